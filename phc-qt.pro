@@ -201,6 +201,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/editaddressdialog.h \
     src/qt/bitcoinaddressvalidator.h \
     src/alert.h \
+    src/checkqueue.h \
+    src/blockfile.h \
+    src/leveldbbatch.h \
     src/allocators.h \
     src/addrman.h \
     src/base58.h \
@@ -228,6 +231,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/db.h \
     src/txdb.h \
     src/txmempool.h \
+    src/memusage.h \
     src/walletdb.h \
     src/script.h \
     src/scrypt.h \
@@ -328,6 +332,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/editaddressdialog.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/alert.cpp \
+    src/blockfile.cpp \
     src/allocators.cpp \
     src/base58.cpp \
     src/chainparams.cpp \
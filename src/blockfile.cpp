@@ -0,0 +1,247 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "util.h"
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+CBlockFileCache blockFileCache;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile)
+{
+    string strBlockFn = strprintf("blk%04u.dat", nFile);
+    return GetDataDir() / strBlockFn;
+}
+
+#ifdef WIN32
+CBlockFileHandle::CBlockFileHandle(const boost::filesystem::path& path)
+{
+    file = fopen(path.string().c_str(), "rb");
+}
+
+CBlockFileHandle::~CBlockFileHandle()
+{
+    if (file)
+        fclose(file);
+}
+
+bool CBlockFileHandle::IsNull() const
+{
+    return file == NULL;
+}
+
+int64_t CBlockFileHandle::ReadAt(char* pch, size_t nSize, uint64_t nPos)
+{
+    // No pread here; serialize seek+read on the shared FILE*
+    LOCK(cs);
+    if (_fseeki64(file, nPos, SEEK_SET) != 0)
+        return -1;
+    size_t nRead = fread(pch, 1, nSize, file);
+    if (nRead != nSize && ferror(file))
+    {
+        clearerr(file);
+        return -1;
+    }
+    return nRead;
+}
+
+CBlockFileMappingRef CBlockFileHandle::Map(uint64_t nEnd)
+{
+    return CBlockFileMappingRef();
+}
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+}
+#else
+CBlockFileHandle::CBlockFileHandle(const boost::filesystem::path& path)
+{
+    fd = open(path.string().c_str(), O_RDONLY);
+}
+
+CBlockFileHandle::~CBlockFileHandle()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+bool CBlockFileHandle::IsNull() const
+{
+    return fd < 0;
+}
+
+int64_t CBlockFileHandle::ReadAt(char* pch, size_t nSize, uint64_t nPos)
+{
+    size_t nRead = 0;
+    while (nRead < nSize)
+    {
+        ssize_t n = pread(fd, pch + nRead, nSize - nRead, nPos + nRead);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        nRead += n;
+    }
+    return nRead;
+}
+
+CBlockFileMappingRef CBlockFileHandle::Map(uint64_t nEnd)
+{
+    // Mapping whole 2GB block files is only reasonable with a 64-bit address space
+    if (sizeof(void*) < 8)
+        return CBlockFileMappingRef();
+
+    LOCK(csMapping);
+    if (mapping && mapping->size() >= nEnd)
+        return mapping;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < nEnd || st.st_size == 0)
+        return CBlockFileMappingRef();
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return CBlockFileMappingRef();
+    madvise(p, st.st_size, MADV_RANDOM);
+
+    // Readers of a previous, shorter mapping keep it alive until they finish
+    mapping.reset(new CBlockFileMapping((char*)p, st.st_size));
+    return mapping;
+}
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+    munmap(pBegin, nLength);
+}
+#endif
+
+CBlockFileHandleRef CBlockFileCache::Get(unsigned int nFile)
+{
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return CBlockFileHandleRef();
+
+    {
+        LOCK(cs);
+        handle_map::iterator mi = mapOpen.find(nFile);
+        if (mi != mapOpen.end())
+        {
+            lru.splice(lru.begin(), lru, mi->second.second);
+            return mi->second.first;
+        }
+    }
+
+    // Open outside the lock so a slow open doesn't hold up readers of
+    // files that are already cached
+    CBlockFileHandleRef handle(new CBlockFileHandle(BlockFilePath(nFile)));
+    if (handle->IsNull())
+        return CBlockFileHandleRef();
+
+    LOCK(cs);
+    handle_map::iterator mi = mapOpen.find(nFile);
+    if (mi != mapOpen.end())
+    {
+        // Another thread got there first; use its handle
+        lru.splice(lru.begin(), lru, mi->second.second);
+        return mi->second.first;
+    }
+    lru.push_front(nFile);
+    mapOpen[nFile] = make_pair(handle, lru.begin());
+    while (mapOpen.size() > nMaxOpen)
+    {
+        // Readers still holding the evicted handle keep it open until they finish
+        mapOpen.erase(lru.back());
+        lru.pop_back();
+    }
+    return handle;
+}
+
+void CBlockFileCache::Clear()
+{
+    LOCK(cs);
+    mapOpen.clear();
+    lru.clear();
+}
+
+bool ReadBlockBytes(unsigned int nFile, unsigned int nBlockPos, CBlockDiskView& view)
+{
+    CBlockFileHandleRef handle = blockFileCache.Get(nFile);
+    if (!handle || nBlockPos < sizeof(unsigned int))
+        return false;
+
+    // The block is preceded by its serialized size
+    unsigned char buf[sizeof(unsigned int)];
+    if (handle->ReadAt((char*)buf, sizeof(buf), nBlockPos - sizeof(buf)) != (int64_t)sizeof(buf))
+        return false;
+    unsigned int nSize = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((unsigned int)buf[3] << 24);
+    if (nSize < 80 || nSize > MAX_SIZE)
+        return false;
+
+    view.mapping = handle->Map((uint64_t)nBlockPos + nSize);
+    if (view.mapping)
+    {
+        view.vchCopy.clear();
+        view.pBegin = view.mapping->begin() + nBlockPos;
+        view.nSize = nSize;
+        return true;
+    }
+
+    view.vchCopy.resize(nSize);
+    if (handle->ReadAt(&view.vchCopy[0], nSize, nBlockPos) != (int64_t)nSize)
+        return false;
+    view.pBegin = &view.vchCopy[0];
+    view.nSize = nSize;
+    return true;
+}
+
+CBlockFileReader& CBlockFileReader::read(char* pch, size_t nSize)
+{
+    if (!handle)
+        throw std::ios_base::failure("CBlockFileReader::read : file handle is NULL");
+
+    while (nSize > 0)
+    {
+        if (nBufPos == nBufEnd)
+        {
+            nReadPos += nBufEnd;
+            nBufPos = nBufEnd = 0;
+            if (nSize >= BUFFER_SIZE)
+            {
+                // Large field: read it in place rather than through the buffer
+                int64_t nRead = handle->ReadAt(pch, nSize, nReadPos);
+                if (nRead < 0)
+                    throw std::ios_base::failure("CBlockFileReader::read : read failed");
+                if ((size_t)nRead != nSize)
+                    throw std::ios_base::failure("CBlockFileReader::read : end of file");
+                nReadPos += nSize;
+                return (*this);
+            }
+            int64_t nRead = handle->ReadAt(vchBuf, BUFFER_SIZE, nReadPos);
+            if (nRead < 0)
+                throw std::ios_base::failure("CBlockFileReader::read : read failed");
+            if (nRead == 0)
+                throw std::ios_base::failure("CBlockFileReader::read : end of file");
+            nBufEnd = nRead;
+        }
+        size_t nChunk = std::min(nSize, nBufEnd - nBufPos);
+        memcpy(pch, vchBuf + nBufPos, nChunk);
+        nBufPos += nChunk;
+        pch += nChunk;
+        nSize -= nChunk;
+    }
+    return (*this);
+}
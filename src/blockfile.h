@@ -0,0 +1,180 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Maximum number of block files kept open for reading at once */
+static const unsigned int MAX_OPEN_BLOCK_FILES = 64;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile);
+
+/** Read-only memory map of a whole block file. The region is unmapped when
+ *  the last reference to it is released. */
+class CBlockFileMapping
+{
+private:
+    char* pBegin;
+    size_t nLength;
+
+    CBlockFileMapping(const CBlockFileMapping&);
+    CBlockFileMapping& operator=(const CBlockFileMapping&);
+
+public:
+    CBlockFileMapping(char* pBeginIn, size_t nLengthIn) : pBegin(pBeginIn), nLength(nLengthIn) {}
+    ~CBlockFileMapping();
+
+    const char* begin() const   { return pBegin; }
+    size_t size() const         { return nLength; }
+};
+
+typedef boost::shared_ptr<CBlockFileMapping> CBlockFileMappingRef;
+
+/** A read-only handle on one blkNNNN.dat file.
+ *
+ * Reads are positional, so any number of threads can read through the same
+ * handle at the same time without seeking. The descriptor is closed when the
+ * last reference goes away, which may be after the handle has been evicted
+ * from the cache.
+ */
+class CBlockFileHandle
+{
+private:
+#ifdef WIN32
+    FILE* file;
+    CCriticalSection cs;
+#else
+    int fd;
+    CCriticalSection csMapping;
+    CBlockFileMappingRef mapping;
+#endif
+
+    CBlockFileHandle(const CBlockFileHandle&);
+    CBlockFileHandle& operator=(const CBlockFileHandle&);
+
+public:
+    CBlockFileHandle(const boost::filesystem::path& path);
+    ~CBlockFileHandle();
+
+    bool IsNull() const;
+
+    /** Read up to nSize bytes at nPos. Returns the number of bytes read, which
+     *  is less than nSize only at end of file, or -1 on error. */
+    int64_t ReadAt(char* pch, size_t nSize, uint64_t nPos);
+
+    /** Return a memory map of the file covering at least the first nEnd
+     *  bytes, remapping if the file has grown since it was last mapped.
+     *  Null if mapping is not available. */
+    CBlockFileMappingRef Map(uint64_t nEnd);
+};
+
+typedef boost::shared_ptr<CBlockFileHandle> CBlockFileHandleRef;
+
+/** Bounded LRU cache of open block file handles */
+class CBlockFileCache
+{
+private:
+    typedef std::list<unsigned int> lru_list;
+    typedef std::map<unsigned int, std::pair<CBlockFileHandleRef, lru_list::iterator> > handle_map;
+
+    CCriticalSection cs;
+    unsigned int nMaxOpen;
+    lru_list lru;
+    handle_map mapOpen;
+
+public:
+    CBlockFileCache(unsigned int nMaxOpenIn = MAX_OPEN_BLOCK_FILES) : nMaxOpen(nMaxOpenIn) {}
+
+    /** Return a handle for block file nFile, opening it if needed. The handle
+     *  is null if the file cannot be opened. */
+    CBlockFileHandleRef Get(unsigned int nFile);
+
+    /** Drop every cached handle, e.g. before block files are deleted */
+    void Clear();
+};
+
+extern CBlockFileCache blockFileCache;
+
+/** The serialized bytes of one block exactly as stored on disk, which is
+ *  also its network serialization. Points into a memory map of the block
+ *  file when possible, otherwise into a private copy. */
+class CBlockDiskView
+{
+private:
+    CBlockFileMappingRef mapping;
+    std::vector<char> vchCopy;
+    const char* pBegin;
+    size_t nSize;
+
+public:
+    CBlockDiskView() : pBegin(NULL), nSize(0) {}
+
+    const char* begin() const   { return pBegin; }
+    const char* end() const     { return pBegin + nSize; }
+    size_t size() const         { return nSize; }
+
+    friend bool ReadBlockBytes(unsigned int nFile, unsigned int nBlockPos, CBlockDiskView& view);
+};
+
+/** Fill view with the raw bytes of the block stored at (nFile, nBlockPos)
+ *  without deserializing it */
+bool ReadBlockBytes(unsigned int nFile, unsigned int nBlockPos, CBlockDiskView& view);
+
+/** Deserialization stream over positional reads of a block file.
+ *
+ * Small reads are served from an internal buffer, so deserializing a typical
+ * transaction costs one or two system calls; reads larger than the buffer go
+ * straight into the destination.
+ */
+class CBlockFileReader
+{
+private:
+    static const size_t BUFFER_SIZE = 4096;
+
+    CBlockFileHandleRef handle;
+    uint64_t nReadPos;      // file position of vchBuf[0]
+    size_t nBufPos;         // next unread byte in vchBuf
+    size_t nBufEnd;         // end of valid data in vchBuf
+    char vchBuf[BUFFER_SIZE];
+
+public:
+    int nType;
+    int nVersion;
+
+    CBlockFileReader(unsigned int nFile, uint64_t nPos, int nTypeIn, int nVersionIn)
+    {
+        handle = blockFileCache.Get(nFile);
+        nReadPos = nPos;
+        nBufPos = 0;
+        nBufEnd = 0;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    bool IsNull() const         { return !handle; }
+
+    CBlockFileReader& read(char* pch, size_t nSize);
+
+    template<typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        if (!handle)
+            throw std::ios_base::failure("CBlockFileReader::operator>> : file handle is NULL");
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+#endif
@@ -65,7 +65,7 @@ public:
         vAlertPubKey = ParseHex("045ae8e09a456a2ae88f9a2fdb99122612cd26f9da329731b1b8335f650978c9d21df0a0543ba1179d05a081c3c1ec389ce2bb55e36565b50ab40dde6b19d136e1");
         nDefaultPort = 20060;
         nRPCPort = 20061;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 16);
+        bnProofOfWorkLimit = arith_uint256(~uint256(0) >> 16);
 
         // Build the genesis block. Note that the output of the genesis coinbase cannot
         // be spent as it did not originally exist in the database.
@@ -106,7 +106,7 @@ public:
         hashGenesisBlock = uint256("0x01");
         if (true && (genesis.GetHash() != hashGenesisBlock))
         {
-            uint256 hashTarget = CBigNum().SetCompact(genesis.nBits).getuint256();
+            uint256 hashTarget = arith_uint256().SetCompact(genesis.nBits);
             while (genesis.GetHash() > hashTarget)
             {
                 ++genesis.nNonce;
@@ -302,7 +302,7 @@ public:
         pchMessageStart[1] = 0x33;
         pchMessageStart[2] = 0x25;
         pchMessageStart[3] = 0x75;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 16);
+        bnProofOfWorkLimit = arith_uint256(~uint256(0) >> 16);
         vAlertPubKey = ParseHex("04344278bdac5f6e1e1711a3672a5002e54369b984c97df9d36e5aa2123dec228e85da0b88f3a38ba62746a1ca20726dd73a806767620c830ffb99ab1e6c45a778");
         nDefaultPort = 20062;
         nRPCPort = 20063;
@@ -336,7 +336,7 @@ public:
         hashGenesisBlock = uint256("0x01");
         if (true && (genesis.GetHash() != hashGenesisBlock))
         {
-            uint256 hashTarget = CBigNum().SetCompact(genesis.nBits).getuint256();
+            uint256 hashTarget = arith_uint256().SetCompact(genesis.nBits);
             while (genesis.GetHash() > hashTarget)
             {
                 ++genesis.nNonce;
@@ -8,6 +8,14 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define SHA256_HAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -43,80 +51,265 @@ void inline Initialize(uint32_t* s)
     s[7] = 0x5be0cd19ul;
 }
 
-/** Perform one SHA-256 transformation, processing a 64-byte chunk. */
-void Transform(uint32_t* s, const unsigned char* chunk)
-{
-    uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
-    uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
-
-    Round(a, b, c, d, e, f, g, h, 0x428a2f98, w0 = ReadBE32(chunk + 0));
-    Round(h, a, b, c, d, e, f, g, 0x71374491, w1 = ReadBE32(chunk + 4));
-    Round(g, h, a, b, c, d, e, f, 0xb5c0fbcf, w2 = ReadBE32(chunk + 8));
-    Round(f, g, h, a, b, c, d, e, 0xe9b5dba5, w3 = ReadBE32(chunk + 12));
-    Round(e, f, g, h, a, b, c, d, 0x3956c25b, w4 = ReadBE32(chunk + 16));
-    Round(d, e, f, g, h, a, b, c, 0x59f111f1, w5 = ReadBE32(chunk + 20));
-    Round(c, d, e, f, g, h, a, b, 0x923f82a4, w6 = ReadBE32(chunk + 24));
-    Round(b, c, d, e, f, g, h, a, 0xab1c5ed5, w7 = ReadBE32(chunk + 28));
-    Round(a, b, c, d, e, f, g, h, 0xd807aa98, w8 = ReadBE32(chunk + 32));
-    Round(h, a, b, c, d, e, f, g, 0x12835b01, w9 = ReadBE32(chunk + 36));
-    Round(g, h, a, b, c, d, e, f, 0x243185be, w10 = ReadBE32(chunk + 40));
-    Round(f, g, h, a, b, c, d, e, 0x550c7dc3, w11 = ReadBE32(chunk + 44));
-    Round(e, f, g, h, a, b, c, d, 0x72be5d74, w12 = ReadBE32(chunk + 48));
-    Round(d, e, f, g, h, a, b, c, 0x80deb1fe, w13 = ReadBE32(chunk + 52));
-    Round(c, d, e, f, g, h, a, b, 0x9bdc06a7, w14 = ReadBE32(chunk + 56));
-    Round(b, c, d, e, f, g, h, a, 0xc19bf174, w15 = ReadBE32(chunk + 60));
-
-    Round(a, b, c, d, e, f, g, h, 0xe49b69c1, w0 += sigma1(w14) + w9 + sigma0(w1));
-    Round(h, a, b, c, d, e, f, g, 0xefbe4786, w1 += sigma1(w15) + w10 + sigma0(w2));
-    Round(g, h, a, b, c, d, e, f, 0x0fc19dc6, w2 += sigma1(w0) + w11 + sigma0(w3));
-    Round(f, g, h, a, b, c, d, e, 0x240ca1cc, w3 += sigma1(w1) + w12 + sigma0(w4));
-    Round(e, f, g, h, a, b, c, d, 0x2de92c6f, w4 += sigma1(w2) + w13 + sigma0(w5));
-    Round(d, e, f, g, h, a, b, c, 0x4a7484aa, w5 += sigma1(w3) + w14 + sigma0(w6));
-    Round(c, d, e, f, g, h, a, b, 0x5cb0a9dc, w6 += sigma1(w4) + w15 + sigma0(w7));
-    Round(b, c, d, e, f, g, h, a, 0x76f988da, w7 += sigma1(w5) + w0 + sigma0(w8));
-    Round(a, b, c, d, e, f, g, h, 0x983e5152, w8 += sigma1(w6) + w1 + sigma0(w9));
-    Round(h, a, b, c, d, e, f, g, 0xa831c66d, w9 += sigma1(w7) + w2 + sigma0(w10));
-    Round(g, h, a, b, c, d, e, f, 0xb00327c8, w10 += sigma1(w8) + w3 + sigma0(w11));
-    Round(f, g, h, a, b, c, d, e, 0xbf597fc7, w11 += sigma1(w9) + w4 + sigma0(w12));
-    Round(e, f, g, h, a, b, c, d, 0xc6e00bf3, w12 += sigma1(w10) + w5 + sigma0(w13));
-    Round(d, e, f, g, h, a, b, c, 0xd5a79147, w13 += sigma1(w11) + w6 + sigma0(w14));
-    Round(c, d, e, f, g, h, a, b, 0x06ca6351, w14 += sigma1(w12) + w7 + sigma0(w15));
-    Round(b, c, d, e, f, g, h, a, 0x14292967, w15 += sigma1(w13) + w8 + sigma0(w0));
-
-    Round(a, b, c, d, e, f, g, h, 0x27b70a85, w0 += sigma1(w14) + w9 + sigma0(w1));
-    Round(h, a, b, c, d, e, f, g, 0x2e1b2138, w1 += sigma1(w15) + w10 + sigma0(w2));
-    Round(g, h, a, b, c, d, e, f, 0x4d2c6dfc, w2 += sigma1(w0) + w11 + sigma0(w3));
-    Round(f, g, h, a, b, c, d, e, 0x53380d13, w3 += sigma1(w1) + w12 + sigma0(w4));
-    Round(e, f, g, h, a, b, c, d, 0x650a7354, w4 += sigma1(w2) + w13 + sigma0(w5));
-    Round(d, e, f, g, h, a, b, c, 0x766a0abb, w5 += sigma1(w3) + w14 + sigma0(w6));
-    Round(c, d, e, f, g, h, a, b, 0x81c2c92e, w6 += sigma1(w4) + w15 + sigma0(w7));
-    Round(b, c, d, e, f, g, h, a, 0x92722c85, w7 += sigma1(w5) + w0 + sigma0(w8));
-    Round(a, b, c, d, e, f, g, h, 0xa2bfe8a1, w8 += sigma1(w6) + w1 + sigma0(w9));
-    Round(h, a, b, c, d, e, f, g, 0xa81a664b, w9 += sigma1(w7) + w2 + sigma0(w10));
-    Round(g, h, a, b, c, d, e, f, 0xc24b8b70, w10 += sigma1(w8) + w3 + sigma0(w11));
-    Round(f, g, h, a, b, c, d, e, 0xc76c51a3, w11 += sigma1(w9) + w4 + sigma0(w12));
-    Round(e, f, g, h, a, b, c, d, 0xd192e819, w12 += sigma1(w10) + w5 + sigma0(w13));
-    Round(d, e, f, g, h, a, b, c, 0xd6990624, w13 += sigma1(w11) + w6 + sigma0(w14));
-    Round(c, d, e, f, g, h, a, b, 0xf40e3585, w14 += sigma1(w12) + w7 + sigma0(w15));
-    Round(b, c, d, e, f, g, h, a, 0x106aa070, w15 += sigma1(w13) + w8 + sigma0(w0));
-
-    Round(a, b, c, d, e, f, g, h, 0x19a4c116, w0 += sigma1(w14) + w9 + sigma0(w1));
-    Round(h, a, b, c, d, e, f, g, 0x1e376c08, w1 += sigma1(w15) + w10 + sigma0(w2));
-    Round(g, h, a, b, c, d, e, f, 0x2748774c, w2 += sigma1(w0) + w11 + sigma0(w3));
-    Round(f, g, h, a, b, c, d, e, 0x34b0bcb5, w3 += sigma1(w1) + w12 + sigma0(w4));
-    Round(e, f, g, h, a, b, c, d, 0x391c0cb3, w4 += sigma1(w2) + w13 + sigma0(w5));
-    Round(d, e, f, g, h, a, b, c, 0x4ed8aa4a, w5 += sigma1(w3) + w14 + sigma0(w6));
-    Round(c, d, e, f, g, h, a, b, 0x5b9cca4f, w6 += sigma1(w4) + w15 + sigma0(w7));
-    Round(b, c, d, e, f, g, h, a, 0x682e6ff3, w7 += sigma1(w5) + w0 + sigma0(w8));
-    Round(a, b, c, d, e, f, g, h, 0x748f82ee, w8 += sigma1(w6) + w1 + sigma0(w9));
-    Round(h, a, b, c, d, e, f, g, 0x78a5636f, w9 += sigma1(w7) + w2 + sigma0(w10));
-    Round(g, h, a, b, c, d, e, f, 0x84c87814, w10 += sigma1(w8) + w3 + sigma0(w11));
-    Round(f, g, h, a, b, c, d, e, 0x8cc70208, w11 += sigma1(w9) + w4 + sigma0(w12));
-    Round(e, f, g, h, a, b, c, d, 0x90befffa, w12 += sigma1(w10) + w5 + sigma0(w13));
-    Round(d, e, f, g, h, a, b, c, 0xa4506ceb, w13 += sigma1(w11) + w6 + sigma0(w14));
-    Round(c, d, e, f, g, h, a, b, 0xbef9a3f7, w14 + sigma1(w12) + w7 + sigma0(w15));
-    Round(b, c, d, e, f, g, h, a, 0xc67178f2, w15 + sigma1(w13) + w8 + sigma0(w0));
+/** Perform a number of SHA-256 transformations, processing 64-byte chunks. */
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
+
+        Round(a, b, c, d, e, f, g, h, 0x428a2f98, w0 = ReadBE32(chunk + 0));
+        Round(h, a, b, c, d, e, f, g, 0x71374491, w1 = ReadBE32(chunk + 4));
+        Round(g, h, a, b, c, d, e, f, 0xb5c0fbcf, w2 = ReadBE32(chunk + 8));
+        Round(f, g, h, a, b, c, d, e, 0xe9b5dba5, w3 = ReadBE32(chunk + 12));
+        Round(e, f, g, h, a, b, c, d, 0x3956c25b, w4 = ReadBE32(chunk + 16));
+        Round(d, e, f, g, h, a, b, c, 0x59f111f1, w5 = ReadBE32(chunk + 20));
+        Round(c, d, e, f, g, h, a, b, 0x923f82a4, w6 = ReadBE32(chunk + 24));
+        Round(b, c, d, e, f, g, h, a, 0xab1c5ed5, w7 = ReadBE32(chunk + 28));
+        Round(a, b, c, d, e, f, g, h, 0xd807aa98, w8 = ReadBE32(chunk + 32));
+        Round(h, a, b, c, d, e, f, g, 0x12835b01, w9 = ReadBE32(chunk + 36));
+        Round(g, h, a, b, c, d, e, f, 0x243185be, w10 = ReadBE32(chunk + 40));
+        Round(f, g, h, a, b, c, d, e, 0x550c7dc3, w11 = ReadBE32(chunk + 44));
+        Round(e, f, g, h, a, b, c, d, 0x72be5d74, w12 = ReadBE32(chunk + 48));
+        Round(d, e, f, g, h, a, b, c, 0x80deb1fe, w13 = ReadBE32(chunk + 52));
+        Round(c, d, e, f, g, h, a, b, 0x9bdc06a7, w14 = ReadBE32(chunk + 56));
+        Round(b, c, d, e, f, g, h, a, 0xc19bf174, w15 = ReadBE32(chunk + 60));
+
+        Round(a, b, c, d, e, f, g, h, 0xe49b69c1, w0 += sigma1(w14) + w9 + sigma0(w1));
+        Round(h, a, b, c, d, e, f, g, 0xefbe4786, w1 += sigma1(w15) + w10 + sigma0(w2));
+        Round(g, h, a, b, c, d, e, f, 0x0fc19dc6, w2 += sigma1(w0) + w11 + sigma0(w3));
+        Round(f, g, h, a, b, c, d, e, 0x240ca1cc, w3 += sigma1(w1) + w12 + sigma0(w4));
+        Round(e, f, g, h, a, b, c, d, 0x2de92c6f, w4 += sigma1(w2) + w13 + sigma0(w5));
+        Round(d, e, f, g, h, a, b, c, 0x4a7484aa, w5 += sigma1(w3) + w14 + sigma0(w6));
+        Round(c, d, e, f, g, h, a, b, 0x5cb0a9dc, w6 += sigma1(w4) + w15 + sigma0(w7));
+        Round(b, c, d, e, f, g, h, a, 0x76f988da, w7 += sigma1(w5) + w0 + sigma0(w8));
+        Round(a, b, c, d, e, f, g, h, 0x983e5152, w8 += sigma1(w6) + w1 + sigma0(w9));
+        Round(h, a, b, c, d, e, f, g, 0xa831c66d, w9 += sigma1(w7) + w2 + sigma0(w10));
+        Round(g, h, a, b, c, d, e, f, 0xb00327c8, w10 += sigma1(w8) + w3 + sigma0(w11));
+        Round(f, g, h, a, b, c, d, e, 0xbf597fc7, w11 += sigma1(w9) + w4 + sigma0(w12));
+        Round(e, f, g, h, a, b, c, d, 0xc6e00bf3, w12 += sigma1(w10) + w5 + sigma0(w13));
+        Round(d, e, f, g, h, a, b, c, 0xd5a79147, w13 += sigma1(w11) + w6 + sigma0(w14));
+        Round(c, d, e, f, g, h, a, b, 0x06ca6351, w14 += sigma1(w12) + w7 + sigma0(w15));
+        Round(b, c, d, e, f, g, h, a, 0x14292967, w15 += sigma1(w13) + w8 + sigma0(w0));
+
+        Round(a, b, c, d, e, f, g, h, 0x27b70a85, w0 += sigma1(w14) + w9 + sigma0(w1));
+        Round(h, a, b, c, d, e, f, g, 0x2e1b2138, w1 += sigma1(w15) + w10 + sigma0(w2));
+        Round(g, h, a, b, c, d, e, f, 0x4d2c6dfc, w2 += sigma1(w0) + w11 + sigma0(w3));
+        Round(f, g, h, a, b, c, d, e, 0x53380d13, w3 += sigma1(w1) + w12 + sigma0(w4));
+        Round(e, f, g, h, a, b, c, d, 0x650a7354, w4 += sigma1(w2) + w13 + sigma0(w5));
+        Round(d, e, f, g, h, a, b, c, 0x766a0abb, w5 += sigma1(w3) + w14 + sigma0(w6));
+        Round(c, d, e, f, g, h, a, b, 0x81c2c92e, w6 += sigma1(w4) + w15 + sigma0(w7));
+        Round(b, c, d, e, f, g, h, a, 0x92722c85, w7 += sigma1(w5) + w0 + sigma0(w8));
+        Round(a, b, c, d, e, f, g, h, 0xa2bfe8a1, w8 += sigma1(w6) + w1 + sigma0(w9));
+        Round(h, a, b, c, d, e, f, g, 0xa81a664b, w9 += sigma1(w7) + w2 + sigma0(w10));
+        Round(g, h, a, b, c, d, e, f, 0xc24b8b70, w10 += sigma1(w8) + w3 + sigma0(w11));
+        Round(f, g, h, a, b, c, d, e, 0xc76c51a3, w11 += sigma1(w9) + w4 + sigma0(w12));
+        Round(e, f, g, h, a, b, c, d, 0xd192e819, w12 += sigma1(w10) + w5 + sigma0(w13));
+        Round(d, e, f, g, h, a, b, c, 0xd6990624, w13 += sigma1(w11) + w6 + sigma0(w14));
+        Round(c, d, e, f, g, h, a, b, 0xf40e3585, w14 += sigma1(w12) + w7 + sigma0(w15));
+        Round(b, c, d, e, f, g, h, a, 0x106aa070, w15 += sigma1(w13) + w8 + sigma0(w0));
+
+        Round(a, b, c, d, e, f, g, h, 0x19a4c116, w0 += sigma1(w14) + w9 + sigma0(w1));
+        Round(h, a, b, c, d, e, f, g, 0x1e376c08, w1 += sigma1(w15) + w10 + sigma0(w2));
+        Round(g, h, a, b, c, d, e, f, 0x2748774c, w2 += sigma1(w0) + w11 + sigma0(w3));
+        Round(f, g, h, a, b, c, d, e, 0x34b0bcb5, w3 += sigma1(w1) + w12 + sigma0(w4));
+        Round(e, f, g, h, a, b, c, d, 0x391c0cb3, w4 += sigma1(w2) + w13 + sigma0(w5));
+        Round(d, e, f, g, h, a, b, c, 0x4ed8aa4a, w5 += sigma1(w3) + w14 + sigma0(w6));
+        Round(c, d, e, f, g, h, a, b, 0x5b9cca4f, w6 += sigma1(w4) + w15 + sigma0(w7));
+        Round(b, c, d, e, f, g, h, a, 0x682e6ff3, w7 += sigma1(w5) + w0 + sigma0(w8));
+        Round(a, b, c, d, e, f, g, h, 0x748f82ee, w8 += sigma1(w6) + w1 + sigma0(w9));
+        Round(h, a, b, c, d, e, f, g, 0x78a5636f, w9 += sigma1(w7) + w2 + sigma0(w10));
+        Round(g, h, a, b, c, d, e, f, 0x84c87814, w10 += sigma1(w8) + w3 + sigma0(w11));
+        Round(f, g, h, a, b, c, d, e, 0x8cc70208, w11 += sigma1(w9) + w4 + sigma0(w12));
+        Round(e, f, g, h, a, b, c, d, 0x90befffa, w12 += sigma1(w10) + w5 + sigma0(w13));
+        Round(d, e, f, g, h, a, b, c, 0xa4506ceb, w13 += sigma1(w11) + w6 + sigma0(w14));
+        Round(c, d, e, f, g, h, a, b, 0xbef9a3f7, w14 + sigma1(w12) + w7 + sigma0(w15));
+        Round(b, c, d, e, f, g, h, a, 0xc67178f2, w15 + sigma1(w13) + w8 + sigma0(w0));
+
+        s[0] += a;
+        s[1] += b;
+        s[2] += c;
+        s[3] += d;
+        s[4] += e;
+        s[5] += f;
+        s[6] += g;
+        s[7] += h;
+        chunk += 64;
+    }
+}
+
+} // namespace sha256
+
+/** Round constants, for the transforms that load them from memory. */
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t IV[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+/** The padding block that follows a 64-byte message. */
+const unsigned char PAD64[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00};
+
+/** The second half of the only block of a 32-byte message. */
+const unsigned char PAD32[32] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x00};
+
+const unsigned char ZERO[64] = {0};
+
+typedef void (*TransformFn)(uint32_t* s, const unsigned char* chunk, size_t blocks);
+
+/** Double SHA-256 of one 64-byte input with a single-state transform. */
+void TransformD64(TransformFn transform, unsigned char* out, const unsigned char* in)
+{
+    uint32_t s[8];
+    unsigned char buf[64];
+    memcpy(s, IV, sizeof(s));
+    transform(s, in, 1);
+    transform(s, PAD64, 1);
+    for (int k = 0; k < 8; k++)
+        WriteBE32(buf + 4 * k, s[k]);
+    memcpy(buf + 32, PAD32, 32);
+    memcpy(s, IV, sizeof(s));
+    transform(s, buf, 1);
+    for (int k = 0; k < 8; k++)
+        WriteBE32(out + 4 * k, s[k]);
+}
+
+#ifdef SHA256_HAVE_X86_DISPATCH
+/* SHA-NI transform. The state is kept in the ABEF/CDGH order the
+   sha256rnds2 instruction works on, four rounds per pair of calls. */
+#define SHANI_INLINE static inline __attribute__((always_inline, target("sha,sse4.1")))
+
+SHANI_INLINE void QuadRound(__m128i& s0, __m128i& s1, __m128i m, int i)
+{
+    const __m128i msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&K[i]));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+SHANI_INLINE void ShiftMessageA(__m128i& m0, __m128i m1)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+}
+
+SHANI_INLINE void ShiftMessageC(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1);
+}
 
+SHANI_INLINE void ShiftMessageB(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    ShiftMessageC(m0, m1, m2);
+    ShiftMessageA(m0, m1);
+}
+
+__attribute__((target("sha,sse4.1")))
+void Transform_shani(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+    __m128i m0, m1, m2, m3, s0, s1, so0, so1, t1, t2;
+
+    t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xB1);
+    t2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(s + 4)), 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+
+    while (blocks--) {
+        so0 = s0;
+        so1 = s1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)chunk), mask);
+        QuadRound(s0, s1, m0, 0);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16)), mask);
+        QuadRound(s0, s1, m1, 4);
+        ShiftMessageA(m0, m1);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 32)), mask);
+        QuadRound(s0, s1, m2, 8);
+        ShiftMessageA(m1, m2);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 48)), mask);
+        QuadRound(s0, s1, m3, 12);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(s0, s1, m0, 16);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(s0, s1, m1, 20);
+        ShiftMessageB(m0, m1, m2);
+        QuadRound(s0, s1, m2, 24);
+        ShiftMessageB(m1, m2, m3);
+        QuadRound(s0, s1, m3, 28);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(s0, s1, m0, 32);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(s0, s1, m1, 36);
+        ShiftMessageB(m0, m1, m2);
+        QuadRound(s0, s1, m2, 40);
+        ShiftMessageB(m1, m2, m3);
+        QuadRound(s0, s1, m3, 44);
+        ShiftMessageB(m2, m3, m0);
+        QuadRound(s0, s1, m0, 48);
+        ShiftMessageB(m3, m0, m1);
+        QuadRound(s0, s1, m1, 52);
+        ShiftMessageC(m0, m1, m2);
+        QuadRound(s0, s1, m2, 56);
+        ShiftMessageC(m1, m2, m3);
+        QuadRound(s0, s1, m3, 60);
+
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+        chunk += 64;
+    }
+
+    t1 = _mm_shuffle_epi32(s0, 0x1B);
+    t2 = _mm_shuffle_epi32(s1, 0xB1);
+    _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(t1, t2, 0xF0));
+    _mm_storeu_si128((__m128i*)(s + 4), _mm_alignr_epi8(t2, t1, 0x08));
+}
+#undef SHANI_INLINE
+#endif
+
+/* Multi-lane transforms: LANES independent states side by side, word k of
+   every lane held in one vector, the same layout scrypt's lane cores use.
+   They cannot speed up one long message, but hashing many short ones - the
+   64-byte pairs of a merkle level, or a block's transactions - is what
+   they are for. Built on GCC vector extensions; the 8-lane version is also
+   compiled for AVX2 and picked at run time when the CPU has it. */
+#if defined(__GNUC__)
+#define SHA256_LANES_MAX 8
+
+typedef uint32_t sha256_v4 __attribute__((vector_size(16)));
+typedef uint32_t sha256_v8 __attribute__((vector_size(32)));
+
+/** One compression of every lane's state s[] with message words w[], which are clobbered */
+template<typename V>
+static inline __attribute__((always_inline)) void TransformLanes(V s[8], V w[16])
+{
+#define R(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16) {
+            V w1 = w[(i + 1) & 15], w14 = w[(i + 14) & 15];
+            w[i & 15] += (R(w14, 17) ^ R(w14, 19) ^ (w14 >> 10)) + w[(i + 9) & 15] + (R(w1, 7) ^ R(w1, 18) ^ (w1 >> 3));
+        }
+        V t1 = h + (R(e, 6) ^ R(e, 11) ^ R(e, 25)) + (g ^ (e & (f ^ g))) + K[i] + w[i & 15];
+        V t2 = (R(a, 2) ^ R(a, 13) ^ R(a, 22)) + ((a & b) | (c & (a | b)));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+#undef R
     s[0] += a;
     s[1] += b;
     s[2] += c;
@@ -127,7 +320,189 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
-} // namespace sha256
+/** One chunk for each lane; s holds 8 words per lane, lane-major */
+template<typename V, int LANES>
+static inline __attribute__((always_inline)) void TransformChunkLanes(uint32_t* s, const unsigned char* const chunks[])
+{
+    V vs[8], w[16];
+    for (int k = 0; k < 8; k++)
+        for (int l = 0; l < LANES; l++)
+            vs[k][l] = s[l * 8 + k];
+    for (int k = 0; k < 16; k++)
+        for (int l = 0; l < LANES; l++)
+            w[k][l] = ReadBE32(chunks[l] + 4 * k);
+    TransformLanes<V>(vs, w);
+    for (int k = 0; k < 8; k++)
+        for (int l = 0; l < LANES; l++)
+            s[l * 8 + k] = vs[k][l];
+}
+
+/** Double SHA-256 of LANES consecutive 64-byte inputs. The padding blocks
+    are the same for every input, so they are set up as constants. */
+template<typename V, int LANES>
+static inline __attribute__((always_inline)) void TransformD64Lanes(unsigned char* out, const unsigned char* in)
+{
+    V s[8], w[16];
+    for (int k = 0; k < 8; k++)
+        s[k] = V() + IV[k];
+    for (int k = 0; k < 16; k++)
+        for (int l = 0; l < LANES; l++)
+            w[k][l] = ReadBE32(in + 64 * l + 4 * k);
+    TransformLanes<V>(s, w);
+
+    w[0] = V() + 0x80000000;
+    for (int k = 1; k < 15; k++)
+        w[k] = V();
+    w[15] = V() + 0x200;
+    TransformLanes<V>(s, w);
+
+    for (int k = 0; k < 8; k++) {
+        w[k] = s[k];
+        s[k] = V() + IV[k];
+    }
+    w[8] = V() + 0x80000000;
+    for (int k = 9; k < 15; k++)
+        w[k] = V();
+    w[15] = V() + 0x100;
+    TransformLanes<V>(s, w);
+
+    for (int k = 0; k < 8; k++)
+        for (int l = 0; l < LANES; l++)
+            WriteBE32(out + 32 * l + 4 * k, s[k][l]);
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SHA256_HAVE_4WAY
+void TransformChunk_4way(uint32_t* s, const unsigned char* const chunks[])
+{
+    TransformChunkLanes<sha256_v4, 4>(s, chunks);
+}
+
+void TransformD64_4way(unsigned char* out, const unsigned char* in)
+{
+    TransformD64Lanes<sha256_v4, 4>(out, in);
+}
+#endif
+
+#ifdef SHA256_HAVE_X86_DISPATCH
+__attribute__((target("avx2")))
+void TransformChunk_8way_avx2(uint32_t* s, const unsigned char* const chunks[])
+{
+    TransformChunkLanes<sha256_v8, 8>(s, chunks);
+}
+
+__attribute__((target("avx2")))
+void TransformD64_8way_avx2(unsigned char* out, const unsigned char* in)
+{
+    TransformD64Lanes<sha256_v8, 8>(out, in);
+}
+#endif
+#else
+#define SHA256_LANES_MAX 1
+#endif
+
+typedef void (*TransformChunkLanesFn)(uint32_t* s, const unsigned char* const chunks[]);
+typedef void (*TransformD64LanesFn)(unsigned char* out, const unsigned char* in);
+
+struct sha256_engine
+{
+    TransformFn transform;
+    TransformChunkLanesFn transform_lanes;
+    TransformD64LanesFn transform_d64;
+    int nLanes;
+    bool fLanesForBatch;
+    const char* pszName;
+};
+
+/* The SHA extensions give the fastest single-message transform. On CPUs
+   that also have AVX2, eight lanes still beat them on 64-byte inputs, but
+   not on longer ones once the lanes' extra loads and stores are counted. */
+sha256_engine sha256_select_engine()
+{
+    sha256_engine engine;
+    engine.transform = sha256::Transform;
+    engine.transform_lanes = NULL;
+    engine.transform_d64 = NULL;
+    engine.nLanes = 1;
+    engine.fLanesForBatch = false;
+    engine.pszName = "generic";
+#ifdef SHA256_HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    bool fSHANI = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+    if (fSHANI) {
+        engine.transform = Transform_shani;
+        engine.pszName = "shani";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        engine.transform_lanes = TransformChunk_8way_avx2;
+        engine.transform_d64 = TransformD64_8way_avx2;
+        engine.nLanes = 8;
+        engine.fLanesForBatch = !fSHANI;
+        engine.pszName = fSHANI ? "shani,avx2-8way" : "avx2-8way";
+        return engine;
+    }
+    if (fSHANI)
+        return engine;
+#endif
+#ifdef SHA256_HAVE_4WAY
+    engine.transform_lanes = TransformChunk_4way;
+    engine.transform_d64 = TransformD64_4way;
+    engine.nLanes = 4;
+    engine.fLanesForBatch = true;
+    engine.pszName = "simd-4way";
+#endif
+    return engine;
+}
+
+/* Every engine this CPU can run, whether or not it is the one picked, so
+   that the unit tests can check each of them. */
+std::vector<sha256_engine> sha256_list_engines()
+{
+    std::vector<sha256_engine> vEngine;
+    sha256_engine engine = {sha256::Transform, NULL, NULL, 1, false, "generic"};
+    vEngine.push_back(engine);
+#ifdef SHA256_HAVE_4WAY
+    sha256_engine engine4way = {sha256::Transform, TransformChunk_4way, TransformD64_4way, 4, true, "simd-4way"};
+    vEngine.push_back(engine4way);
+#endif
+#ifdef SHA256_HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    bool fSHANI = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+    if (fSHANI) {
+        sha256_engine engineSHANI = {Transform_shani, NULL, NULL, 1, false, "shani"};
+        vEngine.push_back(engineSHANI);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sha256_engine engine8way = {sha256::Transform, TransformChunk_8way_avx2, TransformD64_8way_avx2, 8, true, "avx2-8way"};
+        vEngine.push_back(engine8way);
+        if (fSHANI) {
+            sha256_engine engineBoth = {Transform_shani, TransformChunk_8way_avx2, TransformD64_8way_avx2, 8, false, "shani,avx2-8way"};
+            vEngine.push_back(engineBoth);
+        }
+    }
+#endif
+    return vEngine;
+}
+
+const std::vector<sha256_engine>& sha256_get_engines()
+{
+    static const std::vector<sha256_engine> vEngine = sha256_list_engines();
+    return vEngine;
+}
+
+/* Only set by SHA256ForceEngine, from the unit tests */
+const sha256_engine* pForcedEngine = NULL;
+
+/* Picked on first use rather than at static initialization, since other
+   static initializers (the genesis block's merkle root) already hash. */
+const sha256_engine& sha256_get_engine()
+{
+    static const sha256_engine engine = sha256_select_engine();
+    if (pForcedEngine)
+        return *pForcedEngine;
+    return engine;
+}
+
 } // namespace
 
 
@@ -140,6 +515,7 @@ CSHA256::CSHA256() : bytes(0)
 
 CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
 {
+    const TransformFn transform = sha256_get_engine().transform;
     const unsigned char* end = data + len;
     size_t bufsize = bytes % 64;
     if (bufsize && bufsize + len >= 64) {
@@ -147,14 +523,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        transform(s, data, blocks);
+        bytes += 64 * blocks;
+        data += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +564,141 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+////// Batch hashing
+
+const char* SHA256Engine()
+{
+    return sha256_get_engine().pszName;
+}
+
+const char* SHA256EngineAvailable(size_t i)
+{
+    const std::vector<sha256_engine>& vEngine = sha256_get_engines();
+    return i < vEngine.size() ? vEngine[i].pszName : NULL;
+}
+
+bool SHA256ForceEngine(const char* pszName)
+{
+    if (!pszName) {
+        pForcedEngine = NULL;
+        return true;
+    }
+    const std::vector<sha256_engine>& vEngine = sha256_get_engines();
+    for (size_t i = 0; i < vEngine.size(); i++) {
+        if (strcmp(vEngine[i].pszName, pszName) == 0) {
+            pForcedEngine = &vEngine[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+void SHA256Compress(uint32_t s[8], const unsigned char chunk[64])
+{
+    sha256_get_engine().transform(s, chunk, 1);
+}
+
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+    const sha256_engine& engine = sha256_get_engine();
+    if (engine.transform_d64) {
+        while (blocks >= (size_t)engine.nLanes) {
+            engine.transform_d64(output, input);
+            output += 32 * engine.nLanes;
+            input += 64 * engine.nLanes;
+            blocks -= engine.nLanes;
+        }
+    }
+    while (blocks--) {
+        TransformD64(engine.transform, output, input);
+        output += 32;
+        input += 64;
+    }
+}
+
+namespace
+{
+struct LengthOrder
+{
+    const size_t* lens;
+    bool operator()(size_t a, size_t b) const { return lens[a] < lens[b]; }
+};
+}
+
+void SHA256DBatch(unsigned char* output, const unsigned char* const inputs[], const size_t lens[], size_t n)
+{
+    const sha256_engine& engine = sha256_get_engine();
+    if (!engine.fLanesForBatch || n < 2) {
+        for (size_t i = 0; i < n; i++) {
+            unsigned char hash[CSHA256::OUTPUT_SIZE];
+            CSHA256().Write(inputs[i], lens[i]).Finalize(hash);
+            CSHA256().Write(hash, sizeof(hash)).Finalize(output + 32 * i);
+        }
+        return;
+    }
+
+    // Lanes run in lockstep, so inputs of about the same length share a group
+    std::vector<size_t> vOrder(n);
+    for (size_t i = 0; i < n; i++)
+        vOrder[i] = i;
+    LengthOrder order = {lens};
+    std::stable_sort(vOrder.begin(), vOrder.end(), order);
+
+    const int nLanes = engine.nLanes;
+    unsigned char tail[SHA256_LANES_MAX][128];
+    const unsigned char* chunks[SHA256_LANES_MAX];
+    size_t nFull[SHA256_LANES_MAX], nBlocks[SHA256_LANES_MAX];
+    uint32_t s[SHA256_LANES_MAX * 8], sInner[SHA256_LANES_MAX * 8];
+
+    for (size_t nBegin = 0; nBegin < n; nBegin += nLanes) {
+        size_t nCount = std::min(n - nBegin, (size_t)nLanes);
+        size_t nMaxBlocks = 0;
+        for (int l = 0; l < nLanes; l++) {
+            memcpy(&s[l * 8], IV, sizeof(IV));
+            nFull[l] = nBlocks[l] = 0;
+            if ((size_t)l >= nCount)
+                continue;
+            // Whole chunks are read in place; the rest and the padding go
+            // through a one or two chunk tail
+            size_t i = vOrder[nBegin + l], nLen = lens[i];
+            size_t nRest = nLen % 64;
+            nFull[l] = nLen / 64;
+            nBlocks[l] = nFull[l] + (nRest < 56 ? 1 : 2);
+            memset(tail[l], 0, sizeof(tail[l]));
+            if (nRest)
+                memcpy(tail[l], inputs[i] + 64 * nFull[l], nRest);
+            tail[l][nRest] = 0x80;
+            WriteBE64(tail[l] + 64 * (nBlocks[l] - nFull[l]) - 8, (uint64_t)nLen << 3);
+            nMaxBlocks = std::max(nMaxBlocks, nBlocks[l]);
+        }
+
+        for (size_t b = 0; b < nMaxBlocks; b++) {
+            for (int l = 0; l < nLanes; l++) {
+                if (b < nFull[l])
+                    chunks[l] = inputs[vOrder[nBegin + l]] + 64 * b;
+                else if (b < nBlocks[l])
+                    chunks[l] = tail[l] + 64 * (b - nFull[l]);
+                else
+                    chunks[l] = ZERO;
+            }
+            engine.transform_lanes(s, chunks);
+            for (int l = 0; l < nLanes; l++)
+                if (b + 1 == nBlocks[l])
+                    memcpy(&sInner[l * 8], &s[l * 8], 32);
+        }
+
+        // The second hash is of 32 bytes, one chunk for every lane
+        for (int l = 0; l < nLanes; l++) {
+            for (int k = 0; k < 8; k++)
+                WriteBE32(tail[l] + 4 * k, (size_t)l < nCount ? sInner[l * 8 + k] : 0);
+            memcpy(tail[l] + 32, PAD32, 32);
+            memcpy(&s[l * 8], IV, sizeof(IV));
+            chunks[l] = tail[l];
+        }
+        engine.transform_lanes(s, chunks);
+        for (size_t l = 0; l < nCount; l++)
+            for (int k = 0; k < 8; k++)
+                WriteBE32(output + 32 * vOrder[nBegin + l] + 4 * k, s[l * 8 + k]);
+    }
+}
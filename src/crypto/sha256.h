@@ -25,4 +25,28 @@ public:
     CSHA256& Reset();
 };
 
+/** Name of the SHA-256 implementation picked for this CPU. */
+const char* SHA256Engine();
+
+/** For the unit tests: name of the i-th SHA-256 implementation this CPU can
+ *  run, or NULL past the last one. */
+const char* SHA256EngineAvailable(size_t i);
+
+/** For the unit tests: use the named implementation instead of the one
+ *  picked for this CPU, or go back to that one if pszName is NULL. Not
+ *  safe while other threads hash. Returns false for an unknown name. */
+bool SHA256ForceEngine(const char* pszName);
+
+/** Apply the SHA-256 compression function to state s and one 64-byte
+ *  chunk, for callers that manage their own state (getwork midstates). */
+void SHA256Compress(uint32_t s[8], const unsigned char chunk[64]);
+
+/** Compute the double SHA-256 of blocks independent 64-byte inputs, as
+ *  merkle tree levels need. Writes 32 bytes per input to output. */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Compute the double SHA-256 of n independent inputs of any length, several
+ *  at a time where the CPU allows. Writes 32 bytes per input to output. */
+void SHA256DBatch(unsigned char* output, const unsigned char* const inputs[], const size_t lens[], size_t n);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -398,6 +398,7 @@ void CDarksendPool::SetNull(){
     entries.clear();
     finalTransaction.vin.clear();
     finalTransaction.vout.clear();
+    finalTransaction.InvalidateHash();
     lastTimeChanged = GetTimeMillis();
 
     // -- seed random number generator (used for ordering output lists)
@@ -1086,6 +1087,7 @@ bool CDarksendPool::AddScriptSig(const CTxIn& newVin){
         if(newVin.prevout == vin.prevout && vin.nSequence == newVin.nSequence){
             vin.scriptSig = newVin.scriptSig;
             vin.prevPubKey = newVin.prevPubKey;
+            finalTransaction.InvalidateHash();
             LogPrint("darksend", "CDarksendPool::AddScriptSig -- adding to finalTransaction  %s\n", newVin.scriptSig.ToString().substr(0,24));
         }
     }
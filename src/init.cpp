@@ -9,6 +9,7 @@
 #include "main.h"
 #include "chainparams.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "rpcserver.h"
 #include "net.h"
 #include "key.h"
@@ -16,6 +17,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "kernel.h"
 #include "darksend-relay.h"
 #include "activemasternode.h"
 #include "masternode-payments.h"
@@ -124,8 +126,12 @@ void Shutdown()
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
     DumpMasternodes();
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
     {
         LOCK(cs_main);
+        CTxDB::FlushDeferred();
+        fDeferDBCommits = false;
 #ifdef ENABLE_WALLET
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
@@ -192,7 +198,7 @@ std::string HelpMessage()
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: phcd.pid)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 10)") + "\n";
+    strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes, shared between LevelDB and block index updates batched during initial sync (default: %u)"), DEFAULT_DB_CACHE) + "\n";
     strUsage += "  -dbwalletcache=<n>     " + _("Set wallet database cache size in megabytes (default: 1)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
@@ -268,7 +274,21 @@ std::string HelpMessage()
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "  -addrindex             " + _("Maintain an index of transactions by address (default: 0)") + "\n";
+    strUsage += "  -reindexaddr           " + _("Rebuild the address index from the blk000?.dat files") + "\n";
+    strUsage += "  -reindexaddrthreads=<n> " + strprintf(_("Number of threads used to rebuild the address index (up to %d, default: number of cores)"), MAX_ADDRINDEX_THREADS) + "\n";
+    strUsage += "  -coinscache=<n>        " + strprintf(_("Cache previous transaction outputs used to validate spends, in megabytes (default: %u)"), DEFAULT_COINS_CACHE_SIZE) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Cache valid signatures, in megabytes (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads, also used to load and verify the block index at startup (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanmem=<n>      " + strprintf(_("Keep orphan transactions below <n> megabytes of memory (default: %u)"), DEFAULT_MAX_ORPHAN_MEMORY) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes, evicting the transactions paying the lowest fee rate (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions with <n> or more unconfirmed ancestors in the memory pool (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+    strUsage += "  -limitancestorsize=<n> " + strprintf(_("Do not accept transactions whose unconfirmed ancestors, with them, take more than <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+    strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give a pool transaction <n> or more descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+    strUsage += "  -limitdescendantsize=<n> " + strprintf(_("Do not accept transactions that would grow a pool transaction and its descendants past <n> kilobytes (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Save the transaction memory pool to mempool.dat on shutdown and every %d minutes, and load it again on startup (default: %u)"), DUMP_MEMPOOL_INTERVAL / 60, DEFAULT_PERSIST_MEMPOOL) + "\n";
+    strUsage += "  -headersfirst          " + strprintf(_("Fetch the header chain first during initial sync, then its blocks from all outbound peers at once (default: %u)"), DEFAULT_HEADERS_FIRST) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -303,6 +323,7 @@ strUsage += "\n" + _("Masternode options:") + "\n";
         "  -debugsmsg                               " + _("Log extra debug messages.") + "\n" +
         "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n" +
     strUsage += "  -stakethreshold=<n> " + _("This will set the output size of your stakes to never be below this number (default: 100)") + "\n";
+    strUsage += "  -stakethreads=<n>   " + strprintf(_("Number of threads searching for stake kernels (0 = one per core, default: %d)"), DEFAULT_STAKE_THREADS) + "\n";
 
     return strUsage;
 }
@@ -473,6 +494,25 @@ bool AppInit2(boost::thread_group& threadGroup)
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
 #endif
 
+    // -coinscache is in megabytes; cap it well below what a 32-bit build can address
+    int64_t nCoinsCacheMB = std::min(std::max(GetArg("-coinscache", DEFAULT_COINS_CACHE_SIZE), (int64_t)0), (int64_t)1024);
+    coinsCache.SetMaxUsage((size_t)nCoinsCacheMB << 20);
+
+    // -maxsigcachesize is in megabytes too
+    int64_t nSigCacheMB = std::min(std::max(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0), (int64_t)1024);
+    InitSignatureCache((size_t)nSigCacheMB << 20);
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    fHeadersFirst = GetBoolArg("-headersfirst", DEFAULT_HEADERS_FIRST);
+
     if (mapArgs.count("-timeout"))
     {
         int nNewTimeout = GetArg("-timeout", 5000);
@@ -498,6 +538,12 @@ bool AppInit2(boost::thread_group& threadGroup)
         if (!ParseMoney(mapArgs["-mininput"], nMinimumInputValue))
             return InitError(strprintf(_("Invalid amount for -mininput=<amount>: '%s'"), mapArgs["-mininput"]));
     }
+
+    // -stakethreads=0 means one per core
+    nStakeThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    if (nStakeThreads <= 0)
+        nStakeThreads = boost::thread::hardware_concurrency();
+    nStakeThreads = std::max(1, std::min(nStakeThreads, MAX_STAKE_THREADS));
 #endif
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
@@ -531,12 +577,19 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("PHC version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using SHA-256 engine %s\n", SHA256Engine());
     if (!fLogTimestamps)
         LogPrintf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()));
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string());
     LogPrintf("Used data directory %s\n", strDataDir);
     std::ostringstream strErrors;
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     if (mapArgs.count("-masternodepaymentskey")) // masternode payments priv key
     {
         if (!masternodePayments.SetPrivKey(GetArg("-masternodepaymentskey", "")))
@@ -821,7 +874,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -944,6 +997,8 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        threadGroup.create_thread(boost::bind(&LoopForever<bool (*)()>, "dumpmempool", &DumpMempool, DUMP_MEMPOOL_INTERVAL * 1000));
 
     // ********************************************************* Step 10: load peers
 
@@ -1091,21 +1146,31 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     RandAddSeedPerfmon();
 
-    // reindex addresses found in blockchain
-    if(GetBoolArg("-reindexaddr", false))
+    // convert an address index written by older versions
+    {
+        CTxDB txdbAddr("r+");
+        if (!txdbAddr.MigrateAddrIndex())
+            return InitError(_("Error upgrading address index"));
+    }
+
+    // reindex addresses found in blockchain, or finish an interrupted reindex
     {
-        uiInterface.InitMessage(_("Rebuilding address index..."));
-        CBlockIndex *pblockAddrIndex = pindexBest;
-	CTxDB txdbAddr("rw");
-	while(pblockAddrIndex)
-	{
-	    uiInterface.InitMessage(strprintf("Rebuilding address index, block %i", pblockAddrIndex->nHeight));
-	    bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
-	    CBlock pblockAddr;
-	    if(pblockAddr.ReadFromDisk(pblockAddrIndex, true))
-	        pblockAddr.RebuildAddressIndex(txdbAddr);
-	    pblockAddrIndex = pblockAddrIndex->pprev;
-	}
+        CTxDB txdbAddr("r");
+        int nProgressHeight;
+        uint256 hashProgress;
+        if (GetBoolArg("-reindexaddr", false) || txdbAddr.ReadAddrIndexProgress(nProgressHeight, hashProgress))
+        {
+            uiInterface.InitMessage(_("Rebuilding address index..."));
+            if (!RebuildAddressIndex())
+            {
+                if (fRequestShutdown)
+                {
+                    LogPrintf("Shutdown requested. Exiting.\n");
+                    return false;
+                }
+                return InitError(_("Error rebuilding address index"));
+            }
+        }
     }
 
     //// debug print
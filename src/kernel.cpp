@@ -4,12 +4,17 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "txdb.h"
 
 using namespace std;
 
+int nStakeThreads = DEFAULT_STAKE_THREADS;
+
 extern bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
 
 // Get time weight
@@ -52,46 +57,163 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// A candidate block for stake modifier selection, with what the selection
+// hash needs from it
+struct CModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    uint256 hashProof;
+    bool fProofOfStake;
+    const CBlockIndex* pindex;
+
+    CModifierCandidate(const CBlockIndex* pindexIn) :
+        nTime(pindexIn->GetBlockTime()), hashBlock(pindexIn->GetBlockHash()), hashProof(pindexIn->hashProof),
+        fProofOfStake(pindexIn->IsProofOfStake()), pindex(pindexIn) {}
+
+    // Ordered by timestamp, then block hash
+    bool operator<(const CModifierCandidate& other) const
+    {
+        return nTime < other.nTime || (nTime == other.nTime && hashBlock < other.hashBlock);
+    }
+};
+
+// The candidate blocks of the last modifier computation: the chain segment
+// above pindexBelow up to pindexLast, sorted by timestamp. Successive
+// computations mostly see the same segment with a few blocks added on top
+// and a few dropped at the bottom, so it is moved rather than rebuilt.
+class CModifierCandidateWindow
+{
+private:
+    const CBlockIndex* pindexBelow;
+    const CBlockIndex* pindexLast;
+    vector<CModifierCandidate> vSorted;
+
+    void Add(vector<CModifierCandidate>& vNew)
+    {
+        sort(vNew.begin(), vNew.end());
+        size_t nOld = vSorted.size();
+        vSorted.insert(vSorted.end(), vNew.begin(), vNew.end());
+        inplace_merge(vSorted.begin(), vSorted.begin() + nOld, vSorted.end());
+    }
+
+    // Drop candidates at heights in [nHeightBegin, nHeightEnd]
+    void Remove(int nHeightBegin, int nHeightEnd)
+    {
+        size_t j = 0;
+        for (size_t i = 0; i < vSorted.size(); i++)
+        {
+            int nHeight = vSorted[i].pindex->nHeight;
+            if (nHeight < nHeightBegin || nHeight > nHeightEnd)
+                vSorted[j++] = vSorted[i];
+        }
+        vSorted.erase(vSorted.begin() + j, vSorted.end());
+    }
+
+public:
+    CModifierCandidateWindow() : pindexBelow(NULL), pindexLast(NULL) {}
+
+    // Make the window what walking back from pindexPrev to the first block
+    // older than nSelectionIntervalStart would produce
+    void Update(const CBlockIndex* pindexPrev, int64_t nSelectionIntervalStart)
+    {
+        // Move the top to pindexPrev, reusing the part below the fork with
+        // the chain we had. A fork at or below the bottom, or a jump further
+        // than the window is long, costs as much as starting over.
+        bool fReuse = false;
+        vector<CModifierCandidate> vNew;
+        if (pindexLast)
+        {
+            int nHeightBottom = pindexBelow ? pindexBelow->nHeight + 1 : 0;
+            const CBlockIndex* pindexOld = pindexLast;
+            const CBlockIndex* pindexNew = pindexPrev;
+            while (pindexNew && pindexNew->nHeight > pindexOld->nHeight && vNew.size() <= vSorted.size())
+            {
+                vNew.push_back(CModifierCandidate(pindexNew));
+                pindexNew = pindexNew->pprev;
+            }
+            if (pindexNew && pindexOld->nHeight - pindexNew->nHeight > (int)vSorted.size())
+                pindexOld = NULL;
+            while (pindexOld && pindexNew && pindexOld->nHeight > pindexNew->nHeight)
+                pindexOld = pindexOld->pprev;
+            while (pindexOld && pindexNew && pindexOld != pindexNew && pindexOld->nHeight >= nHeightBottom && vNew.size() <= vSorted.size())
+            {
+                vNew.push_back(CModifierCandidate(pindexNew));
+                pindexOld = pindexOld->pprev;
+                pindexNew = pindexNew->pprev;
+            }
+            if (pindexOld && pindexOld == pindexNew && pindexOld->nHeight >= nHeightBottom)
+            {
+                fReuse = true;
+                Remove(pindexOld->nHeight + 1, pindexLast->nHeight);
+                Add(vNew);
+            }
+        }
+        if (!fReuse)
+        {
+            vSorted.clear();
+            pindexBelow = pindexPrev;
+        }
+        pindexLast = pindexPrev;
+
+        // Move the bottom: drop everything up to the newest block that is
+        // too old, or extend downwards if there is none
+        const CBlockIndex* pindex = pindexLast;
+        while (pindex != pindexBelow && pindex->GetBlockTime() >= nSelectionIntervalStart)
+            pindex = pindex->pprev;
+        if (pindex != pindexBelow)
+        {
+            Remove(pindexBelow ? pindexBelow->nHeight + 1 : 0, pindex->nHeight);
+            pindexBelow = pindex;
+        }
+        else
+        {
+            vNew.clear();
+            while (pindexBelow && pindexBelow->GetBlockTime() >= nSelectionIntervalStart)
+            {
+                vNew.push_back(CModifierCandidate(pindexBelow));
+                pindexBelow = pindexBelow->pprev;
+            }
+            Add(vNew);
+        }
+    }
+
+    const vector<CModifierCandidate>& GetSorted() const { return vSorted; }
+    int GetFirstHeight() const { return pindexBelow ? pindexBelow->nHeight + 1 : 0; }
+};
+
+static CCriticalSection cs_modifierWindow;
+static CModifierCandidateWindow modifierWindow;
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+// already selected blocks in vSelected, and with timestamp up to
+// nSelectionIntervalStop. vHashSelection holds each candidate's selection
+// hash.
+static bool SelectBlockFromCandidates(const vector<CModifierCandidate>& vSortedByTimestamp, const vector<uint256>& vHashSelection,
+    vector<bool>& vSelected, int64_t nSelectionIntervalStop, const CBlockIndex** pindexSelected)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
+    size_t nBest = 0;
     *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    for (size_t i = 0; i < vSortedByTimestamp.size(); i++)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (fSelected && vSortedByTimestamp[i].nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (vSelected[i])
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
-        {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
-        }
-        else if (!fSelected)
+        if (!fSelected || vHashSelection[i] < hashBest)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = vHashSelection[i];
+            nBest = i;
         }
     }
+    if (fSelected)
+    {
+        vSelected[nBest] = true;
+        *pindexSelected = vSortedByTimestamp[nBest].pindex;
+    }
     LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString());
     return fSelected;
 }
@@ -127,37 +249,46 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     if (nModifierTime / nModifierInterval >= pindexPrev->GetBlockTime() / nModifierInterval)
         return true;
 
-    // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * nModifierInterval / TARGET_SPACING);
-
+    // Candidate blocks sorted by timestamp
+    LOCK(cs_modifierWindow);
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
-    const CBlockIndex* pindex = pindexPrev;
-    while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
+    modifierWindow.Update(pindexPrev, nSelectionIntervalStart);
+    const vector<CModifierCandidate>& vSortedByTimestamp = modifierWindow.GetSorted();
+    int nHeightFirstCandidate = modifierWindow.GetFirstHeight();
+
+    // The selection hash of a candidate hashes its proof-hash and the
+    // previous proof-of-stake modifier, so it is the same in every round
+    vector<uint256> vHashSelection(vSortedByTimestamp.size());
+    for (size_t i = 0; i < vSortedByTimestamp.size(); i++)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
-        pindex = pindex->pprev;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << vSortedByTimestamp[i].hashProof << nStakeModifier;
+        vHashSelection[i] = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (vSortedByTimestamp[i].fProofOfStake)
+            vHashSelection[i] >>= 32;
     }
-    int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
+    vector<bool> vSelected(vSortedByTimestamp.size(), false);
+    vector<const CBlockIndex*> vSelectedBlocks;
+    const CBlockIndex* pindex;
     for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, vHashSelection, vSelected, nSelectionIntervalStop, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
         // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        vSelectedBlocks.push_back(pindex);
         LogPrint("stakemodifier", "ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
 
@@ -175,11 +306,11 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CBlockIndex* pindexSelected, vSelectedBlocks)
         {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap);
     }
@@ -190,6 +321,18 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+void GetWeightedTarget(unsigned int nBits, int64_t nValue, arith_uint256& bnTarget, bool& fAlways, bool& fNever)
+{
+    bool fNegative, fOverflow;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    bool fZero = (!fOverflow && bnTarget == 0) || nValue == 0;
+    uint64_t nWeight = nValue < 0 ? -(uint64_t)nValue : (uint64_t)nValue;
+    if (!bnTarget.MulU64(nWeight))
+        fOverflow = true;
+    fNever = !fZero && (fNegative != (nValue < 0));
+    fAlways = !fZero && !fNever && fOverflow;
+}
+
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
@@ -198,16 +341,13 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    // Base target
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-
     // Weighted target
     int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    CBigNum bnWeight = CBigNum(nValueIn);
-    bnTarget *= bnWeight;
+    arith_uint256 bnTarget;
+    bool fAlways, fNever;
+    GetWeightedTarget(nBits, nValueIn, bnTarget, fAlways, fNever);
 
-    targetProofOfStake = bnTarget.getuint256();
+    targetProofOfStake = bnTarget;
 
     uint64_t nStakeModifier = pindexPrev->nStakeModifier;
     int nStakeModifierHeight = pindexPrev->nHeight;
@@ -232,7 +372,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnTarget){
+    if (fNever || (!fAlways && hashProofOfStake > bnTarget)){
          return false;
     }
 
@@ -290,9 +430,38 @@ bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock, int64_t nTimeTx)
 
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
 {
-    uint256 hashProofOfStake, targetProofOfStake;
-
     CTxDB txdb("r");
+    CStakeKernelInput input;
+    if (!stakeKernelCache.Get(txdb, prevout, input))
+        return false;
+
+    if (input.nTimeBlockFrom + nStakeMinAge > nTime)
+        return false; // only count coins meeting min age requirement
+
+    if (pBlockTime)
+        *pBlockTime = input.nTimeBlockFrom;
+
+    if (nTime < input.nTimeTxPrev)
+        return false;
+
+    CStakeKernel kernel(input, pindexPrev->nStakeModifier, nBits);
+    return kernel.Check(nTime);
+}
+
+CStakeKernelCache stakeKernelCache;
+
+bool CStakeKernelCache::Get(CTxDB& txdb, const COutPoint& prevout, CStakeKernelInput& input)
+{
+    {
+        LOCK(cs);
+        std::map<COutPoint, CStakeKernelInput>::const_iterator mi = mapInputs.find(prevout);
+        if (mi != mapInputs.end())
+        {
+            input = mi->second;
+            return true;
+        }
+    }
+
     CTransaction txPrev;
     CTxIndex txindex;
     if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
@@ -303,11 +472,189 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
         return false;
 
-    if (block.GetBlockTime() + nStakeMinAge > nTime)
-        return false; // only count coins meeting min age requirement
+    input.prevout = prevout;
+    input.nTimeBlockFrom = block.GetBlockTime();
+    input.nTimeTxPrev = txPrev.nTime;
+    input.nValue = txPrev.vout[prevout.n].nValue;
 
-    if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+    LOCK(cs);
+    if (mapInputs.size() >= MAX_ENTRIES)
+    {
+        // Evict the neighbour of the new entry
+        std::map<COutPoint, CStakeKernelInput>::iterator mi = mapInputs.lower_bound(prevout);
+        if (mi == mapInputs.end())
+            mi = mapInputs.begin();
+        mapInputs.erase(mi);
+    }
+    mapInputs[prevout] = input;
+    return true;
+}
+
+void CStakeKernelCache::EraseTx(const uint256& hashTx)
+{
+    LOCK(cs);
+    std::map<COutPoint, CStakeKernelInput>::iterator mi = mapInputs.lower_bound(COutPoint(hashTx, 0));
+    while (mi != mapInputs.end() && mi->first.hash == hashTx)
+        mapInputs.erase(mi++);
+}
+
+CStakeKernel::CStakeKernel(const CStakeKernelInput& input, uint64_t nStakeModifier, unsigned int nBits)
+{
+    nTimeBlockFrom = input.nTimeBlockFrom;
+    nTimeTxPrev = input.nTimeTxPrev;
+
+    // Serialized as in CheckStakeKernelHash, with nTimeTx left for Check
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << input.nTimeBlockFrom << input.nTimeTxPrev << input.prevout.hash << input.prevout.n << (unsigned int)0;
+    assert(ss.size() == PREIMAGE_SIZE);
+    memcpy(preimage, &ss[0], PREIMAGE_SIZE);
+
+    // Weighted target, with the cases where it can't be compared as a
+    // 256-bit number folded into fNever and a target of ~0
+    arith_uint256 bnTarget;
+    bool fAlways;
+    GetWeightedTarget(nBits, input.nValue, bnTarget, fAlways, fNever);
+    targetProofOfStake = fAlways ? ~uint256(0) : uint256(bnTarget);
+}
+
+bool CStakeKernel::Check(unsigned int nTimeTx, uint256* phashProofOfStake)
+{
+    if (fNever || nTimeTx < nTimeTxPrev || nTimeBlockFrom + nStakeMinAge > nTimeTx)
+        return false;
+
+    unsigned char* p = preimage + PREIMAGE_SIZE - 4;
+    p[0] = nTimeTx;
+    p[1] = nTimeTx >> 8;
+    p[2] = nTimeTx >> 16;
+    p[3] = nTimeTx >> 24;
+    uint256 hashProofOfStake = Hash(preimage, preimage + PREIMAGE_SIZE);
+    if (phashProofOfStake)
+        *phashProofOfStake = hashProofOfStake;
+
+    return hashProofOfStake <= targetProofOfStake;
+}
+
+// State shared by the threads of one FindStakeKernel call
+struct CStakeSearch
+{
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    const std::vector<COutPoint>* pvCoins;
+    unsigned int nTimeBegin;
+    unsigned int nTimeEnd;
+
+    boost::atomic<bool> fFound;
+    boost::atomic<uint64_t> nKernels;
+    CCriticalSection cs;
+    COutPoint prevoutFound;
+    unsigned int nTimeFound;
+
+    CStakeSearch() : fFound(false), nKernels(0), nTimeFound(0) {}
+};
+
+// Scan every nThreads'th coin starting at nThread over the whole window
+static void StakeSearchThread(CStakeSearch* psearch, int nThread, int nThreads)
+{
+    // Only the calling thread can be interrupted; workers run to completion
+    bool fInterruptible = (nThreads == 1);
+    if (!fInterruptible)
+    {
+        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+        RenameThread("PHC-stake-search");
+    }
+
+    const std::vector<COutPoint>& vCoins = *psearch->pvCoins;
+    uint64_t nStakeModifier = psearch->pindexPrev->nStakeModifier;
+    uint64_t nKernels = 0;
+    CTxDB txdb("r");
+    for (unsigned int i = nThread; i < vCoins.size(); i += nThreads)
+    {
+        if (fInterruptible)
+            boost::this_thread::interruption_point();
+        if (psearch->fFound.load(boost::memory_order_relaxed) || psearch->pindexPrev != pindexBest)
+            break;
+
+        CStakeKernelInput input;
+        if (!stakeKernelCache.Get(txdb, vCoins[i], input))
+            continue;
+        CStakeKernel kernel(input, nStakeModifier, psearch->nBits);
+
+        // Newest timestamp first
+        for (unsigned int nTimeTx = psearch->nTimeEnd; nTimeTx >= psearch->nTimeBegin; nTimeTx -= STAKE_TIMESTAMP_MASK + 1)
+        {
+            nKernels++;
+            if (kernel.Check(nTimeTx))
+            {
+                LOCK(psearch->cs);
+                if (!psearch->fFound.load(boost::memory_order_relaxed))
+                {
+                    psearch->prevoutFound = vCoins[i];
+                    psearch->nTimeFound = nTimeTx;
+                    psearch->fFound.store(true);
+                }
+                break;
+            }
+            if (nTimeTx < STAKE_TIMESTAMP_MASK + 1)
+                break;
+        }
+    }
+    psearch->nKernels.fetch_add(nKernels);
+}
+
+bool FindStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<COutPoint>& vCoins,
+                     unsigned int nTimeBegin, unsigned int nTimeEnd, COutPoint& prevoutRet, unsigned int& nTimeRet)
+{
+    nTimeEnd &= ~STAKE_TIMESTAMP_MASK;
+    if (vCoins.empty() || nTimeEnd < nTimeBegin)
+        return false;
+
+    CStakeSearch search;
+    search.pindexPrev = pindexPrev;
+    search.nBits = nBits;
+    search.pvCoins = &vCoins;
+    search.nTimeBegin = nTimeBegin;
+    search.nTimeEnd = nTimeEnd;
+
+    int64_t nStart = GetTimeMicros();
+    int nThreads = std::min(std::max(nStakeThreads, 1), (int)vCoins.size());
+    if (nThreads == 1)
+        StakeSearchThread(&search, 0, 1);
+    else
+    {
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&StakeSearchThread, &search, i, nThreads));
+        {
+            // The workers point into this frame; wait for them even on shutdown
+            boost::this_thread::disable_interruption di;
+            threads.join_all();
+        }
+        boost::this_thread::interruption_point();
+    }
+    RecordStakeKernelSearch(search.nKernels.load(), GetTimeMicros() - nStart);
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+    if (!search.fFound.load())
+        return false;
+    prevoutRet = search.prevoutFound;
+    nTimeRet = search.nTimeFound;
+    return true;
+}
+
+static CCriticalSection cs_kernelstats;
+static uint64_t nKernelsTried = 0;
+static int64_t nKernelSearchMicros = 0;
+
+void RecordStakeKernelSearch(uint64_t nKernels, int64_t nMicros)
+{
+    LOCK(cs_kernelstats);
+    nKernelsTried += nKernels;
+    nKernelSearchMicros += nMicros;
+}
+
+double GetStakeKernelRate()
+{
+    LOCK(cs_kernelstats);
+    if (nKernelSearchMicros <= 0)
+        return 0;
+    return nKernelsTried * 1000000.0 / nKernelSearchMicros;
 }
@@ -13,6 +13,11 @@ static const int STAKE_TIMESTAMP_MASK = 15;
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 extern unsigned int nModifierInterval;
 
+// Number of threads searching for a stake kernel (-stakethreads)
+extern int nStakeThreads;
+static const int DEFAULT_STAKE_THREADS = 1;
+static const int MAX_STAKE_THREADS = 64;
+
 // MODIFIER_INTERVAL_RATIO:
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
@@ -20,6 +25,12 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Target nBits weighted by nValue. bnTarget is the magnitude modulo 2**256,
+// as CBigNum::getuint256 gave it. Where comparing a hash against that would
+// not be what comparing against the signed, unbounded product gives, fAlways
+// or fNever says how the comparison comes out.
+void GetWeightedTarget(unsigned int nBits, int64_t nValue, arith_uint256& bnTarget, bool& fAlways, bool& fNever);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
@@ -39,4 +50,70 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// What the kernel hash needs to know about a staked output. All of it is
+// fixed once the output's transaction is in the main chain.
+struct CStakeKernelInput
+{
+    COutPoint prevout;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+};
+
+// Kernel inputs of outputs that have been tried for staking, so the search
+// doesn't read the same transaction and block header from disk every round.
+// An entry is dropped whenever its transaction is synced with the wallets,
+// which happens when the block holding it is connected or disconnected.
+class CStakeKernelCache
+{
+private:
+    static const unsigned int MAX_ENTRIES = 200000;
+
+    CCriticalSection cs;
+    std::map<COutPoint, CStakeKernelInput> mapInputs;
+
+public:
+    // Look up prevout, reading it from disk on a miss. Fails if the output
+    // does not exist in the main chain.
+    bool Get(CTxDB& txdb, const COutPoint& prevout, CStakeKernelInput& input);
+
+    // Forget every output of transaction hashTx
+    void EraseTx(const uint256& hashTx);
+};
+
+extern CStakeKernelCache stakeKernelCache;
+
+// Kernel of one output against one stake modifier and target. The hash
+// preimage and the weighted target are built once; checking a timestamp
+// only rewrites the last four bytes of the preimage and hashes it.
+// Same result as CheckStakeKernelHash.
+class CStakeKernel
+{
+private:
+    static const unsigned int PREIMAGE_SIZE = 56;
+
+    unsigned char preimage[PREIMAGE_SIZE];
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    uint256 targetProofOfStake;
+    bool fNever;
+
+public:
+    CStakeKernel(const CStakeKernelInput& input, uint64_t nStakeModifier, unsigned int nBits);
+
+    bool Check(unsigned int nTimeTx, uint256* phashProofOfStake = NULL);
+};
+
+// Search vCoins for a kernel at any of the timestamps from nTimeEnd back to
+// nTimeBegin that meet the protocol mask, splitting the coins between
+// nStakeThreads threads. Returns the first kernel found.
+bool FindStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<COutPoint>& vCoins,
+                     unsigned int nTimeBegin, unsigned int nTimeEnd, COutPoint& prevoutRet, unsigned int& nTimeRet);
+
+// Account for nKernels kernel hashes tried in nMicros of searching
+void RecordStakeKernelSearch(uint64_t nKernels, int64_t nMicros);
+
+// Kernel hashes tried per second of stake searching so far
+double GetStakeKernelRate();
+
 #endif // PPCOIN_KERNEL_H
@@ -0,0 +1,76 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LEVELDBBATCH_H
+#define BITCOIN_LEVELDBBATCH_H
+
+#include <string>
+
+#include <boost/unordered_map.hpp>
+
+#include <leveldb/write_batch.h>
+
+/** A LevelDB write batch that can be read back.
+ *
+ * Every put or delete is recorded in the batch and mirrored in a hash map
+ * from key to the latest value or a tombstone, so that reads made inside a
+ * database transaction find pending writes in constant time instead of
+ * iterating the whole batch.
+ */
+class CLevelDBBatch
+{
+public:
+    struct Entry
+    {
+        bool fErase;
+        std::string strValue;
+    };
+    typedef boost::unordered_map<std::string, Entry> EntryMap;
+
+private:
+    leveldb::WriteBatch batch;
+    EntryMap mapEntries;
+
+    CLevelDBBatch(const CLevelDBBatch&);
+    CLevelDBBatch& operator=(const CLevelDBBatch&);
+
+public:
+    CLevelDBBatch() {}
+
+    void Put(const std::string& key, const std::string& value)
+    {
+        batch.Put(key, value);
+        Entry& entry = mapEntries[key];
+        entry.fErase = false;
+        entry.strValue = value;
+    }
+
+    void Delete(const std::string& key)
+    {
+        batch.Delete(key);
+        Entry& entry = mapEntries[key];
+        entry.fErase = true;
+        entry.strValue.clear();
+    }
+
+    /** Returns true and sets (value, false) if the batch writes the key, or
+     *  leaves value alone and sets deleted = true if it deletes it. */
+    bool Lookup(const std::string& key, std::string* value, bool* deleted) const
+    {
+        EntryMap::const_iterator it = mapEntries.find(key);
+        if (it == mapEntries.end())
+            return false;
+        *deleted = it->second.fErase;
+        if (!*deleted)
+            *value = it->second.strValue;
+        return true;
+    }
+
+    /** Final state of every key the batch touches */
+    const EntryMap& GetEntries() const { return mapEntries; }
+
+    /** The underlying batch, to hand to leveldb::DB::Write */
+    leveldb::WriteBatch* Get() { return &batch; }
+};
+
+#endif // BITCOIN_LEVELDBBATCH_H
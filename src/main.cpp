@@ -10,9 +10,11 @@
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
+#include "memusage.h"
 #include "net.h"
 #include "txdb.h"
 #include "txmempool.h"
@@ -30,6 +32,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 using namespace std;
 using namespace boost;
 
@@ -43,11 +46,12 @@ set<CWallet*> setpwalletRegistered;
 CCriticalSection cs_main;
 
 CTxMemPool mempool;
+CCoinsCache coinsCache(DEFAULT_COINS_CACHE_SIZE << 20);
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
-CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
+arith_uint256 bnProofOfStakeLimit(~uint256(0) >> 20);
 
 unsigned int nStakeMinAge = 60 * 60; // 1 hours
 unsigned int nModifierInterval = 8 * 60; // time to elapse before new modifier is computed (8 hours)
@@ -64,6 +68,9 @@ CBlockIndex* pindexBest = NULL;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
+int nScriptCheckThreads = 0;
+bool fHeadersFirst = DEFAULT_HEADERS_FIRST;
+bool fDeferDBCommits = false;
 bool fAddrIndex = false;
 bool fHaveGUI = false;
 
@@ -79,6 +86,7 @@ set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+size_t nOrphanTransactionsUsage = 0;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -140,6 +148,9 @@ void UnregisterAllWallets() {
 }
 
 void SyncWithWallets(const CTransaction &tx, const CBlock *pblock, bool fConnect) {
+    // The block holding tx changed, so its outputs' kernel inputs may have
+    if (pblock)
+        stakeKernelCache.EraseTx(tx.GetHash());
     g_signals.SyncTransaction(tx, pblock, fConnect);
 }
 
@@ -164,15 +175,51 @@ struct CNodeState {
     // Whether this peer should be disconnected and banned.
     bool fShouldBan;
     std::string name;
+    // Blocks of the header chain requested from this peer and not yet received.
+    int nBlocksInFlight;
+    // Height of the last header this peer sent us.
+    int nHeadersHeight;
+    // Whether the header chain was fetched from this peer and it let us
+    // down; it isn't asked for headers again.
+    bool fHeadersSyncFailed;
+    // Header chain blocks this peer delivered with a body their header
+    // doesn't commit to; they are requested from other peers instead.
+    std::set<uint256> setBadBlockBodies;
 
     CNodeState() {
         nMisbehavior = 0;
         fShouldBan = false;
+        nBlocksInFlight = 0;
+        nHeadersHeight = -1;
+        fHeadersSyncFailed = false;
     }
 };
 
 map<NodeId, CNodeState> mapNodeState;
 
+// Headers-first sync. The header chain is the best chain of headers fetched
+// ahead of our best block, by hash in height order from nHeaderChainStart;
+// hashes leave the front as their blocks are connected. Its blocks are
+// requested from all outbound peers, and those arriving out of order wait
+// in mapOrphanBlocks until they can be connected.
+deque<uint256> vHeaderChain;
+int nHeaderChainStart = 0;
+// Timestamp of each header of the header chain, and the peer it came from
+struct CHeaderChainInfo
+{
+    int64_t nTime;
+    NodeId nFrom;
+};
+deque<CHeaderChainInfo> vHeaderChainInfo;
+// When a block of the header chain was last connected, or the chain started
+int64_t nHeaderChainProgressTime = 0;
+// Peer the header chain is fetched from, and when it was last asked (0 when
+// no reply is outstanding).
+NodeId nHeadersSyncPeer = -1;
+int64_t nHeadersRequestTime = 0;
+// Blocks requested from the header chain: the peer asked and when.
+map<uint256, pair<NodeId, int64_t> > mapBlocksInFlight;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -181,6 +228,30 @@ CNodeState *State(NodeId pnode) {
     return &it->second;
 }
 
+// Drop the header chain from position i on
+void TruncateHeaderChain(unsigned int i)
+{
+    vHeaderChain.resize(i);
+    vHeaderChainInfo.resize(i);
+}
+
+// Give up on the header chain and its sync peer; until another peer is
+// asked for headers, orphan blocks are filled in with getblocks again.
+// Requires cs_main.
+void ResetHeaderChain()
+{
+    TruncateHeaderChain(0);
+    nHeadersSyncPeer = -1;
+    nHeadersRequestTime = 0;
+    for (map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); ++it)
+    {
+        CNodeState *state = State(it->second.first);
+        if (state)
+            state->nBlocksInFlight--;
+    }
+    mapBlocksInFlight.clear();
+}
+
 int GetHeight()
 {
     while(true){
@@ -198,7 +269,22 @@ void InitializeNode(NodeId nodeid, const CNode *pnode) {
 
 void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
+    // Whatever the peer still owed us goes back to be requested elsewhere
+    map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.begin();
+    while (it != mapBlocksInFlight.end())
+    {
+        if (it->second.first == nodeid)
+            mapBlocksInFlight.erase(it++);
+        else
+            ++it;
+    }
     mapNodeState.erase(nodeid);
+    // Headers nobody is fetching any more aren't worth waiting on
+    if (nHeadersSyncPeer == nodeid)
+    {
+        LogPrint("net", "headers sync peer=%d disconnected, dropping the header chain\n", nodeid);
+        ResetHeaderChain();
+    }
 }
 
 }
@@ -209,6 +295,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     if (state == NULL)
         return false;
     stats.nMisbehavior = state->nMisbehavior;
+    stats.nBlocksInFlight = state->nBlocksInFlight;
     return true;
 }
 
@@ -246,6 +333,16 @@ bool AbortNode(const std::string &strMessage, const std::string &userMessage) {
 // mapOrphanTransactions
 //
 
+// Memory charged for an orphan: its map node, its inputs, outputs and
+// scripts, and for every input a by-prev map node and set node, which
+// overcounts inputs that share a previous transaction
+static size_t OrphanTxUsage(const CTransaction& tx)
+{
+    return memusage::IncrementalDynamicUsage(mapOrphanTransactions) + RecursiveDynamicUsage(tx) +
+           tx.vin.size() * (memusage::IncrementalDynamicUsage(mapOrphanTransactionsByPrev) +
+                            memusage::MallocUsage(sizeof(memusage::stl_tree_node<uint256>)));
+}
+
 bool AddOrphanTx(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
@@ -271,9 +368,10 @@ bool AddOrphanTx(const CTransaction& tx)
     mapOrphanTransactions[hash] = tx;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    nOrphanTransactionsUsage += OrphanTxUsage(tx);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u, %u bytes)\n", hash.ToString(),
+        mapOrphanTransactions.size(), nOrphanTransactionsUsage);
     return true;
 }
 
@@ -291,13 +389,14 @@ void static EraseOrphanTx(uint256 hash)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    nOrphanTransactionsUsage -= OrphanTxUsage(it->second);
     mapOrphanTransactions.erase(it);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsUsage > nMaxUsage)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -310,6 +409,14 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     return nEvicted;
 }
 
+unsigned int GetOrphanTxStats(size_t* pnUsage)
+{
+    LOCK(cs_main);
+    if (pnUsage)
+        *pnUsage = nOrphanTransactionsUsage;
+    return mapOrphanTransactions.size();
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CTransaction and CTxIndex
@@ -605,7 +712,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -615,6 +722,40 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     return pindexBest->nHeight - pindex->nHeight + 1;
 }
 
+void CTransaction::CacheHashes(const std::vector<CTransaction>& vtx)
+{
+    std::vector<const CTransaction*> vPending;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        if (!tx.HashCached())
+            vPending.push_back(&tx);
+    if (vPending.size() < 2)
+        return;
+
+    // Serialize them all into one buffer, then hash the pieces together
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    std::vector<size_t> vOffset;
+    vOffset.reserve(vPending.size() + 1);
+    BOOST_FOREACH(const CTransaction* ptx, vPending)
+    {
+        vOffset.push_back(ss.size());
+        ss << *ptx;
+    }
+    vOffset.push_back(ss.size());
+
+    std::vector<const unsigned char*> vInput(vPending.size());
+    std::vector<size_t> vLen(vPending.size());
+    for (unsigned int i = 0; i < vPending.size(); i++)
+    {
+        vInput[i] = (const unsigned char*)&ss[0] + vOffset[i];
+        vLen[i] = vOffset[i+1] - vOffset[i];
+    }
+    std::vector<uint256> vHash(vPending.size());
+    SHA256DBatch(vHash[0].begin(), &vInput[0], &vLen[0], vPending.size());
+
+    for (unsigned int i = 0; i < vPending.size(); i++)
+        vPending[i]->StoreHash(vHash[i]);
+}
+
 double CTransaction::ComputePriority(double dPriorityInputs, unsigned int nTxSize) const
 {
     // In order to avoid disincentivizing cleaning up the UTXO set we don't count
@@ -720,8 +861,14 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 }
 
 
+size_t GetMaxMempoolSize()
+{
+    return (size_t)std::max((int64_t)0, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE)) * 1000000;
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees,
+                        int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -773,6 +920,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -853,6 +1001,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                 LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
                 dFreeCount += nSize;
             }
+
+            // A pool that had to evict lately only takes what pays more
+            // than the evicted transactions did
+            int64_t nMempoolMinFee = pool.GetMinFeeRate(GetMaxMempoolSize()) * nSize / 1000;
+            if (nFees < nMempoolMinFee)
+                return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                             hash.ToString(), nFees, nMempoolMinFee);
         }
 
         if (fRejectInsaneFee && nFees > MIN_RELAY_TX_FEE * 10000)
@@ -860,6 +1015,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                          hash.ToString(),
                          nFees, MIN_RELAY_TX_FEE * 10000);
 
+        // Adding and evicting a transaction walks every pool transaction it
+        // spends from or is spent by, so keep unconfirmed chains short
+        string strLimitReason;
+        if (!pool.CheckPackageLimits(tx, nSize,
+                                     GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                     GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                     GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                     GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                     strLimitReason))
+            return error("AcceptToMemoryPool : too long unconfirmed chain %s: %s", hash.ToString(), strLimitReason);
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
@@ -880,10 +1046,39 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Work out priority now that the inputs are at hand, so block
+        // assembly does not read them again. Priority is
+        // sum(valuein * age) / txsize; outputs of pool transactions have
+        // no age.
+        int64_t nValueInChain = 0;
+        double dPriority = 0;
+        map<uint256, int> mapDepth;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+            if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+                continue;
+            if (!mapDepth.count(txin.prevout.hash))
+                mapDepth[txin.prevout.hash] = txindex.GetDepthInMainChain();
+            int64_t nValue = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+            nValueInChain += nValue;
+            dPriority += (double)nValue * mapDepth[txin.prevout.hash];
+        }
+        entry = CTxMemPoolEntry(tx, nFees, tx.GetValueIn(mapInputs), nValueInChain, nSigOps,
+                                nAcceptTime ? nAcceptTime : GetTime(), dPriority / nSize, nBestHeight);
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, entry);
+
+    // Keep the pool within its memory limit. If that evicts the new
+    // transaction itself, it paid less than everything else there.
+    unsigned int nEvicted = pool.TrimToSize(GetMaxMempoolSize());
+    if (nEvicted > 0)
+        LogPrint("mempool", "AcceptToMemoryPool : mempool full, evicted %u tx\n", nEvicted);
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full, fee rate too low %s", hash.ToString());
     setValidatedTx.insert(hash);
 
     SyncWithWallets(tx, NULL);
@@ -1045,7 +1240,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1211,7 +1406,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1267,22 +1462,93 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+// Slab allocator behind CBlockIndex::operator new. Block index entries
+// live as long as the node runs, so they are carved out of large slabs
+// instead of costing a heap allocation, with its header and alignment
+// slack, each. Slabs are never given back.
+class CBlockIndexArena
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
+private:
+    static const size_t SLAB_ENTRIES = 4096;
+
+    CCriticalSection cs;
+    vector<char*> vSlab;
+    size_t nUsed;           // entries handed out from the last slab
+    vector<void*> vFree;
+
+public:
+    CBlockIndexArena() : nUsed(SLAB_ENTRIES) {}
+
+    void* Allocate()
+    {
+        LOCK(cs);
+        if (!vFree.empty())
+        {
+            void* p = vFree.back();
+            vFree.pop_back();
+            return p;
+        }
+        if (nUsed == SLAB_ENTRIES)
+        {
+            vSlab.push_back((char*)::operator new(SLAB_ENTRIES * sizeof(CBlockIndex)));
+            nUsed = 0;
+        }
+        return vSlab.back() + sizeof(CBlockIndex) * nUsed++;
+    }
+
+    void Free(void* p)
+    {
+        LOCK(cs);
+        vFree.push_back(p);
+    }
+};
+
+static CBlockIndexArena blockIndexArena;
+
+void* CBlockIndex::operator new(size_t nSize)
+{
+    // Derived classes such as CDiskBlockIndex don't fit a slot
+    if (nSize != sizeof(CBlockIndex))
+        return ::operator new(nSize);
+    return blockIndexArena.Allocate();
+}
+
+void CBlockIndex::operator delete(void* p, size_t nSize)
+{
+    if (!p)
+        return;
+    if (nSize != sizeof(CBlockIndex))
+        ::operator delete(p);
     else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+        blockIndexArena.Free(p);
+}
+
+// Blocks of the best chain by height, kept in step with pnext. It has a
+// lock of its own: the masternode code, the wallet and the GUI look up
+// heights without holding cs_main, and a resize may reallocate it.
+static CCriticalSection cs_vBestChain;
+static vector<CBlockIndex*> vBestChain;
+
+void SetBestChainByHeight(CBlockIndex* pindexTip)
+{
+    LOCK(cs_vBestChain);
+    if (!pindexTip)
+    {
+        vBestChain.clear();
+        return;
+    }
+    // Entries below the fork with the old chain are already right
+    vBestChain.resize(pindexTip->nHeight + 1);
+    for (CBlockIndex* pindex = pindexTip; pindex && vBestChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBestChain[pindex->nHeight] = pindex;
+}
+
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    LOCK(cs_vBestChain);
+    if (nHeight < 0 || nHeight >= (int)vBestChain.size())
+        return NULL;
+    return vBestChain[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1349,7 +1615,7 @@ void static PruneOrphanBlocks()
     mapOrphanBlocks.erase(hash);
 }
 
-static CBigNum GetProofOfStakeLimit(int nHeight)
+static arith_uint256 GetProofOfStakeLimit(int nHeight)
 {
     return bnProofOfStakeLimit;
 }
@@ -1556,7 +1822,7 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-    CBigNum bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
+    arith_uint256 bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
 
     if (pindexLast == NULL)
         return bnTargetLimit.GetCompact(); // genesis block
@@ -1576,29 +1842,108 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    // A negative or oversized previous target, or a product that doesn't fit
+    // in 256 bits, would come out at or beyond the limit anyway
+    arith_uint256 bnNew;
+    bool fNegative, fOverflow;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative, &fOverflow);
     int64_t nInterval = nTargetTimespan / TARGET_SPACING;
-    bnNew *= ((nInterval - 1) * TARGET_SPACING + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * TARGET_SPACING);
+    if (!fNegative && !fOverflow &&
+        bnNew.MulU64((nInterval - 1) * TARGET_SPACING + nActualSpacing + nActualSpacing))
+        bnNew /= arith_uint256((nInterval + 1) * TARGET_SPACING);
+    else
+        bnNew = bnTargetLimit;
 
-    if (bnNew <= 0 || bnNew > bnTargetLimit)
+    if (bnNew == 0 || bnNew > bnTargetLimit)
         bnNew = bnTargetLimit;
 
     return bnNew.GetCompact();
 }
 
+// Recently computed scrypt hashes of block headers, by block hash. A block
+// read from disk has its header checked by ReadFromDisk and again by
+// CheckBlock, and PrecomputePoWHashes fills it ahead of both.
+class CPoWHashCache
+{
+private:
+    static const size_t MAX_ENTRIES = 4096;
+
+    CCriticalSection cs;
+    map<uint256, uint256> mapPoWHash;
+    deque<uint256> vOrder;
+
+public:
+    bool Get(const uint256& hash, uint256& hashPoW)
+    {
+        LOCK(cs);
+        map<uint256, uint256>::const_iterator mi = mapPoWHash.find(hash);
+        if (mi == mapPoWHash.end())
+            return false;
+        hashPoW = mi->second;
+        return true;
+    }
+
+    void Insert(const uint256& hash, const uint256& hashPoW)
+    {
+        LOCK(cs);
+        if (!mapPoWHash.insert(make_pair(hash, hashPoW)).second)
+            return;
+        vOrder.push_back(hash);
+        while (vOrder.size() > MAX_ENTRIES)
+        {
+            mapPoWHash.erase(vOrder.front());
+            vOrder.pop_front();
+        }
+    }
+};
+
+static CPoWHashCache powHashCache;
+
+uint256 CBlock::GetPoWHash() const
+{
+    uint256 hash = GetHash();
+    uint256 hashPoW;
+    if (powHashCache.Get(hash, hashPoW))
+        return hashPoW;
+    hashPoW = scrypt_blockhash(CVOIDBEGIN(nVersion));
+    powHashCache.Insert(hash, hashPoW);
+    return hashPoW;
+}
+
+void PrecomputePoWHashes(const vector<const CBlock*>& vpblock)
+{
+    vector<uint256> vHash;
+    vector<const void*> vHeader;
+    BOOST_FOREACH(const CBlock* pblock, vpblock)
+    {
+        uint256 hash = pblock->GetHash();
+        uint256 hashPoW;
+        if (powHashCache.Get(hash, hashPoW))
+            continue;
+        vHash.push_back(hash);
+        vHeader.push_back(CVOIDBEGIN(pblock->nVersion));
+    }
+    if (vHeader.empty())
+        return;
+
+    vector<uint256> vHashPoW(vHeader.size());
+    scrypt_blockhash_batch(&vHeader[0], &vHashPoW[0], vHeader.size());
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        powHashCache.Insert(vHash[i], vHashPoW[i]);
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    arith_uint256 bnTarget;
+    bool fNegative, fOverflow;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > Params().ProofOfWorkLimit())
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > Params().ProofOfWorkLimit())
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1732,20 +2077,25 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString(),  prevout.hash.ToString());
 
         // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
+        CCoins& coinsPrev = inputsRet[prevout.hash].second;
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
             // Get prev tx from single transactions in memory
+            CTransaction txPrev;
             if (!mempool.lookup(prevout.hash, txPrev))
                 return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString(),  prevout.hash.ToString());
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
+            coinsPrev = CCoins(txPrev);
         }
-        else
+        else if (!coinsCache.Get(prevout.hash, coinsPrev))
         {
             // Get prev tx from disk
+            CTransaction txPrev;
             if (!txPrev.ReadFromDisk(txindex.pos))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
+            coinsPrev = CCoins(txPrev);
+            coinsCache.Add(prevout.hash, coinsPrev);
         }
     }
 
@@ -1755,7 +2105,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         const COutPoint prevout = vin[i].prevout;
         assert(inputsRet.count(prevout.hash) != 0);
         const CTxIndex& txindex = inputsRet[prevout.hash].first;
-        const CTransaction& txPrev = inputsRet[prevout.hash].second;
+        const CCoins& txPrev = inputsRet[prevout.hash].second;
         if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
         {
             // Revisit this if/when transaction replacement is implemented and allows
@@ -1768,13 +2118,61 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     return true;
 }
 
+bool CCoinsCache::Get(const uint256& hash, CCoins& coinsRet)
+{
+    LOCK(cs);
+    coins_map::iterator mi = mapCoins.find(hash);
+    if (mi == mapCoins.end())
+        return false;
+    lru.splice(lru.begin(), lru, mi->second.second);
+    coinsRet = mi->second.first;
+    return true;
+}
+
+void CCoinsCache::Add(const uint256& hash, const CCoins& coins)
+{
+    size_t nEntryUsage = coins.DynamicUsage();
+    LOCK(cs);
+    if (nEntryUsage > nMaxUsage || mapCoins.count(hash))
+        return;
+    lru.push_front(hash);
+    mapCoins.insert(make_pair(hash, make_pair(coins, lru.begin())));
+    nUsage += nEntryUsage;
+    while (nUsage > nMaxUsage)
+    {
+        coins_map::iterator mi = mapCoins.find(lru.back());
+        nUsage -= mi->second.first.DynamicUsage();
+        mapCoins.erase(mi);
+        lru.pop_back();
+    }
+}
+
+void CCoinsCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    while (nUsage > nMaxUsage)
+    {
+        coins_map::iterator mi = mapCoins.find(lru.back());
+        nUsage -= mi->second.first.DynamicUsage();
+        mapCoins.erase(mi);
+        lru.pop_back();
+    }
+}
+
+size_t CCoinsCache::GetUsage()
+{
+    LOCK(cs);
+    return nUsage;
+}
+
 const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const
 {
     MapPrevTx::const_iterator mi = inputs.find(input.prevout.hash);
     if (mi == inputs.end())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-    const CTransaction& txPrev = (mi->second).second;
+    const CCoins& txPrev = (mi->second).second;
     if (input.prevout.n >= txPrev.vout.size())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
@@ -1796,7 +2194,8 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 }
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig,
+    std::vector<CScriptCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1811,7 +2210,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& txPrev = inputs[prevout.hash].second;
 
             if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
                 return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
@@ -1837,12 +2236,15 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        // Signature hash state shared by the checks of all inputs, made on
+        // first use and only for transactions with more than one input.
+        boost::shared_ptr<const CSignatureHashContext> psighash;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& txPrev = inputs[prevout.hash].second;
 
             // Check for conflicts (double-spend)
             // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
@@ -1857,8 +2259,19 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                 // still computed and checked, and any change will be caught at the next checkpoint.
                 if (!(fBlock && !IsInitialBlockDownload()))
                 {
-                    // Verify signature
-                    if (!VerifySignature(txPrev, *this, i, flags, 0))
+                    // Verify signature. FetchInputs keyed txPrev by
+                    // prevout.hash, so there is no need to rehash it here.
+                    const CScript& scriptPubKey = txPrev.vout[prevout.n].scriptPubKey;
+                    if (!psighash && vin.size() > 1)
+                        psighash.reset(new CSignatureHashContext(*this));
+                    if (pvChecks)
+                    {
+                        // Leave it to the caller's check queue
+                        CScriptCheck check(scriptPubKey, *this, i, flags, 0, psighash);
+                        pvChecks->push_back(CScriptCheck());
+                        check.swap(pvChecks->back());
+                    }
+                    else if (!VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, flags, 0, psighash.get()))
                     {
                         if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                             // Check whether the failure was caused by a
@@ -1867,7 +2280,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                             // if so, don't trigger DoS protection to
                             // avoid splitting the network between upgraded and
                             // non-upgraded nodes.
-                            if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+                            if (VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0, psighash.get()))
                                 return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
                         }
                         // Failures of other flags indicate a transaction that is
@@ -1911,30 +2324,6 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
-bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
-{
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
-
-    // Update block index on disk without changing it in memory.
-    // The memory index structure will be changed after the db commits.
-    if (pindex->pprev)
-    {
-        CDiskBlockIndex blockindexPrev(pindex->pprev);
-        blockindexPrev.hashNext = 0;
-        if (!txdb.WriteBlockIndex(blockindexPrev))
-            return error("DisconnectBlock() : WriteBlockIndex failed");
-    }
-
-    // ppcoin: clean up wallet after disconnecting coinstake
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, false);
-
-    return true;
-}
-
 bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
 {
     CScript::const_iterator pc = script.begin();
@@ -1969,8 +2358,81 @@ bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
     }
 }
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash) {
-    uint160 addrid = 0;
+// Collect the address ids a transaction is indexed under: those of its own
+// outputs and those of the transactions it spends from.
+bool static GetAddrIndexIds(CTxDB& txdb, CTransaction& tx, std::set<uint160>& setAddrIds)
+{
+    // inputs
+    if (!tx.IsCoinBase())
+    {
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapQueuedChangesT;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
+            return false;
+
+        for (MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+        {
+            BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
+            {
+                std::vector<uint160> addrIds;
+                if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
+                    setAddrIds.insert(addrIds.begin(), addrIds.end());
+            }
+        }
+    }
+
+    // outputs
+    BOOST_FOREACH(const CTxOut &atxout, tx.vout)
+    {
+        std::vector<uint160> addrIds;
+        if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
+            setAddrIds.insert(addrIds.begin(), addrIds.end());
+    }
+    return true;
+}
+
+bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
+{
+    // Drop the address index records of this block while the spent
+    // transactions can still be fetched
+    if(GetBoolArg("-addrindex", false))
+    {
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            std::set<uint160> setAddrIds;
+            if (!GetAddrIndexIds(txdb, vtx[i], setAddrIds))
+                return error("DisconnectBlock() : address ids of tx %s not found", vtx[i].GetHash().ToString());
+            BOOST_FOREACH(const uint160& addrId, setAddrIds)
+                txdb.EraseAddrIndex(addrId, pindex->nHeight, i);
+        }
+    }
+
+    // Disconnect in reverse order
+    for (int i = vtx.size()-1; i >= 0; i--)
+        if (!vtx[i].DisconnectInputs(txdb))
+            return false;
+
+    // Update block index on disk without changing it in memory.
+    // The memory index structure will be changed after the db commits.
+    if (pindex->pprev)
+    {
+        CDiskBlockIndex blockindexPrev(pindex->pprev);
+        blockindexPrev.hashNext = 0;
+        if (!txdb.WriteBlockIndex(blockindexPrev))
+            return error("DisconnectBlock() : WriteBlockIndex failed");
+    }
+
+    // ppcoin: clean up wallet after disconnecting coinstake
+    BOOST_FOREACH(CTransaction& tx, vtx)
+        SyncWithWallets(tx, this, false);
+
+    return true;
+}
+
+bool GetAddrIndexId(const CTxDestination &dest, uint160 &addrid)
+{
+    addrid = 0;
     const CKeyID *pkeyid = boost::get<CKeyID>(&dest);
     if (pkeyid)
         addrid = static_cast<uint160>(*pkeyid);
@@ -1979,7 +2441,12 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
         if (pscriptid)
             addrid = static_cast<uint160>(*pscriptid);
     }
-    if (!addrid)
+    return addrid != 0;
+}
+
+bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash, int nSkip, int nCount) {
+    uint160 addrid;
+    if (!GetAddrIndexId(dest, addrid))
     {
         LogPrintf("FindTransactionsByDestination(): Couldn't parse dest into addrid\n");
         return false;
@@ -1987,7 +2454,7 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
 
     LOCK(cs_main);
     CTxDB txdb("r");
-    if(!txdb.ReadAddrIndex(addrid, vtxhash))
+    if(!txdb.ReadAddrIndex(addrid, vtxhash, nSkip, nCount))
     {
         LogPrintf("FindTransactionsByDestination(): txdb.ReadAddrIndex failed\n");
         return false;
@@ -1995,50 +2462,252 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
     return true;
 }
 
-void CBlock::RebuildAddressIndex(CTxDB& txdb)
+/** One address index record produced by a rebuild worker */
+struct CAddrIndexRecord
 {
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    uint160 addrHash;
+    unsigned int nTxIndex;
+    uint256 hashTx;
+};
+
+/** State shared between the threads of an address index rebuild. Workers
+ * read blocks and extract address ids out of order, the writer consumes
+ * their results strictly in height order.
+ */
+struct CAddrIndexRebuild
+{
+    std::vector<CBlockIndex*> vBlocks;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    unsigned int nNext;     // next block handed to a worker
+    unsigned int nWritten;  // blocks consumed by the writer
+    bool fStop;
+    bool fError;            // a worker could not index its block
+    std::map<unsigned int, std::vector<CAddrIndexRecord> > mapDone;
+};
+
+// How many blocks the workers may run ahead of the writer
+static const unsigned int ADDRINDEX_REBUILD_WINDOW = 1000;
+// Records per committed write batch
+static const unsigned int ADDRINDEX_REBUILD_BATCH = 200000;
+
+static void ThreadAddrIndexRebuild(CAddrIndexRebuild* pstate)
+{
+    CTxDB txdb("r");
+    while (true)
     {
-        uint256 hashTx = tx.GetHash();
-        // inputs
-        if(!tx.IsCoinBase())
+        unsigned int n;
         {
-            MapPrevTx mapInputs;
-            map<uint256, CTxIndex> mapQueuedChangesT;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
+            boost::unique_lock<boost::mutex> lock(pstate->cs);
+            while (!pstate->fStop && pstate->nNext < pstate->vBlocks.size() &&
+                   pstate->nNext >= pstate->nWritten + ADDRINDEX_REBUILD_WINDOW)
+                pstate->cond.wait(lock);
+            if (pstate->fStop || pstate->nNext >= pstate->vBlocks.size())
                 return;
+            n = pstate->nNext++;
+        }
 
-            MapPrevTx::const_iterator mi;
-            for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+        std::vector<CAddrIndexRecord> vRecords;
+        CBlock block;
+        bool fOk = block.ReadFromDisk(pstate->vBlocks[n], true);
+        if (!fOk)
+            LogPrintf("RebuildAddressIndex() : cannot read block at height %d\n", pstate->vBlocks[n]->nHeight);
+        for (unsigned int i = 0; fOk && i < block.vtx.size(); i++)
+        {
+            std::set<uint160> setAddrIds;
+            if (!GetAddrIndexIds(txdb, block.vtx[i], setAddrIds))
             {
-                BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                {
-                    std::vector<uint160> addrIds;
-                    if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                    {
-                        BOOST_FOREACH(uint160 addrId, addrIds)
-                        {
-                            if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                LogPrintf("RebuildAddressIndex(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                        }
-                    }
-                }
+                LogPrintf("RebuildAddressIndex() : address ids of tx %s at height %d not found\n",
+                    block.vtx[i].GetHash().ToString(), pstate->vBlocks[n]->nHeight);
+                fOk = false;
+                break;
+            }
+
+            CAddrIndexRecord record;
+            record.nTxIndex = i;
+            record.hashTx = block.vtx[i].GetHash();
+            BOOST_FOREACH(const uint160& addrId, setAddrIds)
+            {
+                record.addrHash = addrId;
+                vRecords.push_back(record);
             }
         }
-        // outputs
-        BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-            std::vector<uint160> addrIds;
-            if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
+
+        // A block that could not be indexed completely is never handed to
+        // the writer, so neither it nor anything above it gets committed
+        if (!fOk)
+        {
             {
-                BOOST_FOREACH(uint160 addrId, addrIds)
-                {
-                    if(!txdb.WriteAddrIndex(addrId, hashTx))
-                        LogPrintf("RebuildAddressIndex(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                }
+                boost::unique_lock<boost::mutex> lock(pstate->cs);
+                pstate->fStop = true;
+                pstate->fError = true;
+            }
+            pstate->cond.notify_all();
+            return;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(pstate->cs);
+            pstate->mapDone[n].swap(vRecords);
+        }
+        pstate->cond.notify_all();
+    }
+}
+
+bool RebuildAddressIndex()
+{
+    CTxDB txdb("r+");
+
+    // Resume an interrupted rebuild if its last committed block is still
+    // part of the best chain
+    int nStartHeight = 0;
+    int nProgressHeight;
+    uint256 hashProgress;
+    if (txdb.ReadAddrIndexProgress(nProgressHeight, hashProgress))
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(hashProgress);
+        if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain())
+        {
+            nStartHeight = nProgressHeight + 1;
+            LogPrintf("RebuildAddressIndex() : resuming at height %d\n", nStartHeight);
+        }
+    }
+
+    CAddrIndexRebuild state;
+    state.nNext = 0;
+    state.nWritten = 0;
+    state.fStop = false;
+    state.fError = false;
+    for (CBlockIndex* pindex = pindexBest; pindex && pindex->nHeight >= nStartHeight; pindex = pindex->pprev)
+        state.vBlocks.push_back(pindex);
+    reverse(state.vBlocks.begin(), state.vBlocks.end());
+
+    int nThreads = GetArg("-reindexaddrthreads", boost::thread::hardware_concurrency());
+    nThreads = std::max(1, std::min(nThreads, MAX_ADDRINDEX_THREADS));
+    LogPrintf("RebuildAddressIndex() : indexing %u blocks using %d threads\n", state.vBlocks.size(), nThreads);
+
+    boost::thread_group workers;
+    for (int i = 0; i < nThreads; i++)
+        workers.create_thread(boost::bind(&ThreadAddrIndexRebuild, &state));
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastReport = 0;
+    unsigned int nPending = 0;
+    bool fOk = true;
+    txdb.TxnBegin();
+    while (state.nWritten < state.vBlocks.size())
+    {
+        std::vector<CAddrIndexRecord> vRecords;
+        {
+            boost::unique_lock<boost::mutex> lock(state.cs);
+            while (!state.mapDone.count(state.nWritten) && !state.fError && !ShutdownRequested())
+                state.cond.timed_wait(lock, boost::posix_time::milliseconds(250));
+            if (state.fError || ShutdownRequested())
+                break;
+            state.mapDone[state.nWritten].swap(vRecords);
+            state.mapDone.erase(state.nWritten);
+        }
+
+        CBlockIndex* pindex = state.vBlocks[state.nWritten];
+        BOOST_FOREACH(const CAddrIndexRecord& record, vRecords)
+            txdb.WriteAddrIndex(record.addrHash, pindex->nHeight, record.nTxIndex, record.hashTx);
+        nPending += vRecords.size();
+
+        {
+            boost::unique_lock<boost::mutex> lock(state.cs);
+            state.nWritten++;
+        }
+        state.cond.notify_all();
+
+        // Commit together with the progress marker, so the marker never
+        // points past records that are not on disk
+        if (nPending >= ADDRINDEX_REBUILD_BATCH || state.nWritten == state.vBlocks.size())
+        {
+            txdb.WriteAddrIndexProgress(pindex->nHeight, pindex->GetBlockHash());
+            if (!txdb.TxnCommit())
+            {
+                fOk = false;
+                break;
             }
+            txdb.TxnBegin();
+            nPending = 0;
         }
+
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastReport >= 1000)
+        {
+            nLastReport = nNow;
+            double dRate = 1000.0 * state.nWritten / std::max((int64_t)1, nNow - nStart);
+            int64_t nETA = dRate > 0 ? (int64_t)((state.vBlocks.size() - state.nWritten) / dRate) : 0;
+            uiInterface.InitMessage(strprintf(_("Rebuilding address index, block %d (%.0f blocks/s, %d:%02d:%02d left)"),
+                pindex->nHeight, dRate, (int)(nETA / 3600), (int)(nETA / 60 % 60), (int)(nETA % 60)));
+        }
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(state.cs);
+        state.fStop = true;
     }
+    state.cond.notify_all();
+    workers.join_all();
+
+    // Records written after the last progress marker are left uncommitted,
+    // a resumed rebuild writes them again
+    txdb.TxnAbort();
+
+    if (!fOk)
+        return error("RebuildAddressIndex() : TxnCommit failed");
+    if (state.fError)
+        return error("RebuildAddressIndex() : indexing failed, stopped at height %d", state.vBlocks[state.nWritten]->nHeight);
+    if (state.nWritten < state.vBlocks.size())
+    {
+        LogPrintf("RebuildAddressIndex() : interrupted at height %d\n", state.vBlocks[state.nWritten]->nHeight);
+        return false;
+    }
+
+    txdb.EraseAddrIndexProgress();
+    LogPrintf("RebuildAddressIndex() : indexed %u blocks  %dms\n", state.vBlocks.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CScriptCheck::operator()() const
+{
+    // A check earlier in the block has already failed; the block is
+    // rejected for that one, so don't spend time on this one
+    if (presult && presult->FailedBefore(nTx, nIn))
+        return false;
+
+    if (VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighash.get()))
+        return true;
+
+    // Same distinction ConnectInputs draws between mandatory and
+    // non-mandatory failures
+    bool fNonMandatory = (nFlags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) &&
+        VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, nFlags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, nHashType, psighash.get());
+    if (presult)
+        presult->Fail(nTx, nIn, fNonMandatory);
+    return false;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck()
+{
+    RenameThread("phc-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+// Wait for the script checks queued so far and report the first one in
+// block order that failed, the way ConnectInputs would have reported it
+static bool FinishScriptChecks(CCheckQueueControl<CScriptCheck>& control, const CScriptCheckResult& result, std::vector<CTransaction>& vtx)
+{
+    if (control.Wait() || !result.IsFailed())
+        return true;
+
+    const CTransaction& tx = vtx[result.GetTx()];
+    if (result.IsNonMandatory())
+        return error("ConnectInputs() : %s non-mandatory VerifySignature failed", tx.GetHash().ToString());
+    return tx.DoS(100, error("ConnectInputs() : %s VerifySignature failed", tx.GetHash().ToString()));
 }
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
@@ -2066,14 +2735,26 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     unsigned int nSigOps = 0;
     int nInputs = 0;
 
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    // Script checks run on the -par threads while the rest of the block is
+    // connected; every early return below waits for them first
+    CScriptCheckResult checkResult;
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    std::vector<CScriptCheck> vChecks;
+    // Input fetching and script verification are timed apart; the total
+    // also covers sigop counting and the coins cache
+    int64_t nTimeStart = GetTimeMicros();
+    int64_t nTimeFetch = 0;
+    int64_t nTimeVerify = 0;
+
+    for (unsigned int nTx = 0; nTx < vtx.size(); nTx++)
     {
+        CTransaction& tx = vtx[nTx];
         uint256 hashTx = tx.GetHash();
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
 
         if (nSigOps > MAX_BLOCK_SIGOPS)
-            return DoS(100, error("ConnectBlock() : too many sigops"));
+            return FinishScriptChecks(control, checkResult, vtx) && DoS(100, error("ConnectBlock() : too many sigops"));
 
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         if (!fJustCheck)
@@ -2085,15 +2766,21 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         else
         {
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
+            int64_t nTimeFetchStart = GetTimeMicros();
+            bool fFetched = tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid);
+            nTimeFetch += GetTimeMicros() - nTimeFetchStart;
+            if (!fFetched)
+            {
+                FinishScriptChecks(control, checkResult, vtx);
                 return false;
+            }
 
             // Add in sigops done by pay-to-script-hash inputs;
             // this is to prevent a "rogue miner" from creating
             // an incredibly-expensive-to-validate block.
             nSigOps += GetP2SHSigOpCount(tx, mapInputs);
             if (nSigOps > MAX_BLOCK_SIGOPS)
-                return DoS(100, error("ConnectBlock() : too many sigops"));
+                return FinishScriptChecks(control, checkResult, vtx) && DoS(100, error("ConnectBlock() : too many sigops"));
 
             int64_t nTxValueIn = tx.GetValueIn(mapInputs);
             int64_t nTxValueOut = tx.GetValueOut();
@@ -2104,14 +2791,40 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            int64_t nTimeVerifyStart = GetTimeMicros();
+            bool fConnected = tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, true,
+                                               nScriptCheckThreads ? &vChecks : NULL);
+            // Queue what was deferred even on failure: an earlier script
+            // failure in this transaction takes precedence over the error
+            // ConnectInputs returned
+            BOOST_FOREACH(CScriptCheck& check, vChecks)
+                check.SetResult(&checkResult, nTx);
+            control.Add(vChecks);
+            vChecks.clear();
+            nTimeVerify += GetTimeMicros() - nTimeVerifyStart;
+            if (!fConnected)
+            {
+                FinishScriptChecks(control, checkResult, vtx);
                 return false;
+            }
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+
+        // Outputs created now are the likeliest to be spent soon
+        coinsCache.Add(hashTx, CCoins(tx));
     }
 
+    // Checks still queued on the -par threads are verify time as well
+    int64_t nTimeWaitStart = GetTimeMicros();
+    if (!FinishScriptChecks(control, checkResult, vtx))
+        return false;
+    int64_t nTimeEnd = GetTimeMicros();
+    nTimeVerify += nTimeEnd - nTimeWaitStart;
+    LogPrint("bench", "- Connect %u transactions: %.2fms, fetch inputs: %.2fms, verify %u txins: %.2fms (%.3fms/txin)\n",
+             (unsigned)vtx.size(), 0.001 * (nTimeEnd - nTimeStart), 0.001 * nTimeFetch,
+             (unsigned)nInputs, 0.001 * nTimeVerify, nInputs ? 0.001 * nTimeVerify / nInputs : 0);
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -2166,48 +2879,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if(GetBoolArg("-addrindex", false))
     {
         // Write Address Index
-        BOOST_FOREACH(CTransaction& tx, vtx)
+        for (unsigned int i = 0; i < vtx.size(); i++)
         {
+            CTransaction& tx = vtx[i];
             uint256 hashTx = tx.GetHash();
-            // inputs
-            if(!tx.IsCoinBase())
-            {
-                MapPrevTx mapInputs;
-                map<uint256, CTxIndex> mapQueuedChangesT;
-                bool fInvalid;
-                if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-                    return false;
-
-                MapPrevTx::const_iterator mi;
-                for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-                {
-                    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-                    {
-                        std::vector<uint160> addrIds;
-                        if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                        {
-                            BOOST_FOREACH(uint160 addrId, addrIds)
-                            {
-                                if(!txdb.WriteAddrIndex(addrId, hashTx))
-                                    LogPrintf("ConnectBlock(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                            }
-                        }
-                    }
-                }
-            }
+            std::set<uint160> setAddrIds;
+            if (!GetAddrIndexIds(txdb, tx, setAddrIds))
+                return false;
 
-            // outputs
-            BOOST_FOREACH(const CTxOut &atxout, tx.vout)
+            BOOST_FOREACH(const uint160& addrId, setAddrIds)
             {
-                std::vector<uint160> addrIds;
-                if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
-                {
-                    BOOST_FOREACH(uint160 addrId, addrIds)
-                    {
-                        if(!txdb.WriteAddrIndex(addrId, hashTx))
-                            LogPrintf("ConnectBlock(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-                    }
-                }
+                if(!txdb.WriteAddrIndex(addrId, pindex->nHeight, i, hashTx))
+                    LogPrintf("ConnectBlock(): WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
             }
         }
     }
@@ -2263,6 +2946,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Disconnect shorter branch
     list<CTransaction> vResurrect;
+    vector<CTransaction> vDisconnected;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
     {
         CBlock block;
@@ -2270,6 +2954,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
             return error("Reorganize() : ReadFromDisk for disconnect failed");
         if (!block.DisconnectBlock(txdb, pindex))
             return error("Reorganize() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString());
+        vDisconnected.insert(vDisconnected.end(), block.vtx.begin(), block.vtx.end());
 
         // Queue memory transactions to resurrect.
         // We only do this for blocks after the last checkpoint (reorganisation before that
@@ -2319,10 +3004,14 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         AcceptToMemoryPool(mempool, tx, false, NULL);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
-    }
+    mempool.removeForBlock(vDelete);
+
+    // Memory transactions spending from the disconnected branch are left
+    // with missing inputs unless their parents came back. Block assembly
+    // takes the pool as valid, so they have to go.
+    BOOST_FOREACH(const CTransaction& tx, vDisconnected)
+        if (!mempool.exists(tx.GetHash()) && !txdb.ContainsTx(tx.GetHash()))
+            mempool.removeSpends(tx);
 
     LogPrintf("REORGANIZE: done\n");
 
@@ -2349,8 +3038,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
     pindexNew->pprev->pnext = pindexNew;
 
     // Delete redundant memory transactions
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+    mempool.removeForBlock(vtx);
 
     return true;
 }
@@ -2422,6 +3110,15 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Update best block in wallet (so we can detect restored wallets)
     bool fIsInitialDownload = IsInitialBlockDownload();
+
+    // Batch txdb commits while catching up; once caught up, write out what
+    // is pending and go back to committing every block
+    if (fIsInitialDownload != fDeferDBCommits)
+    {
+        if (!fIsInitialDownload && !CTxDB::FlushDeferred())
+            return error("SetBestChain() : FlushDeferred failed");
+        fDeferDBCommits = fIsInitialDownload;
+    }
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
     {
         const CBlockLocator locator(pindexNew);
@@ -2431,7 +3128,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    SetBestChainByHeight(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2532,7 +3229,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2557,7 +3254,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
     
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2770,7 +3467,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2871,13 +3568,19 @@ bool CBlock::AcceptBlock()
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    arith_uint256 bnTarget;
+    bool fNegative, fOverflow;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    if (bnTarget <= 0)
+    if (fNegative || fOverflow || bnTarget == 0)
         return 0;
 
-    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    // 2**256 / (bnTarget+1) doesn't fit in 256 bits, but it is equal to
+    // (2**256 - bnTarget - 1) / (bnTarget+1) + 1, which is. A decoded
+    // compact target is never ~0, so bnTarget+1 can't wrap.
+    arith_uint256 bnTrust = ~bnTarget;
+    bnTrust /= bnTarget + 1;
+    return bnTrust + 1;
 }
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
@@ -2891,6 +3594,242 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+// Drop the blocks that have been connected from the front of the header chain
+static void PruneHeaderChain()
+{
+    while (!vHeaderChain.empty() && mapBlockIndex.count(vHeaderChain.front()))
+    {
+        vHeaderChain.pop_front();
+        vHeaderChainInfo.pop_front();
+        nHeaderChainStart++;
+        nHeaderChainProgressTime = GetTime();
+    }
+}
+
+static bool IsHeadersSyncing()
+{
+    PruneHeaderChain();
+    return fHeadersFirst && !vHeaderChain.empty();
+}
+
+static void PushGetHeaders(CNode* pnode)
+{
+    nHeadersSyncPeer = pnode->GetId();
+    nHeadersRequestTime = GetTime();
+    pnode->PushMessage("getheaders", CBlockLocator(vHeaderChain, pindexBest), uint256(0));
+}
+
+// Stop fetching headers from the sync peer, and don't pick it again
+static void DropHeadersSyncPeer()
+{
+    CNodeState *state = State(nHeadersSyncPeer);
+    if (state)
+        state->fHeadersSyncFailed = true;
+    nHeadersSyncPeer = -1;
+    nHeadersRequestTime = 0;
+}
+
+// Whether pnode can take over fetching the header chain
+static bool IsHeadersSyncCandidate(CNode* pnode)
+{
+    if (pnode->fInbound || pnode->fClient || pnode->fOneShot || pnode->fDisconnect || !pnode->fSuccessfullyConnected ||
+        (pnode->nVersion >= NOBLKS_VERSION_START && pnode->nVersion < NOBLKS_VERSION_END))
+        return false;
+    CNodeState *state = State(pnode->GetId());
+    return state && !state->fHeadersSyncFailed && pnode->nStartingHeight > nBestHeight;
+}
+
+// Append headers from pfrom to the header chain, as far as they check out.
+// Without its coinstake a proof-of-stake header can't be checked beyond its
+// timestamp, so only the headers below the first proof-of-stake height have
+// their scrypt proof-of-work verified; everything is checked again in full
+// when the block itself is accepted. For the same reason the chain may not
+// run much past the height the peer announced when it connected.
+static bool AcceptHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    uint256 hashPrev = vHeaders[0].hashPrevBlock;
+    int nHeight;
+    int64_t nPrevTime;
+    deque<uint256>::iterator it = vHeaderChain.end();
+    if (!vHeaderChain.empty() && hashPrev != vHeaderChain.back())
+        it = find(vHeaderChain.begin(), vHeaderChain.end(), hashPrev);
+    if (!vHeaderChain.empty() && (hashPrev == vHeaderChain.back() || it != vHeaderChain.end()))
+    {
+        // The headers extend the header chain, or fork from it after
+        // hashPrev, e.g. past a block found invalid
+        if (it != vHeaderChain.end())
+            TruncateHeaderChain(it - vHeaderChain.begin() + 1);
+        nHeight = nHeaderChainStart + vHeaderChain.size();
+        nPrevTime = vHeaderChainInfo.back().nTime;
+    }
+    else
+    {
+        // The headers fork from our best chain, or we have connected past
+        // the end of the header chain: start a new one from there
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+        if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+            return error("AcceptHeaders() : headers from peer=%d don't connect to our chain", pfrom->GetId());
+        TruncateHeaderChain(0);
+        nHeight = nHeaderChainStart = mi->second->nHeight + 1;
+        nPrevTime = mi->second->GetBlockTime();
+        nHeaderChainProgressTime = GetTime();
+    }
+
+    int nMaxHeight = pfrom->nStartingHeight + MAX_HEADERS_PAST_STARTING_HEIGHT +
+                     (int)((GetTime() - pfrom->nTimeConnected) / TARGET_SPACING);
+
+    vector<const CBlock*> vpblockPoW;
+    for (unsigned int i = 0; i < vHeaders.size() && nHeight + (int)i < Params().POSStartBlock(); i++)
+        vpblockPoW.push_back(&vHeaders[i]);
+    PrecomputePoWHashes(vpblockPoW);
+
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        if (header.hashPrevBlock != hashPrev)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("AcceptHeaders() : non-continuous headers sequence");
+        }
+        if (nHeight > nMaxHeight)
+            return error("AcceptHeaders() : headers from peer=%d run past its height %d", pfrom->GetId(), pfrom->nStartingHeight);
+        if (!Checkpoints::CheckHardened(nHeight, hash))
+        {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("AcceptHeaders() : rejected by hardened checkpoint lock-in at %d", nHeight);
+        }
+        if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+            return error("AcceptHeaders() : header timestamp too far in the future");
+        if (header.GetBlockTime() <= nPrevTime - DRIFT || FutureDrift(header.GetBlockTime()) < nPrevTime)
+            return error("AcceptHeaders() : header timestamp is too early");
+        if (nHeight < Params().POSStartBlock() && !CheckProofOfWork(header.GetPoWHash(), header.nBits))
+        {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("AcceptHeaders() : proof of work failed at %d", nHeight);
+        }
+
+        CHeaderChainInfo info;
+        info.nTime = header.GetBlockTime();
+        info.nFrom = pfrom->GetId();
+        vHeaderChain.push_back(hash);
+        vHeaderChainInfo.push_back(info);
+        nPrevTime = info.nTime;
+        hashPrev = hash;
+        nHeight++;
+    }
+    return true;
+}
+
+// Whether the body of a block is the one its header commits to. The block
+// hash covers neither the block signature nor a transaction list with
+// duplicates that still hashes to the same merkle root, so a peer can
+// deliver a broken body for a good header.
+static bool IsBlockBodyCommitted(const CBlock& block)
+{
+    set<uint256> setTx;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (!setTx.insert(tx.GetHash()).second)
+            return false;
+    return block.hashMerkleRoot == block.BuildMerkleTree() && block.CheckBlockSignature();
+}
+
+// A block of the header chain was rejected. If the body pfrom delivered is
+// not the one the header commits to, only pfrom is at fault and another
+// peer is asked for the block. Otherwise the header itself announced an
+// invalid block: cut the chain before it, and stop trusting the peer whose
+// header it was. Headers from the next sync peer can fork off the part
+// that is left.
+static void HeaderChainBlockInvalid(CNode* pfrom, const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    deque<uint256>::iterator it = find(vHeaderChain.begin(), vHeaderChain.end(), hash);
+    if (it == vHeaderChain.end())
+        return;
+    if (!IsBlockBodyCommitted(block))
+    {
+        LogPrint("net", "block %s of the header chain from peer=%d has a mutated body, asking elsewhere\n",
+                 hash.ToString(), pfrom->GetId());
+        CNodeState *state = State(pfrom->GetId());
+        if (state)
+            state->setBadBlockBodies.insert(hash);
+        return;
+    }
+    unsigned int i = it - vHeaderChain.begin();
+    NodeId nFrom = vHeaderChainInfo[i].nFrom;
+    LogPrintf("block %s at %d of the header chain is invalid, dropping it and the %u headers after it\n",
+              hash.ToString(), nHeaderChainStart + i, vHeaderChain.size() - i - 1);
+    TruncateHeaderChain(i);
+    if (nHeadersSyncPeer == nFrom)
+        DropHeadersSyncPeer();
+    CNodeState *state = State(nFrom);
+    if (state)
+        state->fHeadersSyncFailed = true;
+    Misbehaving(nFrom, 100);
+}
+
+static void MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    CNodeState *state = State(it->second.first);
+    if (state)
+        state->nBlocksInFlight--;
+    mapBlocksInFlight.erase(it);
+}
+
+// Give up on block requests that have gone unanswered too long, so that
+// other peers can take them over
+static void ExpireBlocksInFlight()
+{
+    int64_t nCutoff = GetTime() - BLOCK_DOWNLOAD_TIMEOUT;
+    map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.begin();
+    while (it != mapBlocksInFlight.end())
+    {
+        if (it->second.second < nCutoff)
+        {
+            LogPrint("net", "block %s from peer=%d timed out\n", it->first.ToString(), it->second.first);
+            CNodeState *state = State(it->second.first);
+            if (state)
+                state->nBlocksInFlight--;
+            mapBlocksInFlight.erase(it++);
+        }
+        else
+            ++it;
+    }
+}
+
+// Request blocks of the header chain from pto, up to its in-flight limit
+// and no further than the download window past the first block that isn't
+// connected yet
+static void RequestHeaderChainBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    if (pto->fInbound || pto->fClient || pto->fOneShot || pto->fDisconnect || !pto->fSuccessfullyConnected ||
+        (pto->nVersion >= NOBLKS_VERSION_START && pto->nVersion < NOBLKS_VERSION_END))
+        return;
+    CNodeState *state = State(pto->GetId());
+    if (state == NULL)
+        return;
+
+    // Blocks past the window would be held as orphans, and must not be
+    // pruned from there before they can be connected
+    int nWindow = std::min((int64_t)BLOCK_DOWNLOAD_WINDOW, GetArg("-maxorphanblocks", DEFAULT_MAX_ORPHAN_BLOCKS));
+    int nPeerHeight = std::max(pto->nStartingHeight, state->nHeadersHeight);
+    int64_t nNow = GetTime();
+    for (int i = 0; i < nWindow && i < (int)vHeaderChain.size() && state->nBlocksInFlight < MAX_BLOCKS_IN_FLIGHT_PER_PEER; i++)
+    {
+        if (nHeaderChainStart + i > nPeerHeight)
+            break;
+        const uint256& hash = vHeaderChain[i];
+        if (mapBlocksInFlight.count(hash) || mapOrphanBlocks.count(hash) || mapBlockIndex.count(hash) ||
+            state->setBadBlockBodies.count(hash))
+            continue;
+        mapBlocksInFlight.insert(make_pair(hash, make_pair(pto->GetId(), nNow)));
+        state->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+
 bool static IsCanonicalBlockSignature(CBlock* pblock)
 {
     if (pblock->IsProofOfWork()) {
@@ -2988,8 +3927,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblock->IsProofOfStake())
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+            // Ask this guy to fill in what we're missing, unless the
+            // header chain download already has it in hand
+            if (!IsHeadersSyncing())
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
             // ppcoin: getblocks may not obtain the ancestor block rejected
             // earlier by duplicate-stake check so we ask for it again directly
             if (!IsInitialBlockDownload())
@@ -3100,7 +4041,9 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
 
     if (nSearchTime > nLastCoinStakeSearchTime)
     {
-        int64_t nSearchInterval = 1;
+        // Cover every timestamp since the last search, in case it took
+        // longer than one timestamp slot
+        int64_t nSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
         if (wallet.CreateCoinStake(wallet, nBits, nSearchInterval, nFees, txCoinStake, key))
         {
             if (txCoinStake.nTime >= pindexBest->GetPastTimeLimit()+1)
@@ -3108,6 +4051,7 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
                 // make sure coinstake would meet timestamp protocol
                 //    as it would be the same as the block timestamp
                 vtx[0].nTime = nTime = txCoinStake.nTime;
+                vtx[0].InvalidateHash();
 
                 // we have to make sure that we have no future timestamps in
                 //    our transactions set
@@ -3171,12 +4115,6 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
-{
-    string strBlockFn = strprintf("blk%04u.dat", nFile);
-    return GetDataDir() / strBlockFn;
-}
-
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == (unsigned int) -1))
@@ -3196,6 +4134,8 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 }
 
 static unsigned int nCurrentBlockFile = 1;
+// First block file appended to without a sync, 0 if none
+static unsigned int nUnsyncedBlockFile = 0;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
 {
@@ -3210,6 +4150,8 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
         // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
         if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
         {
+            if (fDeferDBCommits && nUnsyncedBlockFile == 0)
+                nUnsyncedBlockFile = nCurrentBlockFile;
             nFileRet = nCurrentBlockFile;
             return file;
         }
@@ -3218,6 +4160,21 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+bool SyncBlockFiles()
+{
+    if (nUnsyncedBlockFile == 0)
+        return true;
+    for (unsigned int nFile = nUnsyncedBlockFile; nFile <= nCurrentBlockFile; nFile++)
+    {
+        CAutoFile file = CAutoFile(OpenBlockFile(nFile, 0, "ab"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("SyncBlockFiles() : OpenBlockFile %u failed", nFile);
+        FileCommit(file.Get());
+    }
+    nUnsyncedBlockFile = 0;
+    return true;
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     LOCK(cs_main);
@@ -3262,7 +4219,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3336,62 +4293,106 @@ void PrintBlockTree()
     }
 }
 
+// Process blocks read from an external file, hashing the proof-of-work
+// headers among them in one batch first. Stops at the first block
+// ProcessBlock rejects and returns its index, or vBlock.size().
+static unsigned int ProcessExternalBlocks(vector<CBlock>& vBlock, int& nLoaded)
+{
+    vector<const CBlock*> vpblockPoW;
+    BOOST_FOREACH(const CBlock& block, vBlock)
+        if (block.IsProofOfWork())
+            vpblockPoW.push_back(&block);
+    PrecomputePoWHashes(vpblockPoW);
+
+    LOCK(cs_main);
+    unsigned int i = 0;
+    for (; i < vBlock.size(); i++)
+    {
+        if (!ProcessBlock(NULL, &vBlock[i]))
+            break;
+        nLoaded++;
+    }
+    vBlock.clear();
+    return i;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
     int64_t nStart = GetTimeMillis();
 
+    // Blocks are read ahead this many at a time. As before batching, the
+    // scan resumes just past the message start of a block ProcessBlock
+    // rejects, and the blocks read after it are read again from there.
+    static const unsigned int BLOCK_BATCH_SIZE = 16;
+
     int nLoaded = 0;
+    vector<CBlock> vBlock;
+    vector<unsigned int> vBlockPos;
+    vBlock.reserve(BLOCK_BATCH_SIZE);
     {
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
-            {
-                boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat.Get(), nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat.Get());
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
+        CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+        unsigned int nPos = 0;
+        while (nPos != (unsigned int)-1)
+        {
+            try {
+                while (nPos != (unsigned int)-1 && blkdat.good())
+                {
+                    boost::this_thread::interruption_point();
+                    unsigned char pchData[65536];
+                    do {
+                        fseek(blkdat.Get(), nPos, SEEK_SET);
+                        int nRead = fread(pchData, 1, sizeof(pchData), blkdat.Get());
+                        if (nRead <= 8)
                         {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
+                            nPos = (unsigned int)-1;
                             break;
                         }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat.Get(), nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
-                {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
+                        void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
+                        if (nFind)
+                        {
+                            if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
+                            {
+                                nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
+                                break;
+                            }
+                            nPos += ((unsigned char*)nFind - pchData) + 1;
+                        }
+                        else
+                            nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
+                        boost::this_thread::interruption_point();
+                    } while(true);
+                    if (nPos == (unsigned int)-1)
+                        break;
+                    fseek(blkdat.Get(), nPos, SEEK_SET);
+                    unsigned int nSize;
+                    blkdat >> nSize;
+                    if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
                     {
-                        nLoaded++;
+                        CBlock block;
+                        blkdat >> block;
+                        vBlock.push_back(block);
+                        vBlockPos.push_back(nPos);
                         nPos += 4 + nSize;
+                        if (vBlock.size() >= BLOCK_BATCH_SIZE)
+                            break;
                     }
                 }
             }
-        }
-        catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+            catch (std::exception &e) {
+                LogPrintf("%s() : Deserialize or I/O error caught during load\n",
+                       __PRETTY_FUNCTION__);
+                nPos = (unsigned int)-1;
+            }
+
+            if (vBlock.empty())
+                break;
+            unsigned int nRejected = ProcessExternalBlocks(vBlock, nLoaded);
+            if (nRejected < vBlockPos.size())
+            {
+                nPos = vBlockPos[nRejected];
+                blkdat.clear(0);
+            }
+            vBlockPos.clear();
         }
     }
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
@@ -3415,25 +4416,253 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("PHC-loadblk");
 
-    CImportingNow imp;
+    {
+        CImportingNow imp;
+
+        // -loadblock=
+        BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
+            FILE *file = fopen(path.string().c_str(), "rb");
+            if (file)
+                LoadExternalBlockFile(file);
+        }
+
+        // hardcoded $DATADIR/bootstrap.dat
+        filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
+        if (filesystem::exists(pathBootstrap)) {
+            FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
+            if (file) {
+                filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+                LoadExternalBlockFile(file);
+                RenameOver(pathBootstrap, pathBootstrapOld);
+            }
+        }
+    }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// mempool.dat
+//
+
+// mempool.dat holds the network magic, the format version, the number of
+// transactions, each transaction with the time it entered the pool, and a
+// checksum of all that, like peers.dat
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+// Transactions whose inputs are read ahead together while loading
+static const unsigned int MEMPOOL_LOAD_BATCH = 1000;
+
+// Not set until mempool.dat has been loaded, so that shutting down while
+// that runs doesn't replace the file with part of it
+static volatile bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    {
+        LOCK(mempool.cs);
+        vEntries.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vEntries.push_back(make_pair(mi->second.GetTx(), mi->second.GetTime()));
+    }
+    int64_t nCopied = GetTimeMillis();
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    uint64_t nVersion = MEMPOOL_DUMP_VERSION;
+    uint64_t nCount = vEntries.size();
+    ss << FLATDATA(Params().MessageStart()) << VARINT(nVersion) << VARINT(nCount);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        uint64_t nTime = std::max((int64_t)0, vEntries[i].second);
+        ss << vEntries[i].first << VARINT(nTime);
+    }
+    uint256 hash = Hash(ss.begin(), ss.end());
+    ss << hash;
+
+    // Write a new file and move it over the old one
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("DumpMempool() : open failed");
+    try {
+        fileout << ss;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    LogPrintf("Dumped mempool: %u transactions, %u bytes, %dms to copy, %dms to write\n",
+        vEntries.size(), ss.size(), nCopied - nStart, GetTimeMillis() - nCopied);
+    return true;
+}
+
+static bool ReadMempoolDump(std::vector<std::pair<CTransaction, int64_t> >& vEntries)
+{
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    if (!boost::filesystem::exists(pathMempool))
+        return false;
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("LoadMempool() : open failed");
+
+    std::size_t fileSize = boost::filesystem::file_size(pathMempool);
+    if (fileSize < sizeof(uint256))
+        return error("LoadMempool() : file too short");
+    vector<unsigned char> vchData(fileSize - sizeof(uint256));
+    uint256 hashIn;
+    try {
+        if (!vchData.empty())
+            filein.read((char *)&vchData[0], vchData.size());
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error");
+    }
+    filein.fclose();
+
+    CDataStream ss(vchData, SER_DISK, CLIENT_VERSION);
+    if (Hash(ss.begin(), ss.end()) != hashIn)
+        return error("LoadMempool() : checksum mismatch; data corrupted");
+
+    try {
+        unsigned char pchMsgTmp[4];
+        uint64_t nVersion, nCount;
+        ss >> FLATDATA(pchMsgTmp) >> VARINT(nVersion) >> VARINT(nCount);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("LoadMempool() : invalid network magic number");
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unknown version %u", nVersion);
+
+        vEntries.reserve(std::min(nCount, (uint64_t)ss.size() / 60));
+        while (nCount-- > 0)
+        {
+            vEntries.push_back(std::make_pair(CTransaction(), 0));
+            uint64_t nTime;
+            ss >> vEntries.back().first >> VARINT(nTime);
+            vEntries.back().second = nTime;
+        }
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : stream data corrupted");
+    }
+    return true;
+}
 
-    // -loadblock=
-    BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
-        FILE *file = fopen(path.string().c_str(), "rb");
-        if (file)
-            LoadExternalBlockFile(file);
+// Reads the previous transactions of a batch being loaded into the coins
+// cache, leaving AcceptToMemoryPool mostly memory lookups
+static void ThreadPrefetchMempoolInputs(const std::vector<uint256>* pvHash, unsigned int nThread, unsigned int nThreads)
+{
+    CTxDB txdb("r");
+    for (unsigned int i = nThread; i < pvHash->size(); i += nThreads)
+    {
+        const uint256& hash = (*pvHash)[i];
+        CTxIndex txindex;
+        CCoins coins;
+        if (!txdb.ReadTxIndex(hash, txindex) || coinsCache.Get(hash, coins))
+            continue;
+        CTransaction txPrev;
+        if (txPrev.ReadFromDisk(txindex.pos))
+            coinsCache.Add(hash, CCoins(txPrev));
     }
+}
 
-    // hardcoded $DATADIR/bootstrap.dat
-    filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
-    if (filesystem::exists(pathBootstrap)) {
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LoadExternalBlockFile(file);
-            RenameOver(pathBootstrap, pathBootstrapOld);
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    if (!ReadMempoolDump(vEntries))
+    {
+        fMempoolLoaded = !ShutdownRequested();
+        return false;
+    }
+    int64_t nRead = GetTimeMillis();
+
+    // Parents before the children spending them
+    std::map<uint256, unsigned int> mapIndex;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        mapIndex[vEntries[i].first.GetHash()] = i;
+    std::vector<std::vector<unsigned int> > vChildren(vEntries.size());
+    std::vector<unsigned int> vParents(vEntries.size(), 0);
+    std::vector<unsigned int> vOrder;
+    vOrder.reserve(vEntries.size());
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        std::set<unsigned int> setParents;
+        BOOST_FOREACH(const CTxIn& txin, vEntries[i].first.vin)
+        {
+            std::map<uint256, unsigned int>::const_iterator it = mapIndex.find(txin.prevout.hash);
+            if (it != mapIndex.end() && it->second != i)
+                setParents.insert(it->second);
+        }
+        BOOST_FOREACH(unsigned int nParent, setParents)
+            vChildren[nParent].push_back(i);
+        vParents[i] = setParents.size();
+        if (setParents.empty())
+            vOrder.push_back(i);
+    }
+    for (unsigned int n = 0; n < vOrder.size(); n++)
+        BOOST_FOREACH(unsigned int nChild, vChildren[vOrder[n]])
+            if (--vParents[nChild] == 0)
+                vOrder.push_back(nChild);
+
+    unsigned int nThreads = std::max(1U, std::min(boost::thread::hardware_concurrency(), 8U));
+    unsigned int nAccepted = 0, nFailed = 0, nAlreadyThere = 0;
+    int64_t nPrefetchTime = 0, nAcceptingTime = 0;
+    for (unsigned int nBatch = 0; nBatch < vOrder.size() && !ShutdownRequested(); nBatch += MEMPOOL_LOAD_BATCH)
+    {
+        unsigned int nEnd = std::min((unsigned int)vOrder.size(), nBatch + MEMPOOL_LOAD_BATCH);
+
+        // Inputs from the chain; those from the file are in the pool by
+        // the time their spenders get there
+        int64_t nTime1 = GetTimeMillis();
+        std::set<uint256> setPrev;
+        for (unsigned int n = nBatch; n < nEnd; n++)
+            BOOST_FOREACH(const CTxIn& txin, vEntries[vOrder[n]].first.vin)
+                if (!mapIndex.count(txin.prevout.hash))
+                    setPrev.insert(txin.prevout.hash);
+        std::vector<uint256> vPrev(setPrev.begin(), setPrev.end());
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&ThreadPrefetchMempoolInputs, &vPrev, i, nThreads));
+        threads.join_all();
+
+        int64_t nTime2 = GetTimeMillis();
+        for (unsigned int n = nBatch; n < nEnd; n++)
+        {
+            CTransaction& tx = vEntries[vOrder[n]].first;
+            LOCK(cs_main);
+            if (mempool.exists(tx.GetHash()))
+                nAlreadyThere++;
+            else if (AcceptToMemoryPool(mempool, tx, false, NULL, false, false, vEntries[vOrder[n]].second))
+                nAccepted++;
+            else
+                nFailed++;
         }
+        nPrefetchTime += nTime2 - nTime1;
+        nAcceptingTime += GetTimeMillis() - nTime2;
     }
+    // Transactions caught in a spending cycle can't be valid
+    nFailed += vEntries.size() - vOrder.size();
+
+    LogPrintf("Imported mempool transactions from disk: %u accepted, %u rejected, %u already there; "
+              "%dms reading, %dms prefetching inputs on %u threads, %dms accepting\n",
+        nAccepted, nFailed, nAlreadyThere, nRead - nStart, nPrefetchTime, nThreads, nAcceptingTime);
+    fMempoolLoaded = !ShutdownRequested();
+    return true;
 }
 
 
@@ -3563,12 +4792,25 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // Disk and network serializations of a block are the same,
+                    // so send the stored bytes as they are. The header hash
+                    // check guards against a stale or damaged index entry.
+                    CBlockIndex* pindex = (*mi).second;
+                    CBlockDiskView view;
+                    if (ReadBlockBytes(pindex->nFile, pindex->nBlockPos, view) &&
+                        Hash(view.begin(), view.begin() + 80) == inv.hash)
+                    {
+                        pfrom->PushMessageRaw("block", view.begin(), view.size());
+                    }
+                    else
+                    {
+                        CBlock block;
+                        block.ReadFromDisk(pindex);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3915,9 +5157,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting)
+                if (!fImporting && !(inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
                     pfrom->AskFor(inv);
-            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash) && !IsHeadersSyncing()) {
                 PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
@@ -3998,14 +5240,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         LOCK(cs_main);
 
+        // Still syncing ourselves: say so with an empty reply, so that a
+        // headers-first peer moves on instead of waiting for a timeout
         if (IsInitialBlockDownload())
+        {
+            pfrom->PushMessage("headers", vector<CBlock>());
             return true;
+        }
 
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -4019,7 +5266,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -4031,6 +5278,58 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+
+        // Only the peer the header chain is being fetched from is listened to
+        if (pfrom->GetId() != nHeadersSyncPeer)
+            return true;
+        nHeadersRequestTime = 0;
+
+        if (vHeaders.empty())
+        {
+            // Nothing to offer, e.g. because the peer is still syncing itself
+            if (!IsHeadersSyncing())
+            {
+                LogPrint("net", "no headers from peer=%d, falling back to getblocks\n", pfrom->GetId());
+                DropHeadersSyncPeer();
+                PushGetBlocks(pfrom, pindexBest, uint256(0));
+            }
+            return true;
+        }
+
+        bool fAccepted = AcceptHeaders(pfrom, vHeaders);
+        if (!vHeaderChain.empty())
+        {
+            CNodeState *state = State(pfrom->GetId());
+            if (state)
+                state->nHeadersHeight = nHeaderChainStart + vHeaderChain.size() - 1;
+        }
+        LogPrint("net", "received %u headers from peer=%d, header chain at %d\n", vHeaders.size(), pfrom->GetId(), nHeaderChainStart + (int)vHeaderChain.size() - 1);
+        if (!fAccepted)
+        {
+            // Carry on with this peer the old way; the headers accepted so
+            // far stay, and another peer is asked for the rest
+            DropHeadersSyncPeer();
+            PushGetBlocks(pfrom, pindexBest, uint256(0));
+            return false;
+        }
+
+        // A full message means the peer has more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+            PushGetHeaders(pfrom);
+    }
+
+
     else if (strCommand == "tx"|| strCommand == "dstx")
     {
         vector<uint256> vWorkQueue;
@@ -4148,7 +5447,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             AddOrphanTx(tx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            size_t nMaxOrphanUsage = (size_t)std::max((int64_t)0, GetArg("-maxorphanmem", DEFAULT_MAX_ORPHAN_MEMORY)) * 1000000;
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, nMaxOrphanUsage);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         }
@@ -4172,9 +5472,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->AddInventoryKnown(inv);
 
         LOCK(cs_main);
+        MarkBlockReceived(hashBlock);
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+        if (block.nDoS)
+        {
+            Misbehaving(pfrom->GetId(), block.nDoS);
+            HeaderChainBlockInvalid(pfrom, block);
+        }
         if (fSecMsgEnabled)
             SecureMsgScanBlock(block);
     }
@@ -4514,9 +5819,39 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
+            if (fHeadersFirst && IsInitialBlockDownload()) {
+                if (nHeadersSyncPeer == -1)
+                    PushGetHeaders(pto);
+            } else
+                PushGetBlocks(pto, pindexBest, uint256(0));
+        }
+
+        // Fall back to getblocks if the headers sync peer doesn't answer
+        if (pto->GetId() == nHeadersSyncPeer && nHeadersRequestTime && GetTime() - nHeadersRequestTime > HEADERS_RESPONSE_TIMEOUT) {
+            LogPrint("net", "headers request to peer=%d timed out, dropping the header chain\n", pto->GetId());
+            DropHeadersSyncPeer();
+            ResetHeaderChain();
+            PushGetBlocks(pto, pindexBest, uint256(0));
+        }
+
+        // Give up on a header chain whose next block nobody delivers, e.g.
+        // because its proof-of-stake headers were made up
+        if (IsHeadersSyncing() && GetTime() - nHeaderChainProgressTime > HEADER_CHAIN_STALL_TIMEOUT) {
+            LogPrint("net", "no block of the header chain connected for %ds, dropping the header chain\n", GetTime() - nHeaderChainProgressTime);
+            CNodeState *state = State(vHeaderChainInfo.front().nFrom);
+            if (state)
+                state->fHeadersSyncFailed = true;
+            DropHeadersSyncPeer();
+            ResetHeaderChain();
             PushGetBlocks(pto, pindexBest, uint256(0));
         }
 
+        // Headers sync without a peer: carry on with one that hasn't let
+        // us down yet, or with getblocks once there is none left
+        if (fHeadersFirst && nHeadersSyncPeer == -1 && !fImporting && !fReindex &&
+            IsInitialBlockDownload() && IsHeadersSyncCandidate(pto))
+            PushGetHeaders(pto);
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -4637,6 +5972,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+        if (IsHeadersSyncing()) {
+            ExpireBlocksInFlight();
+            RequestHeaderChainBlocks(pto, vGetData);
+        }
         int64_t nNow = GetTime() * 1000000;
         CTxDB txdb("r");
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
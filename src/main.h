@@ -6,15 +6,20 @@
 #define BITCOIN_MAIN_H
 
 #include "core.h"
+#include "blockfile.h"
 #include "bignum.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
 
+#include <deque>
 #include <list>
 
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CValidationState;
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 1513486992 //GMT: Sunday, December 17, 2017 5:03:12 AM
@@ -37,6 +42,7 @@ class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CTxMemPool;
 class CWallet;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
@@ -55,8 +61,50 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Default for -maxorphanmem, memory for orphan transactions in megabytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_MEMORY = 10;
+/** Default for -maxmempool, memory for the transaction memory pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, most in-pool ancestors a new transaction may have, itself included */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, most kilobytes a new transaction and its in-pool ancestors may take */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, most in-pool descendants a pool transaction may have, itself included */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, most kilobytes a pool transaction and its in-pool descendants may take */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -persistmempool, keep the memory pool in mempool.dat across restarts */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between writes of mempool.dat while running */
+static const int64_t DUMP_MEMPOOL_INTERVAL = 900;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Default for -coinscache, size of the in-memory cache of previous transaction outputs in megabytes */
+static const unsigned int DEFAULT_COINS_CACHE_SIZE = 32;
+/** Default for -dbcache, memory for the transaction database in megabytes */
+static const unsigned int DEFAULT_DB_CACHE = 100;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads rebuilding the address index (-reindexaddrthreads) */
+static const int MAX_ADDRINDEX_THREADS = 16;
+/** Default for -headersfirst, fetch the header chain before its blocks during initial sync */
+static const bool DEFAULT_HEADERS_FIRST = true;
+/** Maximum number of headers in one "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks that can be requested from one peer at a time in headers-first sync */
+static const int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+/** How far past the first unconnected block of the header chain blocks are requested */
+static const int BLOCK_DOWNLOAD_WINDOW = 512;
+/** Seconds before an unanswered block request is handed to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds to wait for a "headers" reply before falling back to getblocks */
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 60;
+/** Seconds without a block of the header chain getting connected before the chain is dropped */
+static const int64_t HEADER_CHAIN_STALL_TIMEOUT = 600;
+/** Headers accepted from a peer past the height it announced, besides those found since it connected */
+static const int MAX_HEADERS_PAST_STARTING_HEIGHT = 100;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 1000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -80,7 +128,15 @@ inline int64_t GetMNCollateral(int nHeight) { return 10000; }
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+
+/** Block hashes are already uniformly distributed; use their low bits as is */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -94,11 +150,15 @@ extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
+extern int64_t nLastBlockTemplateTime;
 extern int64_t nLastCoinStakeSearchInterval;
 extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern int nScriptCheckThreads;
+extern bool fHeadersFirst;
+extern bool fDeferDBCommits;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
@@ -113,7 +173,9 @@ extern bool fLargeWorkInvalidChainFound;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
+class CCoins;
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -141,14 +203,28 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Commit to disk the block files appended to since they were last synced */
+bool SyncBlockFiles();
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+/** Block of the best chain at nHeight, or NULL if the chain isn't that long */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Bring the by-height index of the best chain in line with a new tip */
+void SetBestChainByHeight(CBlockIndex* pindexTip);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Write the memory pool to mempool.dat, once it has been loaded from there */
+bool DumpMempool();
+/** Add the transactions in mempool.dat back to the memory pool */
+bool LoadMempool();
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
+/** Hash the proof-of-work of several block headers in one batch, so that
+ *  GetPoWHash() finds them already computed */
+void PrecomputePoWHashes(const std::vector<const CBlock*>& vpblock);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
 int64_t GetProofOfWorkReward(int nHeight, int64_t nFees);
 int64_t GetProofOfStakeReward(const CBlockIndex* pindexPrev, int64_t nCoinAge, int64_t nFees);
@@ -161,15 +237,25 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 void ThreadStakeMiner(CWallet *pwallet);
 
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool, as arriving at nAcceptTime (default: now) **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool ignoreFees=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool ignoreFees=false,
+                        int64_t nAcceptTime=0);
 
 bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectInsaneFee=false, bool isDSTX=false);
 
+/** Memory the transaction memory pool may take, from -maxmempool */
+size_t GetMaxMempoolSize();
+/** Number of orphan transactions held, and the memory they take */
+unsigned int GetOrphanTxStats(size_t* pnUsage);
+
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
+/** Rebuild the address index of the best chain, resuming an interrupted rebuild */
+bool RebuildAddressIndex();
+/** Address index id of a key or script destination */
+bool GetAddrIndexId(const CTxDestination &dest, uint160 &addrid);
+bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash, int nSkip=0, int nCount=-1);
 
 int GetInputAge(CTxIn& vin);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
@@ -183,6 +269,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue);
 
 struct CNodeStateStats {
     int nMisbehavior;
+    int nBlocksInFlight;
 };
 
 
@@ -242,7 +329,7 @@ enum GetMinFee_mode
     GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+typedef std::map<uint256, std::pair<CTxIndex, CCoins> > MapPrevTx;
 
 int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree, enum GetMinFee_mode mode);
 
@@ -265,18 +352,66 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
-    CTransaction()
+private:
+    // Memoized GetHash() result, see InvalidateHash(). Const transactions
+    // are shared between threads (script check workers, prefetch threads),
+    // so the first thread to finish hashing claims the slot, writes it and
+    // publishes it with release; readers only trust it after an acquire.
+    enum { HASH_NONE, HASH_WRITING, HASH_CACHED };
+    mutable uint256 hashCached;
+    mutable boost::atomic<int> nHashState;
+
+    bool HashCached() const
+    {
+        return nHashState.load(boost::memory_order_acquire) == HASH_CACHED;
+    }
+
+    void StoreHash(const uint256& hash) const
+    {
+        int nExpected = HASH_NONE;
+        if (nHashState.compare_exchange_strong(nExpected, HASH_WRITING, boost::memory_order_acquire))
+        {
+            hashCached = hash;
+            nHashState.store(HASH_CACHED, boost::memory_order_release);
+        }
+    }
+
+public:
+    CTransaction() : nHashState(HASH_NONE)
     {
         SetNull();
     }
 
     CTransaction(int nVersion, unsigned int nTime, const std::vector<CTxIn>& vin, const std::vector<CTxOut>& vout, unsigned int nLockTime)
-        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0)
+        : nVersion(nVersion), nTime(nTime), vin(vin), vout(vout), nLockTime(nLockTime), nDoS(0), nHashState(HASH_NONE)
+    {
+    }
+
+    CTransaction(const CTransaction& tx)
+        : nVersion(tx.nVersion), nTime(tx.nTime), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime), nDoS(tx.nDoS), nHashState(HASH_NONE)
+    {
+        if (tx.HashCached())
+            StoreHash(tx.hashCached);
+    }
+
+    CTransaction& operator=(const CTransaction& tx)
     {
+        nVersion = tx.nVersion;
+        nTime = tx.nTime;
+        vin = tx.vin;
+        vout = tx.vout;
+        nLockTime = tx.nLockTime;
+        nDoS = tx.nDoS;
+        InvalidateHash();
+        if (tx.HashCached())
+            StoreHash(tx.hashCached);
+        return *this;
     }
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            nHashState.store(HASH_NONE, boost::memory_order_relaxed);
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(nTime);
@@ -293,6 +428,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        InvalidateHash();
     }
 
     bool IsNull() const
@@ -300,9 +436,31 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    /** The hash is computed on first use and remembered. Copies carry it
+        along with the data; deserializing and SetNull() reset it. Threads
+        racing on the first call each hash, one of them stores the result.
+     */
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        if (HashCached())
+            return hashCached;
+        uint256 hash = SerializeHash(*this);
+        StoreHash(hash);
+        return hash;
+    }
+
+    /** Compute the hashes of every transaction in vtx that has none
+        memoized yet, several at once where the SHA-256 engine allows.
+     */
+    static void CacheHashes(const std::vector<CTransaction>& vtx);
+
+    /** Drop the memoized hash. Code that changes the fields of a
+        transaction whose hash may already have been taken must call this
+        before the hash is used again.
+     */
+    void InvalidateHash()
+    {
+        nHashState.store(HASH_NONE, boost::memory_order_release);
     }
 
     bool IsCoinBase() const
@@ -346,6 +504,21 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            // Positional read through the shared block file handle cache
+            CBlockFileReader filein(pos.nFile, pos.nTxPos, SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (filein.IsNull())
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -432,11 +605,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock   true if called from ConnectBlock
         @param[in] fMiner   true if called from CreateNewBlock
+        @param[out] pvChecks    If not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true,
+                       std::vector<CScriptCheck>* pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -445,6 +620,169 @@ public:
 
 
 
+/** The parts of a transaction that spending its outputs depends on: the
+ *  outputs themselves, its timestamp and whether it is a coinbase or
+ *  coinstake. Much smaller than the full transaction, since the inputs and
+ *  their signatures are dropped.
+ */
+class CCoins
+{
+public:
+    unsigned int nTime;
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+
+    CCoins()
+    {
+        nTime = 0;
+        fCoinBase = false;
+        fCoinStake = false;
+    }
+
+    CCoins(const CTransaction& tx) : nTime(tx.nTime), fCoinBase(tx.IsCoinBase()), fCoinStake(tx.IsCoinStake()), vout(tx.vout) {}
+
+    bool IsCoinBase() const     { return fCoinBase; }
+    bool IsCoinStake() const    { return fCoinStake; }
+
+    /** Approximate heap and object memory held by this entry */
+    size_t DynamicUsage() const
+    {
+        size_t nUsage = sizeof(CCoins) + vout.capacity() * sizeof(CTxOut);
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            nUsage += txout.scriptPubKey.capacity();
+        return nUsage;
+    }
+
+    std::string ToString() const
+    {
+        std::string str;
+        str += IsCoinBase()? "CoinbaseCoins" : (IsCoinStake()? "CoinstakeCoins" : "CCoins");
+        str += strprintf("(nTime=%d, vout.size=%u)\n", nTime, vout.size());
+        for (unsigned int i = 0; i < vout.size(); i++)
+            str += "    " + vout[i].ToString() + "\n";
+        return str;
+    }
+};
+
+/** Size-bounded LRU cache of CCoins by transaction hash, so that validating
+ *  spends of recent transactions doesn't have to read them back from the
+ *  block files. Entries depend only on the transaction's contents, which its
+ *  hash commits to, so they never need invalidating on reorganization;
+ *  whether an output is spent is still tracked by CTxIndex.
+ */
+class CCoinsCache
+{
+private:
+    typedef std::list<uint256> lru_list;
+    typedef std::map<uint256, std::pair<CCoins, lru_list::iterator> > coins_map;
+
+    CCriticalSection cs;
+    size_t nMaxUsage;
+    size_t nUsage;
+    lru_list lru;
+    coins_map mapCoins;
+
+public:
+    CCoinsCache(size_t nMaxUsageIn) : nMaxUsage(nMaxUsageIn), nUsage(0) {}
+
+    bool Get(const uint256& hash, CCoins& coinsRet);
+    void Add(const uint256& hash, const CCoins& coins);
+    void SetMaxUsage(size_t nMaxUsageIn);
+    size_t GetUsage();
+};
+
+extern CCoinsCache coinsCache;
+
+
+
+
+/** Where the first failed script check of a block is recorded, so the
+ *  failure reported is the one a serial check would have hit first.
+ */
+class CScriptCheckResult
+{
+private:
+    mutable CCriticalSection cs;
+    bool fFailed;
+    unsigned int nTx;
+    unsigned int nIn;
+    bool fNonMandatory;
+
+public:
+    CScriptCheckResult() : fFailed(false), nTx(0), nIn(0), fNonMandatory(false) {}
+
+    /** Whether a check that comes before (nTxIn, nInIn) in the block has failed */
+    bool FailedBefore(unsigned int nTxIn, unsigned int nInIn) const
+    {
+        LOCK(cs);
+        return fFailed && (nTx < nTxIn || (nTx == nTxIn && nIn < nInIn));
+    }
+
+    void Fail(unsigned int nTxIn, unsigned int nInIn, bool fNonMandatoryIn)
+    {
+        LOCK(cs);
+        if (fFailed && (nTx < nTxIn || (nTx == nTxIn && nIn < nInIn)))
+            return;
+        fFailed = true;
+        nTx = nTxIn;
+        nIn = nInIn;
+        fNonMandatory = fNonMandatoryIn;
+    }
+
+    bool IsFailed() const               { LOCK(cs); return fFailed; }
+    unsigned int GetTx() const          { LOCK(cs); return nTx; }
+    bool IsNonMandatory() const         { LOCK(cs); return fNonMandatory; }
+};
+
+/** Closure representing one script verification, deferred from
+ *  ConnectInputs so it can run on the -par worker threads. Holds its own
+ *  copy of the scriptPubKey and shares the signature hash state of the
+ *  transaction with the checks of its other inputs; the spending
+ *  transaction must outlive it.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+    boost::shared_ptr<const CSignatureHashContext> psighash;
+    unsigned int nTx;
+    CScriptCheckResult* presult;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0), nTx(0), presult(0) {}
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& psighashIn = boost::shared_ptr<const CSignatureHashContext>()) :
+        scriptPubKey(scriptPubKeyIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighash(psighashIn), nTx(0), presult(0) {}
+
+    /** Set where the transaction sits in its block and where to report failure */
+    void SetResult(CScriptCheckResult* presultIn, unsigned int nTxIn)
+    {
+        presult = presultIn;
+        nTx = nTxIn;
+    }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck& check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+        psighash.swap(check.psighash);
+        std::swap(nTx, check.nTx);
+        std::swap(presult, check.presult);
+    }
+};
+
+
+
 
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
@@ -702,10 +1040,7 @@ public:
         return Hash(BEGIN(nVersion), END(nNonce));
     }
 
-    uint256 GetPoWHash() const
-    {
-        return scrypt_blockhash(CVOIDBEGIN(nVersion));
-    }
+    uint256 GetPoWHash() const;
 
     int64_t GetBlockTime() const
     {
@@ -750,18 +1085,21 @@ public:
 
     uint256 BuildMerkleTree() const
     {
+        CTransaction::CacheHashes(vtx);
         vMerkleTree.clear();
         BOOST_FOREACH(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            // The pairs of a level lie next to each other, so all of them
+            // are hashed in one call; an odd last entry is paired with itself
+            int nPairs = nSize / 2;
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            SHA256D64(vMerkleTree[j+nSize].begin(), vMerkleTree[j].begin(), nPairs);
+            if (nSize & 1)
+                vMerkleTree[j+nSize+nPairs] = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                                   BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
@@ -787,12 +1125,20 @@ public:
     {
         if (nIndex == -1)
             return 0;
+        unsigned char pair[64];
         BOOST_FOREACH(const uint256& otherside, vMerkleBranch)
         {
             if (nIndex & 1)
-                hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
+            {
+                memcpy(pair, otherside.begin(), 32);
+                memcpy(pair + 32, hash.begin(), 32);
+            }
             else
-                hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+            {
+                memcpy(pair, hash.begin(), 32);
+                memcpy(pair + 32, otherside.begin(), 32);
+            }
+            SHA256D64(hash.begin(), pair, 1);
             nIndex >>= 1;
         }
         return hash;
@@ -818,8 +1164,10 @@ public:
         fileout << *this;
 
         // Flush stdio buffers and commit to disk before returning
+        // While txdb commits are deferred, block files are synced before
+        // each batch of index updates is written instead
         fflush(fileout.Get());
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
+        if (!fDeferDBCommits && (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0))
             FileCommit(fileout.Get());
 
         return true;
@@ -829,16 +1177,34 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (filein.IsNull())
+        CBlockFileHandleRef handle = blockFileCache.Get(nFile);
+        if (!handle || nBlockPos < sizeof(unsigned int))
             return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
 
         // Read block
         try {
-            filein >> *this;
+            if (fReadTransactions)
+            {
+                // The size written just ahead of the block lets us fetch it
+                // with a single read and deserialize from memory
+                unsigned char buf[sizeof(unsigned int)];
+                if (handle->ReadAt((char*)buf, sizeof(buf), nBlockPos - sizeof(buf)) != (int64_t)sizeof(buf))
+                    return error("CBlock::ReadFromDisk() : read of block size failed");
+                unsigned int nSize = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((unsigned int)buf[3] << 24);
+                if (nSize < 80 || nSize > MAX_SIZE)
+                    return error("CBlock::ReadFromDisk() : bad block size %u", nSize);
+
+                CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+                ssBlock.resize(nSize);
+                if (handle->ReadAt(&ssBlock[0], nSize, nBlockPos) != (int64_t)nSize)
+                    return error("CBlock::ReadFromDisk() : read failed");
+                ssBlock >> *this;
+            }
+            else
+            {
+                CBlockFileReader filein(nFile, nBlockPos, SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+                filein >> *this;
+            }
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -885,7 +1251,6 @@ public:
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
-    void RebuildAddressIndex(CTxDB& txdb);
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
@@ -906,18 +1271,13 @@ private:
 class CBlockIndex
 {
 public:
+    // Members are ordered so that the 64-bit ones need no padding
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
     unsigned int nFile;
     unsigned int nBlockPos;
-    uint256 nChainTrust; // ppcoin: trust score of block chain
     int nHeight;
-#ifndef LOWMEM
-    int64_t nMint;
-    int64_t nMoneySupply;
-    int64_t nLastReward;
-#endif
     unsigned int nFlags;  // ppcoin: block index flags
     enum
     {
@@ -925,6 +1285,12 @@ public:
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
+    uint256 nChainTrust; // ppcoin: trust score of block chain
+#ifndef LOWMEM
+    int64_t nMint;
+    int64_t nMoneySupply;
+    int64_t nLastReward;
+#endif
 
     uint64_t nStakeModifier; // hash modifier for proof-of-stake
 #ifndef LOWMEM
@@ -943,6 +1309,10 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
+    // Allocated from a slab arena rather than one heap block each
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+
     CBlockIndex()
     {
         phashBlock = NULL;
@@ -1239,6 +1609,23 @@ class CBlockLocator
 {
 protected:
     std::vector<uint256> vHave;
+
+    // Append the hashes of the chain back from pindex
+    void Continue(const CBlockIndex* pindex, int nStep)
+    {
+        while (pindex)
+        {
+            vHave.push_back(pindex->GetBlockHash());
+
+            // Exponentially larger steps back
+            for (int i = 0; pindex && i < nStep; i++)
+                pindex = pindex->pprev;
+            if (vHave.size() > 10)
+                nStep *= 2;
+        }
+        vHave.push_back(Params().HashGenesisBlock());
+    }
+
 public:
 
     CBlockLocator()
@@ -1252,7 +1639,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1262,6 +1649,20 @@ public:
         vHave = vHaveIn;
     }
 
+    /** Locator for a chain of headers that continues past pindex: their
+     *  hashes from the tip back, then the chain back from pindex */
+    CBlockLocator(const std::deque<uint256>& vHeaders, const CBlockIndex* pindex)
+    {
+        int nStep = 1;
+        for (int i = (int)vHeaders.size() - 1; i >= 0; i -= nStep)
+        {
+            vHave.push_back(vHeaders[i]);
+            if (vHave.size() > 10)
+                nStep *= 2;
+        }
+        Continue(pindex, nStep);
+    }
+
     IMPLEMENT_SERIALIZE
     (
         if (!(nType & SER_GETHASH))
@@ -1282,18 +1683,7 @@ public:
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
-        int nStep = 1;
-        while (pindex)
-        {
-            vHave.push_back(pindex->GetBlockHash());
-
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
-            if (vHave.size() > 10)
-                nStep *= 2;
-        }
-        vHave.push_back(Params().HashGenesisBlock());
+        Continue(pindex, 1);
     }
 
     int GetDistanceBack()
@@ -1303,7 +1693,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1322,7 +1712,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1338,7 +1728,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
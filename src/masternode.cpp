@@ -38,29 +38,17 @@ bool GetBlockHash(uint256& hash, int nBlockHeight)
         return true;
     }
 
-    const CBlockIndex *BlockLastSolved = pindexBest;
-    const CBlockIndex *BlockReading = pindexBest;
+    if (pindexBest->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
+    // The block before nBlockHeight, or the tip for a negative height
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexBest->nHeight;
+    if (nHeight <= 0) return false;
 
-    int nBlocksAgo = 0;
-    if(nBlockHeight > 0) nBlocksAgo = (pindexBest->nHeight+1)-nBlockHeight;
-    assert(nBlocksAgo >= 0);
-
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
-
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return false;
+    const CBlockIndex *pindex = FindBlockByHeight(nHeight);
+    if (!pindex) return false;
+    hash = pindex->GetBlockHash();
+    mapCacheBlockHashes[nBlockHeight] = hash;
+    return true;
 }
 
 CMasternode::CMasternode()
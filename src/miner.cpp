@@ -5,6 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "txdb.h"
+#include "txmempool.h"
 #include "miner.h"
 #include "kernel.h"
 #include "masternodeman.h"
@@ -39,45 +40,27 @@ static const unsigned int pSHA256InitState[8] =
 
 void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 {
-    SHA256_CTX ctx;
+    uint32_t state[8];
     unsigned char data[64];
 
-    SHA256_Init(&ctx);
-
     for (int i = 0; i < 16; i++)
         ((uint32_t*)data)[i] = ByteReverse(((uint32_t*)pinput)[i]);
 
     for (int i = 0; i < 8; i++)
-        ctx.h[i] = ((uint32_t*)pinit)[i];
+        state[i] = ((uint32_t*)pinit)[i];
 
-    SHA256_Update(&ctx, data, sizeof(data));
+    SHA256Compress(state, data);
     for (int i = 0; i < 8; i++)
-        ((uint32_t*)pstate)[i] = ctx.h[i];
+        ((uint32_t*)pstate)[i] = state[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-};
-
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
+int64_t nLastBlockTemplateTime = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -100,6 +83,24 @@ public:
     }
 };
 
+// Heap order for transactions whose last pool parent just went into the
+// block: the best fee rate on top, as in the pool's own order
+struct ReleasedCompare
+{
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        return CTxMemPool::CompareFeeRate()(b, a);
+    }
+};
+
+static bool AllParentsIncluded(const uint256& hash, const set<uint256>& setIncluded)
+{
+    BOOST_FOREACH(const uint256& hashParent, mempool.GetLinks(hash).setParents)
+        if (!setIncluded.count(hashParent))
+            return false;
+    return true;
+}
+
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
 {
@@ -167,110 +168,80 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     int64_t nFees = 0;
     {
         LOCK2(cs_main, mempool.cs);
-        CTxDB txdb("r");
+        int64_t nTimeStart = GetTimeMicros();
 //>PHC<
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        // Fees, sizes, sigops and input ages were worked out when the pool
+        // accepted each transaction and its inputs were checked then, so
+        // nothing here reads from disk. Transactions are taken by priority
+        // while there is room set aside for that, then down the pool's fee
+        // rate order. One spending from another pool transaction waits
+        // until all of its pool parents are in the block.
+        set<uint256> setIncluded;
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        int nBlockSigOps = 100;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
 
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        TxPriorityCompare comparer(false);
+        if (!fSortedByFee)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
+            vecPriority.reserve(mempool.mapTx.size());
+            for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            {
+                const CTxMemPoolEntry& entry = mi->second;
+                if (mempool.GetLinks(mi->first).setParents.empty())
+                    vecPriority.push_back(TxPriority(entry.GetPriority(nHeight), entry.GetFeePerKb(), &entry));
+            }
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        const CTxMemPool::setEntriesByFeeRate& setByFeeRate = mempool.GetEntriesByFeeRate();
+        CTxMemPool::setEntriesByFeeRate::const_iterator itFeeRate = setByFeeRate.begin();
+        vector<const CTxMemPoolEntry*> vReleased;
+
+        while (true)
+        {
+            // Take the best transaction of the current order
+            const CTxMemPoolEntry* pentry;
+            if (!fSortedByFee)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                if (vecPriority.empty())
                 {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+                    fSortedByFee = true;
                     continue;
                 }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
+                pentry = vecPriority.front().get<2>();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
+            else if (!vReleased.empty() && (itFeeRate == setByFeeRate.end() || CTxMemPool::CompareFeeRate()(vReleased.front(), *itFeeRate)))
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                pentry = vReleased.front();
+                std::pop_heap(vReleased.begin(), vReleased.end(), ReleasedCompare());
+                vReleased.pop_back();
             }
+            else if (itFeeRate != setByFeeRate.end())
+                pentry = *itFeeRate++;
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+                break;
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTransaction& tx = pentry->GetTx();
+            uint256 hash = tx.GetHash();
+            if (setIncluded.count(hash) || !AllParentsIncluded(hash, setIncluded) || !IsFinalTx(tx, nHeight))
+                continue;
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            double dPriority = pentry->GetPriority(nHeight);
+            double dFeePerKb = pentry->GetFeePerKb();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->GetTxSize();
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+            // Limits on sigOps, legacy and P2SH:
+            unsigned int nTxSigOps = pentry->GetSigOps();
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -283,77 +254,59 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                 continue;
 
             // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
+            // transactions; the fee rate order comes back to this one in its turn
             if (!fSortedByFee &&
                 ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
             {
                 fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
+            }
 
             // Added
             pblock->vtx.push_back(tx);
+            setIncluded.insert(hash);
             nBlockSize += nTxSize;
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+            nFees += pentry->GetFee();
 
             if (fDebug && GetBoolArg("-printpriority", false))
             {
                 LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
+                       dPriority, dFeePerKb, hash.ToString());
             }
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            // Transactions that were waiting for this one may go in now
+            BOOST_FOREACH(const uint256& hashChild, mempool.GetLinks(hash).setChildren)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                if (!AllParentsIncluded(hashChild, setIncluded))
+                    continue;
+                const CTxMemPoolEntry& child = mempool.mapTx.find(hashChild)->second;
+                if (fSortedByFee)
                 {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                    vReleased.push_back(&child);
+                    std::push_heap(vReleased.begin(), vReleased.end(), ReleasedCompare());
+                }
+                else
+                {
+                    vecPriority.push_back(TxPriority(child.GetPriority(nHeight), child.GetFeePerKb(), &child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
                 }
             }
         }
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
+        nLastBlockTemplateTime = GetTimeMicros() - nTimeStart;
 
         if (fDebug && GetBoolArg("-printpriority", false))
             LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 // >PHC<
         if (!fProofOfStake)
+        {
             pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight + 1, nFees);
+            pblock->vtx[0].InvalidateHash();
+        }
 
         if (pFees)
             *pFees = nFees;
@@ -384,6 +337,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].InvalidateHash();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -6,6 +6,7 @@
 #include "db.h"
 #include "net.h"
 #include "main.h"
+#include "txmempool.h"
 #include "addrman.h"
 #include "chainparams.h"
 #include "core.h"
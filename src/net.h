@@ -781,6 +781,23 @@ public:
         }
     }
 
+    /** Send a message whose payload is already serialized, e.g. a block
+     *  copied straight out of its block file */
+    void PushMessageRaw(const char* pszCommand, const char* pch, size_t nSize)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            ssSend.write(pch, nSize);
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -36,26 +36,22 @@ HMAC_SHA256_Init(HMAC_SHA256_CTX * ctx, const void * _K, size_t Klen)
 
     /* If Klen > 64, the key is really SHA256(K). */
     if (Klen > 64) {
-        SHA256_Init(&ctx->ictx);
-        SHA256_Update(&ctx->ictx, K, Klen);
-        SHA256_Final(khash, &ctx->ictx);
+        ctx->ictx.Reset().Write(K, Klen).Finalize(khash);
         K = khash;
         Klen = 32;
     }
 
     /* Inner SHA256 operation is SHA256(K xor [block of 0x36] || data). */
-    SHA256_Init(&ctx->ictx);
     memset(pad, 0x36, 64);
     for (i = 0; i < Klen; i++)
         pad[i] ^= K[i];
-    SHA256_Update(&ctx->ictx, pad, 64);
+    ctx->ictx.Reset().Write(pad, 64);
 
     /* Outer SHA256 operation is SHA256(K xor [block of 0x5c] || hash). */
-    SHA256_Init(&ctx->octx);
     memset(pad, 0x5c, 64);
     for (i = 0; i < Klen; i++)
         pad[i] ^= K[i];
-    SHA256_Update(&ctx->octx, pad, 64);
+    ctx->octx.Reset().Write(pad, 64);
 
     /* Clean the stack. */
     memset(khash, 0, 32);
@@ -67,7 +63,7 @@ HMAC_SHA256_Update(HMAC_SHA256_CTX * ctx, const void *in, size_t len)
 {
 
     /* Feed data to the inner SHA256 operation. */
-    SHA256_Update(&ctx->ictx, in, len);
+    ctx->ictx.Write((const unsigned char *)in, len);
 }
 
 /* Finish an HMAC-SHA256 operation. */
@@ -77,13 +73,13 @@ HMAC_SHA256_Final(unsigned char digest[32], HMAC_SHA256_CTX * ctx)
     unsigned char ihash[32];
 
     /* Finish the inner SHA256 operation. */
-    SHA256_Final(ihash, &ctx->ictx);
+    ctx->ictx.Finalize(ihash);
 
     /* Feed the inner hash to the outer SHA256 operation. */
-    SHA256_Update(&ctx->octx, ihash, 32);
+    ctx->octx.Write(ihash, 32);
 
     /* Finish the outer SHA256 operation. */
-    SHA256_Final(digest, &ctx->octx);
+    ctx->octx.Finalize(digest);
 
     /* Clean the stack. */
     memset(ihash, 0, 32);
@@ -117,7 +113,7 @@ PBKDF2_SHA256(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
         be32enc(ivec, (uint32_t)(i + 1));
 
         /* Compute U_1 = PRF(P, S || INT(i)). */
-        memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
+        hctx = PShctx;
         HMAC_SHA256_Update(&hctx, ivec, 4);
         HMAC_SHA256_Final(U, &hctx);
 
@@ -143,6 +139,6 @@ PBKDF2_SHA256(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
     }
 
     /* Clean PShctx, since we never called _Final on it. */
-    memset(&PShctx, 0, sizeof(HMAC_SHA256_CTX));
+    memset((void *)&PShctx, 0, sizeof(HMAC_SHA256_CTX));
 }
 
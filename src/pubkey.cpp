@@ -4,13 +4,83 @@
 
 #include "pubkey.h"
 
+#include <map>
+
 #include <secp256k1.h>
 #include <secp256k1_recovery.h>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
 namespace
 {
 /* Global secp256k1_context object used for verification. */
 secp256k1_context* secp256k1_context_verify = NULL;
+
+/** Parsed form of recently verified public keys.
+ *
+ * Parsing is a field square root for compressed keys and an on-curve check
+ * for uncompressed ones, and the same few keys (stakers, masternodes, busy
+ * addresses) sign over and over. Split into shards by key byte so the
+ * script-check threads rarely wait on each other.
+ */
+class CParsedPubKeyCache
+{
+private:
+    static const unsigned int SHARDS = 16;
+    static const unsigned int MAX_ENTRIES_PER_SHARD = 1024;
+
+    struct Shard
+    {
+        boost::mutex mutex;
+        std::map<CPubKey, secp256k1_pubkey> map;
+    };
+    Shard shards[SHARDS];
+
+    Shard& GetShard(const CPubKey& key)
+    {
+        // The first byte is just the 02/03/04 prefix; the last is well mixed
+        return shards[key[key.size() - 1] % SHARDS];
+    }
+
+public:
+    bool Parse(const CPubKey& key, secp256k1_pubkey& pubkey)
+    {
+        Shard& shard = GetShard(key);
+        {
+            boost::unique_lock<boost::mutex> lock(shard.mutex);
+            std::map<CPubKey, secp256k1_pubkey>::const_iterator it = shard.map.find(key);
+            if (it != shard.map.end()) {
+                pubkey = it->second;
+                return true;
+            }
+        }
+
+        if (!secp256k1_ec_pubkey_parse(secp256k1_context_verify, &pubkey, key.begin(), key.size()))
+            return false;
+
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        if (shard.map.size() >= MAX_ENTRIES_PER_SHARD) {
+            // Evict the neighbour of the new key, which is as good as random
+            std::map<CPubKey, secp256k1_pubkey>::iterator it = shard.map.lower_bound(key);
+            if (it == shard.map.end())
+                it = shard.map.begin();
+            shard.map.erase(it);
+        }
+        shard.map.insert(std::make_pair(key, pubkey));
+        return true;
+    }
+
+    void Clear()
+    {
+        for (unsigned int i = 0; i < SHARDS; i++) {
+            boost::unique_lock<boost::mutex> lock(shards[i].mutex);
+            shards[i].map.clear();
+        }
+    }
+};
+
+CParsedPubKeyCache parsedPubKeyCache;
 }
 
 /** This function is taken from the libsecp256k1 distribution and implements
@@ -169,7 +239,7 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
         return false;
     secp256k1_pubkey pubkey;
     secp256k1_ecdsa_signature sig;
-    if (!secp256k1_ec_pubkey_parse(secp256k1_context_verify, &pubkey, &(*this)[0], size())) {
+    if (!parsedPubKeyCache.Parse(*this, pubkey)) {
         return false;
     }
     if (vchSig.size() == 0) {
@@ -297,6 +367,7 @@ ECCVerifyHandle::~ECCVerifyHandle()
     refcount--;
     if (refcount == 0) {
         assert(secp256k1_context_verify != NULL);
+        parsedPubKeyCache.Clear();
         secp256k1_context_destroy(secp256k1_context_verify);
         secp256k1_context_verify = NULL;
     }
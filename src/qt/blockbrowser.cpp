@@ -59,10 +59,7 @@ std::string getBlockHash(int Height)
     if (desiredheight < 0 || desiredheight > nBestHeight)
         return 0;
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > desiredheight)
-        pblockindex = pblockindex->pprev;
+    CBlockIndex* pblockindex = FindBlockByHeight(desiredheight);
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -5,6 +5,7 @@
 
 #include "rpcserver.h"
 #include "main.h"
+#include "txmempool.h"
 #include "kernel.h"
 #include "checkpoints.h"
 
@@ -199,10 +200,44 @@ Value getdifficulty(const Array& params, bool fHelp)
 
 Value getrawmempool(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "With verbose, an object with the memory the pool takes and, by transaction id,\n"
+            "the size, fee, usage and descendant package of each transaction.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (fVerbose)
+    {
+        LOCK(mempool.cs);
+        Object txs;
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            const CTxMemPoolEntry& entry = mi->second;
+            Object info;
+            info.push_back(Pair("size", (int)entry.GetTxSize()));
+            info.push_back(Pair("fee", ValueFromAmount(entry.GetFee())));
+            info.push_back(Pair("time", entry.GetTime()));
+            info.push_back(Pair("height", (int)entry.GetHeight()));
+            info.push_back(Pair("usage", (uint64_t)entry.GetDynamicUsage()));
+            info.push_back(Pair("descendantcount", entry.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", entry.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", ValueFromAmount(entry.GetFeesWithDescendants())));
+            txs.push_back(Pair(mi->first.ToString(), info));
+        }
+
+        Object obj;
+        obj.push_back(Pair("size", (uint64_t)mempool.mapTx.size()));
+        obj.push_back(Pair("bytes", mempool.GetTotalTxSize()));
+        obj.push_back(Pair("usage", (uint64_t)mempool.DynamicMemoryUsage()));
+        obj.push_back(Pair("maxmempool", (uint64_t)GetMaxMempoolSize()));
+        obj.push_back(Pair("transactions", txs));
+        return obj;
+    }
 
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
@@ -214,6 +249,25 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns an object containing signature cache statistics.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits", (uint64_t)stats.nHits));
+    obj.push_back(Pair("misses", (uint64_t)stats.nMisses));
+    obj.push_back(Pair("inserts", (uint64_t)stats.nInserts));
+    obj.push_back(Pair("slots", (uint64_t)stats.nSlots));
+    obj.push_back(Pair("bytes", (uint64_t)stats.nBytes));
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
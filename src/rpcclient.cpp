@@ -119,6 +119,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getbalance", 1 },
     { "getbalance", 2 },
     { "getblock", 1 },
+    { "getrawmempool", 0 },
     { "getblockbynumber", 0 },
     { "getblockbynumber", 1 },
     { "getblockhash", 0 },
@@ -168,6 +169,10 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "searchrawtransactions", 1 },
     { "searchrawtransactions", 2 },
     { "searchrawtransactions", 3 },
+    { "searchrawtransactionspaged", 1 },
+    { "searchrawtransactionspaged", 2 },
+    { "searchrawtransactionspaged", 4 },
+    { "searchrawtransactionspaged", 5 },
     { "firewallenabled", 1 },
     { "firewallstatus", 0 },
     { "firewallclearblacklist", 1 },
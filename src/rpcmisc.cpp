@@ -6,6 +6,7 @@
 #include "base58.h"
 #include "init.h"
 #include "main.h"
+#include "txmempool.h"
 #include "net.h"
 #include "netbase.h"
 #include "rpcserver.h"
@@ -61,6 +62,15 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
     obj.push_back(Pair("ip",            GetLocalAddress(NULL).ToStringIP()));
 
+    size_t nOrphanUsage = 0;
+    unsigned int nOrphans = GetOrphanTxStats(&nOrphanUsage);
+    obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
+    obj.push_back(Pair("mempoolbytes",  (uint64_t)mempool.GetTotalTxSize()));
+    obj.push_back(Pair("mempoolusage",  (uint64_t)mempool.DynamicMemoryUsage()));
+    obj.push_back(Pair("maxmempool",    (uint64_t)GetMaxMempoolSize()));
+    obj.push_back(Pair("orphantx",      (int)nOrphans));
+    obj.push_back(Pair("orphanusage",   (uint64_t)nOrphanUsage));
+
     diff.push_back(Pair("proof-of-work",  GetDifficulty()));
     diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
     obj.push_back(Pair("difficulty",    GetDifficulty(GetLastBlockIndex(pindexBest, true))));
@@ -107,6 +107,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         if (fStateStats) {
             obj.push_back(Pair("banscore", statestats.nMisbehavior));
+            obj.push_back(Pair("inflight", statestats.nBlocksInFlight));
         }
         obj.push_back(Pair("syncnode", stats.fSyncNode));
 
@@ -89,7 +89,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -520,6 +520,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
     bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
 
     // Sign what we can:
+    CSignatureHashContext sighash(mergedTx);
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
     {
         CTxIn& txin = mergedTx.vin[i];
@@ -533,16 +534,17 @@ Value signrawtransaction(const Array& params, bool fHelp)
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType, &sighash);
 
         // ... and merge in other signatures:
         BOOST_FOREACH(const CTransaction& txv, txVariants)
         {
             txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
         }
-        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, STANDARD_SCRIPT_VERIFY_FLAGS, 0))
+        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, STANDARD_SCRIPT_VERIFY_FLAGS, 0, &sighash))
             fComplete = false;
     }
+    mergedTx.InvalidateHash();
 
     Object result;
     CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
@@ -610,10 +612,6 @@ Value searchrawtransactions(const Array &params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
     CTxDestination dest = address.Get();
 
-    std::vector<uint256> vtxhash;
-    if (!FindTransactionsByDestination(dest, vtxhash))
-        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
-
     int nSkip = 0;
     int nCount = 100;
     bool fVerbose = true;
@@ -624,18 +622,19 @@ Value searchrawtransactions(const Array &params, bool fHelp)
     if (params.size() > 3)
         nCount = params[3].get_int();
 
-    if (nSkip < 0)
-        nSkip += vtxhash.size();
-    if (nSkip < 0)
-        nSkip = 0;
     if (nCount < 0)
         nCount = 0;
 
+    // skip and count are resolved by the index scan, only the requested
+    // window of hashes is loaded
+    std::vector<uint256> vtxhash;
+    if (!FindTransactionsByDestination(dest, vtxhash, nSkip, nCount))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+
     std::vector<uint256>::const_iterator it = vtxhash.begin();
-    while (it != vtxhash.end() && nSkip--) it++;
 
     Array result;
-    while (it != vtxhash.end() && nCount--) {
+    while (it != vtxhash.end()) {
         CTransaction tx;
         uint256 hashBlock;
         if (!GetTransaction(*it, tx, hashBlock))
@@ -665,3 +664,153 @@ Value searchrawtransactions(const Array &params, bool fHelp)
     }
     return result;
 }
+
+// A searchrawtransactionspaged page ends once the transactions on it add up
+// to this many bytes serialized; the rest is left to the next page. It
+// bounds the work per call, not the JSON returned, which holds each
+// transaction as hex and, when verbose, decoded as well.
+static const unsigned int MAX_SEARCH_PAGE_TX_BYTES = 16 * 1000 * 1000;
+static const int MAX_SEARCH_PAGE_COUNT = 1000;
+
+Value searchrawtransactionspaged(const Array &params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 6)
+        throw runtime_error(
+            "searchrawtransactionspaged <address> [verbose=1] [count=100] [cursor=\"\"] [fromheight=0] [toheight=-1]\n"
+            "Returns up to <count> (at most 1000) transactions touching <address> in chain order,\n"
+            "starting at [fromheight] or at the position encoded in [cursor], up to [toheight].\n"
+            "The result holds the transactions and the cursor to pass to the next call,\n"
+            "which is null once the requested range is exhausted. A page also ends early\n"
+            "once its transactions add up to 16 MB serialized.");
+
+    CPHCcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
+    uint160 addrid;
+    if (!GetAddrIndexId(address.Get(), addrid))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Cannot search for address");
+
+    bool fVerbose = true;
+    int nCount = 100;
+    int nFromHeight = 0;
+    int nToHeight = -1;
+    if (params.size() > 1)
+        fVerbose = (params[1].get_int() != 0);
+    if (params.size() > 2)
+        nCount = params[2].get_int();
+    if (params.size() > 4)
+        nFromHeight = params[4].get_int();
+    if (params.size() > 5)
+        nToHeight = params[5].get_int();
+
+    if (nCount < 1 || nCount > MAX_SEARCH_PAGE_COUNT)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "count out of range");
+    if (nFromHeight < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "fromheight out of range");
+    if (nToHeight < -1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "toheight out of range");
+
+    CAddrIndexKey keyStart(addrid, nFromHeight, 0);
+    if (params.size() > 3 && params[3].get_str() != "")
+    {
+        string strCursor = params[3].get_str();
+        if (!IsHex(strCursor))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        vector<unsigned char> vchCursor(ParseHex(strCursor));
+        CDataStream ssCursor(vchCursor, SER_DISK, CLIENT_VERSION);
+        string strTag;
+        try {
+            // CAddrIndexKey skips over its tag, so read that separately
+            CDataStream ssTag(ssCursor);
+            ssTag >> strTag;
+            ssCursor >> keyStart;
+        }
+        catch (std::exception &e) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        if (strTag != "adx" || !ssCursor.empty())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        if (keyStart.addrHash != addrid)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cursor belongs to another address");
+    }
+
+    vector<pair<CAddrIndexKey, uint256> > vEntries;
+    CAddrIndexKey keyNext;
+    bool fMore;
+    CTxDB txdb("r");
+    if (!txdb.ReadAddrIndexRange(keyStart, nToHeight == -1 ? std::numeric_limits<unsigned int>::max() : nToHeight,
+                                 nCount, vEntries, keyNext, fMore))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+
+    Array result;
+    unsigned int nBytes = 0;
+    CBlock block;
+    CBlockIndex* pindexBlock = NULL;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        const CAddrIndexKey& key = vEntries[i].first;
+        const uint256& hashTx = vEntries[i].second;
+
+        // Stop at the size budget, the next page resumes at this entry
+        if (nBytes >= MAX_SEARCH_PAGE_TX_BYTES)
+        {
+            keyNext = key;
+            fMore = true;
+            break;
+        }
+
+        // All entries of one block are adjacent, so each block is read once
+        if (!pindexBlock || pindexBlock->nHeight != (int)key.nHeight)
+        {
+            pindexBlock = NULL;
+            block.SetNull();
+            if ((int)key.nHeight <= nBestHeight)
+            {
+                pindexBlock = FindBlockByHeight(key.nHeight);
+                if (!block.ReadFromDisk(pindexBlock))
+                    block.SetNull();
+            }
+        }
+
+        CTransaction tx;
+        uint256 hashBlock = 0;
+        if (pindexBlock && key.nTxIndex < block.vtx.size() && block.vtx[key.nTxIndex].GetHash() == hashTx)
+        {
+            tx = block.vtx[key.nTxIndex];
+            hashBlock = pindexBlock->GetBlockHash();
+        }
+        else if (!GetTransaction(hashTx, tx, hashBlock))
+        {
+            Object obj;
+            obj.push_back(Pair("txid", hashTx.GetHex()));
+            obj.push_back(Pair("ERROR", "Cannot read transaction from disk"));
+            result.push_back(obj);
+            continue;
+        }
+
+        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+        ssTx << tx;
+        nBytes += ssTx.size();
+        string strHex = HexStr(ssTx.begin(), ssTx.end());
+        if (fVerbose) {
+            Object object;
+            TxToJSON(tx, hashBlock, object);
+            object.push_back(Pair("hex", strHex));
+            result.push_back(object);
+        } else {
+            result.push_back(strHex);
+        }
+    }
+
+    Object ret;
+    ret.push_back(Pair("transactions", result));
+    if (fMore)
+    {
+        CDataStream ssCursor(SER_DISK, CLIENT_VERSION);
+        ssCursor << keyNext;
+        ret.push_back(Pair("cursor", HexStr(ssCursor.begin(), ssCursor.end())));
+    }
+    else
+        ret.push_back(Pair("cursor", Value::null));
+    return ret;
+}
@@ -236,6 +236,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getdifficulty",          &getdifficulty,          true,      false,     false },
     { "getinfo",                &getinfo,                true,      false,     false },
     { "getrawmempool",          &getrawmempool,          true,      false,     false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,      true,      false },
     { "getblock",               &getblock,               false,     false,     false },
     { "getblockbynumber",       &getblockbynumber,       false,     false,     false },
     { "getblockhash",           &getblockhash,           false,     false,     false },
@@ -251,6 +252,7 @@ static const CRPCCommand vRPCCommands[] =
     { "validatepubkey",         &validatepubkey,         true,      false,     false },
     { "verifymessage",          &verifymessage,          false,     false,     false },
     { "searchrawtransactions",  &searchrawtransactions,  false,     false,     false },
+    { "searchrawtransactionspaged", &searchrawtransactionspaged, false, false,     false },
 
     /* Firewall General Session Settings */
     { "firewallstatus",                                &firewallstatus,                             false,      false,    false },
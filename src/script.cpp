@@ -3,9 +3,9 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <boost/atomic.hpp>
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/scoped_array.hpp>
 
 using namespace std;
 using namespace boost;
@@ -106,7 +106,7 @@ const char* ScriptErrorString(const ScriptError serror)
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* psighash = NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -435,7 +435,7 @@ bool static CheckPubKeyEncoding(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* psighash)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -1089,7 +1089,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     else if (opcode == OP_SHA1)
                         SHA1(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        CSHA256().Write(&vch[0], vch.size()).Finalize(&vchHash[0]);
                     else if (opcode == OP_HASH160)
                     {
                         uint160 hash160 = Hash160(vch);
@@ -1132,7 +1132,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         return false;
 
                     bool fSuccess = CheckSignatureEncoding(vchSig) && CheckPubKeyEncoding(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                     popstack(stack);
                     popstack(stack);
@@ -1196,7 +1196,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = CheckSignatureEncoding(vchSig) && CheckPubKeyEncoding(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash);
 
                         if (fOk)
                         {
@@ -2016,76 +2016,187 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+// Serialized size of an input whose scriptSig is blanked for signature hashing:
+// prevout, empty script, nSequence
+static const size_t SIGHASH_BLANK_INPUT_SIZE = 36 + 1 + 4;
+
+static inline void WriteSigHashBytes(CHashWriter& ss, const vector<unsigned char>& vch, size_t nBegin, size_t nEnd)
+{
+    if (nBegin < nEnd)
+        ss.write((const char*)&vch[nBegin], nEnd - nBegin);
+}
+
+static inline bool SigHashIsNoneOrSingle(int nHashType)
+{
+    return (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE;
+}
+
+// Outputs as nHashType commits to them. SIGHASH_SINGLE keeps output nIn and
+// nulls the ones before it, which is what the original transaction copy did.
+static void WriteSigHashOutputs(CHashWriter& ss, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        WriteCompactSize(ss, 0);
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        WriteCompactSize(ss, nIn + 1);
+        CTxOut txoutNull;
+        for (unsigned int i = 0; i < nIn; i++)
+            ss << txoutNull;
+        ss << txTo.vout[nIn];
+    }
+    else
+    {
+        ss << txTo.vout;
+    }
+}
+
+static bool CheckSigHashRange(const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     if (nIn >= txTo.vin.size())
     {
         LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
-        return 1;
+        return false;
+    }
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE && nIn >= txTo.vout.size())
+    {
+        LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return false;
     }
-    CTransaction txTmp(txTo);
+    return true;
+}
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (!CheckSigHashRange(txTo, nIn, nHashType))
+        return 1;
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
-
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    // Stream the transaction as it would serialize with other inputs'
+    // signatures blanked and the inputs and outputs nHashType leaves out
+    // removed, without making that copy of it
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    if (nHashType & SIGHASH_ANYONECANPAY)
     {
-        // Wildcard payee
-        txTmp.vout.clear();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        WriteCompactSize(ss, 1);
+        ss << txTo.vin[nIn].prevout << scriptCode << txTo.vin[nIn].nSequence;
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    else
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        const CScript scriptEmpty;
+        const unsigned int nZero = 0;
+        bool fZeroSequences = SigHashIsNoneOrSingle(nHashType);
+        WriteCompactSize(ss, txTo.vin.size());
+        for (unsigned int i = 0; i < txTo.vin.size(); i++)
         {
-            LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
+            const CTxIn& txin = txTo.vin[i];
+            if (i == nIn)
+                ss << txin.prevout << scriptCode << txin.nSequence;
+            else
+                ss << txin.prevout << scriptEmpty << (fZeroSequences ? nZero : txin.nSequence);
         }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
     }
+    WriteSigHashOutputs(ss, txTo, nIn, nHashType);
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) : txTo(txToIn)
+{
+    const CScript scriptEmpty;
+    const unsigned int nZero = 0;
+    CDataStream ssInputs(SER_GETHASH, 0);
+    CDataStream ssInputsNoSequence(SER_GETHASH, 0);
+    ssInputs.reserve(txTo.vin.size() * SIGHASH_BLANK_INPUT_SIZE);
+    ssInputsNoSequence.reserve(txTo.vin.size() * SIGHASH_BLANK_INPUT_SIZE);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        ssInputs << txin.prevout << scriptEmpty << txin.nSequence;
+        ssInputsNoSequence << txin.prevout << scriptEmpty << nZero;
     }
+    assert(ssInputs.size() == txTo.vin.size() * SIGHASH_BLANK_INPUT_SIZE);
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+    vchInputsNoSequence.assign(ssInputsNoSequence.begin(), ssInputsNoSequence.end());
 
-    // Serialize and hash
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+
+    // SIGHASH_ALL hashes the same bytes in front of input i whichever input
+    // is signed, so keep the hash state at each of those points
     CHashWriter ss(SER_GETHASH, 0);
-    ss << txTmp << nHashType;
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    vMidstate.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstate.push_back(ss);
+        WriteSigHashBytes(ss, vchInputs, i * SIGHASH_BLANK_INPUT_SIZE, (i + 1) * SIGHASH_BLANK_INPUT_SIZE);
+    }
+}
+
+uint256 CSignatureHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (!CheckSigHashRange(txTo, nIn, nHashType))
+        return 1;
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    const CTxIn& txin = txTo.vin[nIn];
+    size_t nInputEnd = (nIn + 1) * SIGHASH_BLANK_INPUT_SIZE;
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << txTo.nVersion << txTo.nTime;
+        WriteCompactSize(ss, 1);
+        ss << txin.prevout << scriptCode << txin.nSequence;
+        if (SigHashIsNoneOrSingle(nHashType))
+            WriteSigHashOutputs(ss, txTo, nIn, nHashType);
+        else
+            WriteSigHashBytes(ss, vchOutputs, 0, vchOutputs.size());
+        ss << txTo.nLockTime << nHashType;
+        return ss.GetHash();
+    }
+    if (SigHashIsNoneOrSingle(nHashType))
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << txTo.nVersion << txTo.nTime;
+        WriteCompactSize(ss, txTo.vin.size());
+        WriteSigHashBytes(ss, vchInputsNoSequence, 0, nIn * SIGHASH_BLANK_INPUT_SIZE);
+        ss << txin.prevout << scriptCode << txin.nSequence;
+        WriteSigHashBytes(ss, vchInputsNoSequence, nInputEnd, vchInputsNoSequence.size());
+        WriteSigHashOutputs(ss, txTo, nIn, nHashType);
+        ss << txTo.nLockTime << nHashType;
+        return ss.GetHash();
+    }
+
+    CHashWriter ss(vMidstate[nIn]);
+    ss << txin.prevout << scriptCode << txin.nSequence;
+    WriteSigHashBytes(ss, vchInputs, nInputEnd, vchInputs.size());
+    WriteSigHashBytes(ss, vchOutputs, 0, vchOutputs.size());
+    ss << txTo.nLockTime << nHashType;
     return ss.GetHash();
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
 {
     assert(nIn < txTo.vin.size());
+    assert(!psighash || &psighash->GetTransaction() == &txTo);
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = psighash ? psighash->SignatureHash(fromPubKey, nIn, nHashType) : SignatureHash(fromPubKey, txTo, nIn, nHashType);
+
+    // txin.scriptSig is rewritten below
+    txTo.InvalidateHash();
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -2099,7 +2210,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = psighash ? psighash->SignatureHash(subscript, nIn, nHashType) : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -2110,17 +2221,17 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, SignatureChecker(txTo, nIn));
+    return VerifyScript(txin.scriptSig, fromPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, SignatureChecker(txTo, nIn, psighash));
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighash)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, psighash);
 }
 
 
@@ -2129,64 +2240,143 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are a salted SHA256 of (signature hash, signature, public key),
+// so an attacker cannot aim signatures at particular buckets. A bucket is
+// two entries, one cache line. Entries are read and written a 64-bit word
+// at a time with relaxed atomics and no lock: a read that races a write
+// sees a mix of two different hashes, which matches nothing, so the worst
+// outcome is a miss or a lost insert.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct Entry
+    {
+        boost::atomic<uint64_t> w[4];
+    };
+    struct Bucket
+    {
+        Entry entries[2];
+    };
 
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    boost::scoped_array<Bucket> buckets;
+    size_t nBuckets;    // always a power of two, or 0 if disabled
+    unsigned char salt[32];
+
+    boost::atomic<uint64_t> nHits;
+    boost::atomic<uint64_t> nMisses;
+    boost::atomic<uint64_t> nInserts;
+
+    void ComputeKey(uint64_t key[4], const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        unsigned char out[CSHA256::OUTPUT_SIZE];
+        CSHA256().Write(salt, sizeof(salt)).Write(hash.begin(), 32).Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size()).Write(pubKey.begin(), pubKey.size()).Finalize(out);
+        memcpy(key, out, sizeof(out));
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    static bool Matches(const Entry& entry, const uint64_t key[4])
+    {
+        for (int i = 0; i < 4; i++)
+            if (entry.w[i].load(boost::memory_order_relaxed) != key[i])
+                return false;
+        return true;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    static bool IsEmpty(const Entry& entry)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        for (int i = 0; i < 4; i++)
+            if (entry.w[i].load(boost::memory_order_relaxed) != 0)
+                return false;
+        return true;
+    }
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+public:
+    CSignatureCache() : nBuckets(0), nHits(0), nMisses(0), nInserts(0)
+    {
+        memset(salt, 0, sizeof(salt));
+    }
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+    void Init(size_t nMaxBytes)
+    {
+        nBuckets = 0;
+        while ((nBuckets ? nBuckets * 2 : 1) * sizeof(Bucket) <= nMaxBytes)
+            nBuckets = nBuckets ? nBuckets * 2 : 1;
+        buckets.reset(nBuckets ? new Bucket[nBuckets] : NULL);
+        for (size_t i = 0; i < nBuckets; i++)
+            for (int j = 0; j < 2; j++)
+                for (int k = 0; k < 4; k++)
+                    buckets[i].entries[j].w[k].store(0, boost::memory_order_relaxed);
+        GetRandBytes(salt, sizeof(salt));
+    }
+
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        if (nBuckets == 0)
+            return false;
+
+        uint64_t key[4];
+        ComputeKey(key, hash, vchSig, pubKey);
+        const Bucket& bucket = buckets[key[0] & (nBuckets - 1)];
+        if (Matches(bucket.entries[0], key) || Matches(bucket.entries[1], key))
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            nHits.fetch_add(1, boost::memory_order_relaxed);
+            return true;
         }
+        nMisses.fetch_add(1, boost::memory_order_relaxed);
+        return false;
+    }
+
+    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    {
+        if (nBuckets == 0)
+            return;
+
+        uint64_t key[4];
+        ComputeKey(key, hash, vchSig, pubKey);
+        Bucket& bucket = buckets[key[0] & (nBuckets - 1)];
+        if (Matches(bucket.entries[0], key) || Matches(bucket.entries[1], key))
+            return;
+
+        // Fill an empty entry if there is one, otherwise evict one chosen by
+        // the (salted, so unpredictable) key
+        Entry* pentry;
+        if (IsEmpty(bucket.entries[0]))
+            pentry = &bucket.entries[0];
+        else if (IsEmpty(bucket.entries[1]))
+            pentry = &bucket.entries[1];
+        else
+            pentry = &bucket.entries[key[1] & 1];
+        for (int i = 0; i < 4; i++)
+            pentry->w[i].store(key[i], boost::memory_order_relaxed);
+        nInserts.fetch_add(1, boost::memory_order_relaxed);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(CSignatureCacheStats& stats) const
+    {
+        stats.nHits = nHits.load(boost::memory_order_relaxed);
+        stats.nMisses = nMisses.load(boost::memory_order_relaxed);
+        stats.nInserts = nInserts.load(boost::memory_order_relaxed);
+        stats.nSlots = nBuckets * 2;
+        stats.nBytes = nBuckets * sizeof(Bucket);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache signatureCache;
+
+void InitSignatureCache(size_t nMaxBytes)
 {
-    static CSignatureCache signatureCache;
+    signatureCache.Init(nMaxBytes);
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    signatureCache.GetStats(stats);
+}
 
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* psighash)
+{
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
         return false;
@@ -2200,7 +2390,7 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighash ? psighash->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -2698,7 +2888,7 @@ bool SignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn, const vec
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighash ? psighash->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -2707,15 +2897,16 @@ bool SignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn, const vec
 }
 
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* psighash)
 {
+    assert(!psighash || &psighash->GetTransaction() == &txTo);
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighash))
         return false;
 
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighash))
         return false;
     if (stack.empty())
         return false;
@@ -2733,7 +2924,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighash))
             return false;
         if (stackCopy.empty())
             return false;
@@ -14,6 +14,7 @@
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
 
+#include "hash.h"
 #include "keystore.h"
 #include "bignum.h"
 #include "util.h"
@@ -25,9 +26,12 @@ class CKeyStore;
 class CTransaction;
 
 class BaseSignatureChecker;
+class CSignatureHashContext;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+/** Default for -maxsigcachesize, the signature cache size in megabytes */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
 
 template <typename T>
 std::vector<unsigned char> ToByteVector(const T& in)
@@ -972,7 +976,7 @@ public:
 
 
 bool IsDERSignature(const valtype &vchSig, bool haveHashType = true);
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* psighash = NULL);
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* error = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
@@ -982,13 +986,28 @@ isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashContext* psighash = NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashContext* psighash = NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashContext* psighash = NULL);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* error = NULL);
 
+/** Size the signature cache to nMaxBytes; 0 disables it. Must be called
+ *  before any script is verified. */
+void InitSignatureCache(size_t nMaxBytes);
+
+struct CSignatureCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    size_t nSlots;
+    size_t nBytes;
+};
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -998,7 +1017,36 @@ CScript GetScriptForMultisig(int nRequired, const std::vector<CPubKey>& keys);
 
 bool Solver(const CKeyStore& keystore, const CScript& scriptPubKey, uint256 hash, int nHashType,
                   CScript& scriptSigRet, txnouttype& whichTypeRet);
-//uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/** Legacy signature hash of input nIn of txTo */
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+/** Signature hash state shared by all inputs of one transaction.
+ *
+ * The blanked inputs and the outputs are serialized once, and the hash state
+ * in front of every input is kept, so the SIGHASH_ALL digest of an input
+ * only hashes its scriptCode and what follows it instead of a modified copy
+ * of the whole transaction. Digests are the same as SignatureHash(). Only
+ * scriptSigs of the transaction may change while the context is in use; it
+ * is read-only after construction, so script check threads can share it.
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction& txTo;
+    std::vector<unsigned char> vchInputs;
+    std::vector<unsigned char> vchInputsNoSequence;
+    std::vector<unsigned char> vchOutputs;
+    std::vector<CHashWriter> vMidstate;
+
+    CSignatureHashContext(const CSignatureHashContext&);
+    CSignatureHashContext& operator=(const CSignatureHashContext&);
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txToIn);
+
+    const CTransaction& GetTransaction() const { return txTo; }
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
 
 
 class BaseSignatureChecker
@@ -1017,12 +1065,13 @@ class SignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction& txTo;
     unsigned int nIn;
+    const CSignatureHashContext* psighash;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    SignatureChecker(const CTransaction& txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    SignatureChecker(const CTransaction& txToIn, unsigned int nInIn, const CSignatureHashContext* psighashIn = NULL) : txTo(txToIn), nIn(nInIn), psighash(psighashIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
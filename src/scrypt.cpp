@@ -27,6 +27,8 @@
  * online backup system.
  */
 
+#include <algorithm>
+#include <new>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -196,3 +198,205 @@ uint256 scrypt_blockhash(const void* input)
     return scrypt_nosalt(input, 80, scratchpad);
 }
 
+/* Multi-lane scrypt_core: LANES independent hashes run side by side, word k
+   of every lane held in one vector, so each salsa8 operation covers all of
+   them. The scratchpad is interleaved the same way; only the data-dependent
+   reads of the second loop have to pick words out lane by lane.
+   Built on GCC vector extensions, which lower to SSE2 on x86, NEON on ARM
+   and plain integer code elsewhere. The 8-lane core is compiled a second
+   time for AVX2 and chosen at run time when the CPU has it. */
+#if defined(__GNUC__)
+#define SCRYPT_LANES_MAX 8
+
+typedef unsigned int scrypt_v4 __attribute__((vector_size(16)));
+typedef unsigned int scrypt_v8 __attribute__((vector_size(32)));
+
+template<typename V>
+static inline __attribute__((always_inline)) void xor_salsa8_lanes(V B[16], const V Bx[16])
+{
+    V x[16];
+    for (int k = 0; k < 16; k++)
+        x[k] = (B[k] ^= Bx[k]);
+    for (int i = 0; i < 8; i += 2) {
+#define R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+        /* Operate on columns. */
+        x[ 4] ^= R(x[ 0]+x[12], 7); x[ 9] ^= R(x[ 5]+x[ 1], 7);
+        x[14] ^= R(x[10]+x[ 6], 7); x[ 3] ^= R(x[15]+x[11], 7);
+
+        x[ 8] ^= R(x[ 4]+x[ 0], 9); x[13] ^= R(x[ 9]+x[ 5], 9);
+        x[ 2] ^= R(x[14]+x[10], 9); x[ 7] ^= R(x[ 3]+x[15], 9);
+
+        x[12] ^= R(x[ 8]+x[ 4],13); x[ 1] ^= R(x[13]+x[ 9],13);
+        x[ 6] ^= R(x[ 2]+x[14],13); x[11] ^= R(x[ 7]+x[ 3],13);
+
+        x[ 0] ^= R(x[12]+x[ 8],18); x[ 5] ^= R(x[ 1]+x[13],18);
+        x[10] ^= R(x[ 6]+x[ 2],18); x[15] ^= R(x[11]+x[ 7],18);
+
+        /* Operate on rows. */
+        x[ 1] ^= R(x[ 0]+x[ 3], 7); x[ 6] ^= R(x[ 5]+x[ 4], 7);
+        x[11] ^= R(x[10]+x[ 9], 7); x[12] ^= R(x[15]+x[14], 7);
+
+        x[ 2] ^= R(x[ 1]+x[ 0], 9); x[ 7] ^= R(x[ 6]+x[ 5], 9);
+        x[ 8] ^= R(x[11]+x[10], 9); x[13] ^= R(x[12]+x[15], 9);
+
+        x[ 3] ^= R(x[ 2]+x[ 1],13); x[ 4] ^= R(x[ 7]+x[ 6],13);
+        x[ 9] ^= R(x[ 8]+x[11],13); x[14] ^= R(x[13]+x[12],13);
+
+        x[ 0] ^= R(x[ 3]+x[ 2],18); x[ 5] ^= R(x[ 4]+x[ 7],18);
+        x[10] ^= R(x[ 9]+x[ 8],18); x[15] ^= R(x[14]+x[13],18);
+#undef R
+    }
+    for (int k = 0; k < 16; k++)
+        B[k] += x[k];
+}
+
+/* X holds 32 words per lane, lane-major; V needs room for 1024 * 32 vectors */
+template<typename V, int LANES>
+static inline __attribute__((always_inline)) void scrypt_core_lanes(unsigned int* X, V* V_)
+{
+    V Y[32];
+    for (int k = 0; k < 32; k++)
+        for (int l = 0; l < LANES; l++)
+            Y[k][l] = X[l * 32 + k];
+
+    for (unsigned int i = 0; i < 1024; i++) {
+        memcpy(&V_[i * 32], Y, sizeof(Y));
+        xor_salsa8_lanes<V>(&Y[0], &Y[16]);
+        xor_salsa8_lanes<V>(&Y[16], &Y[0]);
+    }
+    const unsigned int* pV = (const unsigned int*)V_;
+    for (unsigned int i = 0; i < 1024; i++) {
+        unsigned int j[LANES];
+        for (int l = 0; l < LANES; l++)
+            j[l] = 32 * (Y[16][l] & 1023);
+        for (int k = 0; k < 32; k++) {
+            V v;
+            for (int l = 0; l < LANES; l++)
+                v[l] = pV[(j[l] + k) * LANES + l];
+            Y[k] ^= v;
+        }
+        xor_salsa8_lanes<V>(&Y[0], &Y[16]);
+        xor_salsa8_lanes<V>(&Y[16], &Y[0]);
+    }
+
+    for (int k = 0; k < 32; k++)
+        for (int l = 0; l < LANES; l++)
+            X[l * 32 + k] = Y[k][l];
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void scrypt_core_4way(unsigned int* X, void* V)
+{
+    scrypt_core_lanes<scrypt_v4, 4>(X, (scrypt_v4*)V);
+}
+#else
+static void scrypt_core_8way(unsigned int* X, void* V)
+{
+    scrypt_core_lanes<scrypt_v8, 8>(X, (scrypt_v8*)V);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define SCRYPT_HAVE_AVX2
+__attribute__((target("avx2")))
+static void scrypt_core_8way_avx2(unsigned int* X, void* V)
+{
+    scrypt_core_lanes<scrypt_v8, 8>(X, (scrypt_v8*)V);
+}
+#endif
+
+typedef void (*scrypt_core_lanes_fn)(unsigned int* X, void* V);
+
+struct scrypt_engine
+{
+    scrypt_core_lanes_fn core;
+    int nLanes;
+    const char* pszName;
+};
+
+static scrypt_engine scrypt_select_engine()
+{
+    scrypt_engine engine;
+#ifdef SCRYPT_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        engine.core = scrypt_core_8way_avx2;
+        engine.nLanes = 8;
+        engine.pszName = "avx2-8way";
+        return engine;
+    }
+#endif
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+    engine.core = scrypt_core_4way;
+    engine.nLanes = 4;
+    engine.pszName = "simd-4way";
+#else
+    engine.core = scrypt_core_8way;
+    engine.nLanes = 8;
+    engine.pszName = "generic-8way";
+#endif
+    return engine;
+}
+
+static const scrypt_engine& scrypt_get_engine()
+{
+    static const scrypt_engine engine = scrypt_select_engine();
+    return engine;
+}
+
+const char* scrypt_batch_engine()
+{
+    return scrypt_get_engine().pszName;
+}
+
+void scrypt_blockhash_batch(const void* const headers[], uint256 out[], size_t n)
+{
+    const scrypt_engine& engine = scrypt_get_engine();
+    if (n < 2) {
+        if (n == 1)
+            out[0] = scrypt_blockhash(headers[0]);
+        return;
+    }
+
+    // One scratchpad per lane is too big for the stack
+    unsigned char* scratchpad = (unsigned char*)malloc(engine.nLanes * 131072 + 63);
+    if (!scratchpad)
+        throw std::bad_alloc();
+    void* V = (void*)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    unsigned int X[SCRYPT_LANES_MAX * 32];
+
+    for (size_t nBegin = 0; nBegin < n; nBegin += engine.nLanes) {
+        size_t nCount = std::min(n - nBegin, (size_t)engine.nLanes);
+        if (nCount == 1) {
+            out[nBegin] = scrypt_blockhash(headers[nBegin]);
+            break;
+        }
+        // A short final group repeats its last header in the unused lanes
+        for (int l = 0; l < engine.nLanes; l++) {
+            const uint8_t* input = (const uint8_t*)headers[nBegin + std::min((size_t)l, nCount - 1)];
+            PBKDF2_SHA256(input, 80, input, 80, 1, (uint8_t *)&X[l * 32], 128);
+        }
+        engine.core(X, V);
+        for (size_t l = 0; l < nCount; l++) {
+            const uint8_t* input = (const uint8_t*)headers[nBegin + l];
+            uint256 result = 0;
+            PBKDF2_SHA256(input, 80, (uint8_t *)&X[l * 32], 128, 1, (uint8_t*)&result, 32);
+            out[nBegin + l] = result;
+        }
+    }
+
+    free(scratchpad);
+}
+#else
+const char* scrypt_batch_engine()
+{
+    return "scalar";
+}
+
+void scrypt_blockhash_batch(const void* const headers[], uint256 out[], size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = scrypt_blockhash(headers[i]);
+}
+#endif
+
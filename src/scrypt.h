@@ -12,4 +12,11 @@ uint256 scrypt_salted_hash(const void* input, size_t inputlen, const void* salt,
 uint256 scrypt_hash(const void* input, size_t inputlen);
 uint256 scrypt_blockhash(const void* input);
 
+/* Hash n 80-byte block headers at once, several to a SIMD lane engine
+   picked for this CPU. Same results as scrypt_blockhash. */
+void scrypt_blockhash_batch(const void* const headers[], uint256 out[], size_t n);
+
+/* Name of the lane engine scrypt_blockhash_batch uses */
+const char* scrypt_batch_engine();
+
 #endif // SCRYPT_MINE_H
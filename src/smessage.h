@@ -6,13 +6,13 @@
 #define SEC_MESSAGE_H
 
 #include <leveldb/db.h>
-#include <leveldb/write_batch.h>
 
 #include "net.h"
 #include "db.h"
 #include "wallet.h"
 #include "base58.h"
 #include "lz4/lz4.h"
+#include "leveldbbatch.h"
 
 
 const unsigned int SMSG_HDR_LEN         = 104;               // length of unencrypted header, 4 + 2 + 1 + 8 + 16 + 33 + 32 + 4 +4
@@ -321,7 +321,7 @@ public:
     bool EraseSmesg(uint8_t* chKey);
 
     leveldb::DB *pdb;       // points to the global instance
-    leveldb::WriteBatch *activeBatch;
+    CLevelDBBatch *activeBatch;
 
 };
 
@@ -0,0 +1,202 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "chainparams.h"
+#include "kernel.h"
+#include "uint256.h"
+#include "util.h"
+
+// arith_uint256 replaced CBigNum in target and chain trust arithmetic, so
+// every result here is checked bit for bit against what CBigNum gives.
+// Historical nBits aren't at hand in a unit test, so the compact cases
+// sweep every exponent with the mantissas at the edges of each byte.
+
+BOOST_AUTO_TEST_SUITE(arith_uint256_tests)
+
+static const unsigned int vMantissa[] = {
+    0x000000, 0x000001, 0x00007f, 0x000080, 0x0000ff, 0x000100, 0x007fff, 0x008000,
+    0x00ffff, 0x010000, 0x123456, 0x7fff00, 0x7fffff, 0x800000, 0x800001, 0x8000ff,
+    0x812345, 0xffffff
+};
+
+static std::vector<unsigned int> CompactCases()
+{
+    std::vector<unsigned int> vCompact;
+    for (unsigned int nSize = 0; nSize <= 36; nSize++)
+    {
+        for (unsigned int i = 0; i < sizeof(vMantissa) / sizeof(vMantissa[0]); i++)
+            vCompact.push_back((nSize << 24) | vMantissa[i]);
+        for (int i = 0; i < 16; i++)
+            vCompact.push_back((nSize << 24) | (insecure_rand() & 0xffffff));
+    }
+    vCompact.push_back(0xff7fffff);
+    vCompact.push_back(0xffffffff);
+    return vCompact;
+}
+
+static uint256 RandomUint256(unsigned int nBits)
+{
+    uint256 n;
+    for (unsigned int i = 0; i < n.size(); i++)
+        n.begin()[i] = insecure_rand();
+    return nBits >= 256 ? n : n >> (256 - nBits);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_setcompact)
+{
+    std::vector<unsigned int> vCompact = CompactCases();
+    for (unsigned int i = 0; i < vCompact.size(); i++)
+    {
+        unsigned int nCompact = vCompact[i];
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        CBigNum bnMagnitude = bn < 0 ? -bn : bn;
+
+        arith_uint256 n;
+        bool fNegative, fOverflow;
+        n.SetCompact(nCompact, &fNegative, &fOverflow);
+
+        BOOST_CHECK_MESSAGE(fNegative == (bn < 0), strprintf("%08x", nCompact));
+        BOOST_CHECK_MESSAGE(fOverflow == (bnMagnitude.bitSize() > 256), strprintf("%08x", nCompact));
+        BOOST_CHECK_MESSAGE(n == bnMagnitude.getuint256(), strprintf("%08x", nCompact));
+        if (!fNegative && !fOverflow)
+            BOOST_CHECK_MESSAGE(n.GetCompact() == bn.GetCompact(), strprintf("%08x", nCompact));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_getcompact)
+{
+    for (unsigned int nBits = 0; nBits <= 256; nBits++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            uint256 n = RandomUint256(nBits);
+            BOOST_CHECK(arith_uint256(n).GetCompact() == CBigNum(n).GetCompact());
+            BOOST_CHECK(arith_uint256(n).bits() == (unsigned int)CBigNum(n).bitSize());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_mul_div)
+{
+    static const uint64_t vFactor[] = {
+        0, 1, 2, 180, 0xffffffffULL, 0x100000000ULL, 0x7fffffffffffffffULL, 0xffffffffffffffffULL
+    };
+    for (unsigned int nBits = 0; nBits <= 256; nBits += 4)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            uint256 a = RandomUint256(nBits);
+            uint64_t b = vFactor[i];
+            if (i & 1)
+                b ^= ((uint64_t)insecure_rand() << 32) | insecure_rand();
+
+            CBigNum bnProduct = CBigNum(a) * CBigNum(b);
+            arith_uint256 n = a;
+            bool fFits = n.MulU64(b);
+            BOOST_CHECK(fFits == (bnProduct.bitSize() <= 256));
+            BOOST_CHECK(n == bnProduct.getuint256());
+
+            uint256 d = RandomUint256(insecure_rand() % 257);
+            if (d == 0)
+                d = 1;
+            BOOST_CHECK(arith_uint256(a) / arith_uint256(d) == (CBigNum(a) / CBigNum(d)).getuint256());
+        }
+    }
+
+    arith_uint256 n = 1;
+    BOOST_CHECK_THROW(n /= arith_uint256(0), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_trust)
+{
+    std::vector<unsigned int> vCompact = CompactCases();
+    for (unsigned int i = 0; i < vCompact.size(); i++)
+    {
+        CBigNum bnTarget;
+        bnTarget.SetCompact(vCompact[i]);
+        uint256 nExpected = 0;
+        if (bnTarget > 0)
+            nExpected = ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+
+        CBlockIndex index;
+        index.nBits = vCompact[i];
+        BOOST_CHECK_MESSAGE(index.GetBlockTrust() == nExpected, strprintf("%08x", vCompact[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_retarget)
+{
+    // GetNextTargetRequired on a proof-of-work chain of three blocks, over
+    // actual spacings from negative to far beyond the target spacing
+    // nTargetTimespan / TARGET_SPACING in main.cpp
+    const int64_t nInterval = 120 / TARGET_SPACING;
+    const CBigNum bnLimit(uint256(Params().ProofOfWorkLimit()));
+    static const int64_t vActualSpacing[] = { -1, 0, 1, 59, 60, 61, 600, 86400, 0x7fffffffLL };
+
+    CBlockIndex vIndex[3];
+    for (int i = 0; i < 3; i++)
+    {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nTime = 1000000;
+    }
+
+    std::vector<unsigned int> vCompact = CompactCases();
+    for (unsigned int i = 0; i < vCompact.size(); i++)
+    {
+        for (unsigned int j = 0; j < sizeof(vActualSpacing) / sizeof(vActualSpacing[0]); j++)
+        {
+            vIndex[2].nBits = vCompact[i];
+            vIndex[2].nTime = vIndex[1].nTime + vActualSpacing[j];
+
+            int64_t nActualSpacing = vActualSpacing[j] < 0 ? TARGET_SPACING : vActualSpacing[j];
+            CBigNum bnExpected;
+            bnExpected.SetCompact(vCompact[i]);
+            bnExpected *= (nInterval - 1) * TARGET_SPACING + nActualSpacing + nActualSpacing;
+            bnExpected /= (nInterval + 1) * TARGET_SPACING;
+            if (bnExpected <= 0 || bnExpected > bnLimit)
+                bnExpected = bnLimit;
+
+            BOOST_CHECK_MESSAGE(GetNextTargetRequired(&vIndex[2], false) == bnExpected.GetCompact(),
+                                strprintf("%08x %d", vCompact[i], vActualSpacing[j]));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(arith_uint256_stake_target)
+{
+    // CheckStakeKernelHash: the hash meets the target weighted by the
+    // output's value
+    static const int64_t vValue[] = { 0, 1, COIN, 1000000 * COIN, MAX_MONEY, -1, -COIN };
+
+    std::vector<unsigned int> vCompact = CompactCases();
+    for (unsigned int i = 0; i < vCompact.size(); i++)
+    {
+        for (unsigned int j = 0; j < sizeof(vValue) / sizeof(vValue[0]); j++)
+        {
+            CBigNum bnTarget;
+            bnTarget.SetCompact(vCompact[i]);
+            bnTarget *= CBigNum(vValue[j]);
+
+            arith_uint256 nTarget;
+            bool fAlways, fNever;
+            GetWeightedTarget(vCompact[i], vValue[j], nTarget, fAlways, fNever);
+
+            BOOST_CHECK(uint256(nTarget) == bnTarget.getuint256());
+            for (int k = 0; k < 8; k++)
+            {
+                uint256 hash = RandomUint256(insecure_rand() % 257);
+                if (k == 0)
+                    hash = 0;
+                else if (k == 1)
+                    hash = nTarget;
+                bool fExpected = !(CBigNum(hash) > bnTarget);
+                bool fMeets = !fNever && (fAlways || !(hash > nTarget));
+                BOOST_CHECK_MESSAGE(fMeets == fExpected, strprintf("%08x %d", vCompact[i], vValue[j]));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,201 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+// The pool keeps its transactions in fee rate order and links each one with
+// the pool transactions it spends from; block assembly relies on both
+// staying right as transactions come and go.
+
+static CTransaction SpendingTx(const uint256& hashPrev, unsigned int nOut, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, nOut);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[1].nValue = nValue;
+    tx.vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_fee_rate_order)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // Same size, fees out of order
+    static const int64_t vFee[] = { 3000, 10000, 1000, 5000 };
+    std::vector<CTransaction> vtx;
+    for (unsigned int i = 0; i < sizeof(vFee) / sizeof(vFee[0]); i++)
+    {
+        CTransaction tx = SpendingTx(0, i, COIN);
+        vtx.push_back(tx);
+        BOOST_CHECK(pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, vFee[i], 2 * COIN + vFee[i], 0, 1, i, 0, 1)));
+    }
+    BOOST_CHECK(!pool.addUnchecked(vtx[0].GetHash(), CTxMemPoolEntry(vtx[0], 0, 0, 0, 1, 0, 0, 1)));
+
+    std::vector<int64_t> vSeen;
+    BOOST_FOREACH(const CTxMemPoolEntry* pentry, pool.GetEntriesByFeeRate())
+        vSeen.push_back(pentry->GetFee());
+    BOOST_CHECK_EQUAL(vSeen.size(), 4U);
+    BOOST_CHECK(vSeen[0] == 10000 && vSeen[1] == 5000 && vSeen[2] == 3000 && vSeen[3] == 1000);
+
+    pool.remove(vtx[1]);
+    BOOST_CHECK_EQUAL(pool.GetEntriesByFeeRate().size(), 3U);
+    BOOST_CHECK_EQUAL((*pool.GetEntriesByFeeRate().begin())->GetFee(), 5000);
+
+    pool.clear();
+    BOOST_CHECK(pool.GetEntriesByFeeRate().empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_links)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    CTransaction txParent = SpendingTx(0, 0, COIN);
+    CTransaction txChild1 = SpendingTx(txParent.GetHash(), 0, COIN / 2);
+    CTransaction txChild2 = SpendingTx(txParent.GetHash(), 1, COIN / 2);
+    CTransaction txGrandChild = SpendingTx(txChild1.GetHash(), 0, COIN / 4);
+    uint256 hashParent = txParent.GetHash();
+    uint256 hashChild1 = txChild1.GetHash();
+
+    // Children first, as when a block holding the parent is disconnected
+    pool.addUnchecked(hashChild1, CTxMemPoolEntry(txChild1, 1000, COIN, 0, 1, 0, 0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 1000, COIN / 2, 0, 1, 0, 0, 1));
+    BOOST_CHECK(pool.GetLinks(hashChild1).setParents.empty());
+    BOOST_CHECK(pool.GetLinks(txGrandChild.GetHash()).setParents.count(hashChild1));
+
+    pool.addUnchecked(hashParent, CTxMemPoolEntry(txParent, 1000, 3 * COIN, 3 * COIN, 1, 0, 0, 1));
+    pool.addUnchecked(txChild2.GetHash(), CTxMemPoolEntry(txChild2, 1000, COIN, 0, 1, 0, 0, 1));
+    BOOST_CHECK_EQUAL(pool.GetLinks(hashParent).setChildren.size(), 2U);
+    BOOST_CHECK(pool.GetLinks(hashChild1).setParents.count(hashParent));
+    BOOST_CHECK(pool.GetLinks(txChild2.GetHash()).setParents.count(hashParent));
+
+    // Taking out a child unlinks it from its parent
+    pool.remove(txChild2);
+    BOOST_CHECK_EQUAL(pool.GetLinks(hashParent).setChildren.size(), 1U);
+
+    // Spends of a transaction that left the pool go with everything below them
+    pool.removeSpends(txParent);
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), 1U);
+    BOOST_CHECK(pool.GetLinks(hashParent).setChildren.empty());
+    BOOST_CHECK(pool.GetLinks(hashChild1).setParents.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_descendants_and_trim)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+
+    // A chain paying little at the top and well at the bottom, and a
+    // transaction on its own paying in between
+    CTransaction txA = SpendingTx(0, 0, COIN);
+    CTransaction txB = SpendingTx(txA.GetHash(), 0, COIN / 2);
+    CTransaction txC = SpendingTx(txB.GetHash(), 0, COIN / 4);
+    CTransaction txD = SpendingTx(1, 0, COIN);
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 100, 2 * COIN, 0, 1, 0, 0, 1));
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 200, COIN, 0, 1, 1, 0, 1));
+    pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 50000, COIN / 2, 0, 1, 2, 0, 1));
+    pool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 5000, 2 * COIN, 0, 1, 3, 0, 1));
+
+    const CTxMemPoolEntry& entryA = pool.mapTx[txA.GetHash()];
+    unsigned int nSize = entryA.GetTxSize();
+    BOOST_CHECK_EQUAL(entryA.GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(entryA.GetSizeWithDescendants(), 3U * nSize);
+    BOOST_CHECK_EQUAL(entryA.GetFeesWithDescendants(), 50300);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 4U * nSize);
+
+    // The package under A pays better than D, so D goes first
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK_EQUAL(pool.TrimToSize(nUsage - 1), 1U);
+    BOOST_CHECK(!pool.exists(txD.GetHash()));
+
+    // Without C, A and B pay little; they go together
+    pool.remove(txC);
+    BOOST_CHECK_EQUAL(entryA.GetFeesWithDescendants(), 300);
+    BOOST_CHECK_EQUAL(pool.TrimToSize(0), 2U);
+    BOOST_CHECK(pool.mapTx.empty());
+
+    // What comes next has to pay more than D did, until blocks make room
+    BOOST_CHECK_EQUAL(pool.GetMinFeeRate(nUsage), 5000 * 1000 / nSize + MIN_RELAY_TX_FEE);
+    pool.removeForBlock(std::vector<CTransaction>());
+    SetMockTime(GetTime() + CTxMemPool::ROLLING_FEE_HALFLIFE / 4);
+    BOOST_CHECK(pool.GetMinFeeRate(nUsage) < 5000 * 1000 / nSize);
+    SetMockTime(0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_block_conflicts)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // A pool chain, and a block spending A's input some other way
+    CTransaction txA = SpendingTx(0, 0, COIN);
+    CTransaction txB = SpendingTx(txA.GetHash(), 0, COIN / 2);
+    CTransaction txC = SpendingTx(txB.GetHash(), 0, COIN / 4);
+    CTransaction txD = SpendingTx(1, 0, COIN);
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 1000, 2 * COIN, 0, 1, 0, 0, 1));
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 1000, COIN, 0, 1, 0, 0, 1));
+    pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 1000, COIN / 2, 0, 1, 0, 0, 1));
+    pool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 1000, 2 * COIN, 0, 1, 0, 0, 1));
+
+    CTransaction txConflict = SpendingTx(0, 0, COIN / 2);
+    BOOST_CHECK(txConflict.GetHash() != txA.GetHash());
+    std::vector<CTransaction> vtxBlock(1, txConflict);
+    vtxBlock.push_back(txD);
+    pool.removeForBlock(vtxBlock);
+
+    BOOST_CHECK(pool.mapTx.empty());
+    BOOST_CHECK(pool.mapNextTx.empty());
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_limits)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    CTransaction txA = SpendingTx(0, 0, COIN);
+    CTransaction txB = SpendingTx(txA.GetHash(), 0, COIN / 2);
+    CTransaction txC = SpendingTx(txB.GetHash(), 0, COIN / 4);
+    CTransaction txD = SpendingTx(txA.GetHash(), 1, COIN / 2);
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 1000, 2 * COIN, 0, 1, 0, 0, 1));
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 1000, COIN, 0, 1, 0, 0, 1));
+    unsigned int nSize = pool.mapTx[txA.GetHash()].GetTxSize();
+    std::string strReason;
+
+    // C would be the third of its chain, D the third under A
+    BOOST_CHECK(pool.CheckPackageLimits(txC, nSize, 3, 3 * nSize, 3, 3 * nSize, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txC, nSize, 2, 3 * nSize, 3, 3 * nSize, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txC, nSize, 3, 3 * nSize - 1, 3, 3 * nSize, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txD, nSize, 3, 3 * nSize, 2, 3 * nSize, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txD, nSize, 3, 3 * nSize, 3, 3 * nSize - 1, strReason));
+    BOOST_CHECK(pool.CheckPackageLimits(txD, nSize, 2, 2 * nSize, 3, 3 * nSize, strReason));
+
+    // Nothing in the pool to count against
+    BOOST_CHECK(pool.CheckPackageLimits(SpendingTx(1, 0, COIN), nSize, 1, nSize, 1, nSize, strReason));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_entry_priority)
+{
+    CTransaction tx = SpendingTx(0, 0, COIN);
+    CTxMemPoolEntry entry(tx, 1000, 3 * COIN, 2 * COIN, 1, 0, 5.0, 100);
+    unsigned int nSize = entry.GetTxSize();
+    BOOST_CHECK_EQUAL(nSize, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(entry.GetPriority(100), 5.0);
+    BOOST_CHECK_EQUAL(entry.GetPriority(110), 5.0 + (double)2 * COIN * 10 / nSize);
+    BOOST_CHECK_EQUAL(entry.GetFeePerKb(), 1000.0 * 1000 / nSize);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
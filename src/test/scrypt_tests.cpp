@@ -0,0 +1,69 @@
+#include <boost/test/unit_test.hpp>
+
+#include "scrypt.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+BOOST_AUTO_TEST_CASE(scrypt_blockhash_testvector)
+{
+    // Litecoin block 29255
+    std::vector<unsigned char> vchHeader = ParseHex("020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659");
+    uint256 hashExpected("00000000002bef4107f882f6115e0b01f348d21195dacd3582aa2dabd7985806");
+    BOOST_CHECK(scrypt_blockhash(&vchHeader[0]) == hashExpected);
+
+    const void* pheader = &vchHeader[0];
+    uint256 hash;
+    scrypt_blockhash_batch(&pheader, &hash, 1);
+    BOOST_CHECK(hash == hashExpected);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_blockhash_batch_matches)
+{
+    // Batch sizes around the lane counts, so that full, partial and single
+    // final groups are all covered
+    static const size_t vSize[] = { 2, 3, 4, 5, 7, 8, 9, 16, 17 };
+    for (unsigned int i = 0; i < sizeof(vSize) / sizeof(vSize[0]); i++)
+    {
+        size_t n = vSize[i];
+        std::vector<unsigned char> vch(80 * n);
+        for (unsigned int j = 0; j < vch.size(); j++)
+            vch[j] = insecure_rand();
+        std::vector<const void*> vpheader(n);
+        for (unsigned int j = 0; j < n; j++)
+            vpheader[j] = &vch[80 * j];
+
+        std::vector<uint256> vHash(n);
+        scrypt_blockhash_batch(&vpheader[0], &vHash[0], n);
+        for (unsigned int j = 0; j < n; j++)
+            BOOST_CHECK_MESSAGE(vHash[j] == scrypt_blockhash(vpheader[j]), strprintf("batch of %u, header %u", n, j));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_blockhash_benchmark)
+{
+    // Not a check: only reports how the scalar and batch paths compare on
+    // this CPU (shown with --log_level=message), so it can never fail
+    const size_t n = 16;
+    std::vector<unsigned char> vch(80 * n);
+    for (unsigned int j = 0; j < vch.size(); j++)
+        vch[j] = insecure_rand();
+    std::vector<const void*> vpheader(n);
+    for (unsigned int j = 0; j < n; j++)
+        vpheader[j] = &vch[80 * j];
+    std::vector<uint256> vHash(n);
+
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int j = 0; j < n; j++)
+        vHash[j] = scrypt_blockhash(vpheader[j]);
+    int64_t nScalar = std::max(GetTimeMicros() - nStart, (int64_t)1);
+
+    nStart = GetTimeMicros();
+    scrypt_blockhash_batch(&vpheader[0], &vHash[0], n);
+    int64_t nBatch = std::max(GetTimeMicros() - nStart, (int64_t)1);
+
+    BOOST_TEST_MESSAGE(strprintf("scrypt: scalar %.0f hashes/s, batch (%s) %.0f hashes/s",
+                                 1000000.0 * n / nScalar, scrypt_batch_engine(), 1000000.0 * n / nBatch));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
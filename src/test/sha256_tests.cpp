@@ -0,0 +1,167 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+
+#include <openssl/sha.h>
+
+// Each SHA-256 engine this CPU can run is forced in turn, and checked
+// against known vectors and against OpenSSL, which shares no code with
+// any of them.
+
+static std::vector<unsigned char> RandomBytes(size_t nLen)
+{
+    std::vector<unsigned char> vch(nLen);
+    for (unsigned int i = 0; i < nLen; i++)
+        vch[i] = insecure_rand();
+    return vch;
+}
+
+static uint256 DoubleSHA(const std::vector<unsigned char>& vch)
+{
+    unsigned char hash1[SHA256_DIGEST_LENGTH];
+    SHA256(vch.empty() ? NULL : &vch[0], vch.size(), hash1);
+    uint256 hash2;
+    SHA256(hash1, sizeof(hash1), hash2.begin());
+    return hash2;
+}
+
+static void CheckTestVectors()
+{
+    static const char* vpszInput[] = {
+        "",
+        "abc",
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+    };
+    static const char* vpszOutput[] = {
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+    };
+    for (unsigned int i = 0; i < sizeof(vpszInput) / sizeof(vpszInput[0]); i++)
+    {
+        unsigned char hash[CSHA256::OUTPUT_SIZE];
+        CSHA256().Write((const unsigned char*)vpszInput[i], strlen(vpszInput[i])).Finalize(hash);
+        BOOST_CHECK_EQUAL(HexStr(hash, hash + sizeof(hash)), vpszOutput[i]);
+    }
+
+    // One million 'a's, written in uneven pieces
+    std::vector<unsigned char> vch(1000000, 'a');
+    CSHA256 sha;
+    for (size_t nPos = 0; nPos < vch.size(); )
+    {
+        size_t nLen = std::min(vch.size() - nPos, (size_t)(insecure_rand() % 1000));
+        sha.Write(&vch[nPos], nLen);
+        nPos += nLen;
+    }
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    sha.Finalize(hash);
+    BOOST_CHECK_EQUAL(HexStr(hash, hash + sizeof(hash)), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+static void CheckD64()
+{
+    // Counts around the lane widths, so that full groups and leftovers
+    // are both covered
+    for (unsigned int n = 0; n <= 17; n++)
+    {
+        std::vector<unsigned char> vchIn = RandomBytes(64 * n);
+        std::vector<uint256> vHash(n + 1);
+        SHA256D64(vHash[0].begin(), vchIn.empty() ? NULL : &vchIn[0], n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            std::vector<unsigned char> vch(vchIn.begin() + 64 * i, vchIn.begin() + 64 * (i + 1));
+            BOOST_CHECK_MESSAGE(vHash[i] == DoubleSHA(vch), strprintf("%u inputs, input %u", n, i));
+        }
+        BOOST_CHECK(vHash[n] == 0);
+    }
+}
+
+static void CheckBatch()
+{
+    // Random lengths, and the ones where the padding spills into another chunk
+    static const size_t vFixed[] = { 0, 1, 55, 56, 63, 64, 119, 120, 128 };
+    for (unsigned int nRound = 0; nRound < 20; nRound++)
+    {
+        unsigned int n = nRound + 1;
+        std::vector<std::vector<unsigned char> > vInput(n);
+        std::vector<const unsigned char*> vpInput(n);
+        std::vector<size_t> vLen(n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            size_t nLen = (i % 2) ? vFixed[insecure_rand() % (sizeof(vFixed) / sizeof(vFixed[0]))] : insecure_rand() % 600;
+            vInput[i] = RandomBytes(nLen);
+            vpInput[i] = vInput[i].empty() ? NULL : &vInput[i][0];
+            vLen[i] = nLen;
+        }
+        std::vector<uint256> vHash(n);
+        SHA256DBatch(vHash[0].begin(), &vpInput[0], &vLen[0], n);
+        for (unsigned int i = 0; i < n; i++)
+            BOOST_CHECK_MESSAGE(vHash[i] == DoubleSHA(vInput[i]), strprintf("%u inputs, input %u of length %u", n, i, vLen[i]));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+BOOST_AUTO_TEST_CASE(sha256_engines)
+{
+    BOOST_TEST_MESSAGE(strprintf("SHA-256 engine: %s", SHA256Engine()));
+
+    for (size_t i = 0; SHA256EngineAvailable(i); i++)
+    {
+        const char* pszName = SHA256EngineAvailable(i);
+        BOOST_TEST_CHECKPOINT(pszName);
+        BOOST_CHECK(SHA256ForceEngine(pszName));
+        BOOST_CHECK_EQUAL(SHA256Engine(), pszName);
+        CheckTestVectors();
+        CheckD64();
+        CheckBatch();
+    }
+    SHA256ForceEngine(NULL);
+    BOOST_CHECK(!SHA256ForceEngine("none"));
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle_tree)
+{
+    for (unsigned int nTx = 1; nTx <= 20; nTx++)
+    {
+        CBlock block;
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            CTransaction tx;
+            tx.nTime = insecure_rand();
+            tx.vin.resize(1 + insecure_rand() % 3);
+            tx.vin[0].prevout.n = insecure_rand();
+            tx.vout.resize(1 + insecure_rand() % 3);
+            tx.vout[0].nValue = insecure_rand();
+            block.vtx.push_back(tx);
+        }
+
+        // The merkle tree as it was built one pair at a time
+        std::vector<uint256> vTree;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vTree.push_back(SerializeHash(tx));
+        int j = 0;
+        for (int nSize = nTx; nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            for (int i = 0; i < nSize; i += 2)
+            {
+                int i2 = std::min(i+1, nSize-1);
+                vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                                     BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+            }
+            j += nSize;
+        }
+
+        uint256 hashMerkleRoot = block.BuildMerkleTree();
+        BOOST_CHECK(hashMerkleRoot == vTree.back());
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            BOOST_CHECK(block.vtx[i].GetHash() == vTree[i]);
+            BOOST_CHECK(CBlock::CheckMerkleBranch(vTree[i], block.GetMerkleBranch(i), i) == hashMerkleRoot);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
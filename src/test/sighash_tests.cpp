@@ -0,0 +1,159 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+// SignatureHash() and CSignatureHashContext stream the transaction into the
+// hash instead of hashing a modified copy of it. The copying implementation
+// they replaced is kept here and both are checked against it on random
+// transactions, scripts and hash types.
+
+static uint256 SignatureHashOld(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Blank out other inputs' signatures
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+
+    // Blank out some of the outputs
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        unsigned int nOut = nIn;
+        if (nOut >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nOut+1);
+        for (unsigned int i = 0; i < nOut; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+
+    // Blank out other inputs completely
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return ss.GetHash();
+}
+
+static void RandomScript(CScript& script)
+{
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int ops = (insecure_rand() % 10);
+    for (int i = 0; i < ops; i++)
+        script << oplist[insecure_rand() % (sizeof(oplist)/sizeof(oplist[0]))];
+}
+
+static uint256 RandomHash()
+{
+    uint256 hash;
+    for (unsigned int i = 0; i < hash.size(); i++)
+        hash.begin()[i] = insecure_rand();
+    return hash;
+}
+
+static void RandomTransaction(CTransaction& tx, bool fSingle)
+{
+    tx.nVersion = insecure_rand();
+    tx.nTime = insecure_rand();
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = (insecure_rand() % 2) ? insecure_rand() : 0;
+    int ins = (insecure_rand() % 4) + 1;
+    int outs = fSingle ? ins : (insecure_rand() % 4) + 1;
+    for (int in = 0; in < ins; in++)
+    {
+        tx.vin.push_back(CTxIn());
+        CTxIn& txin = tx.vin.back();
+        txin.prevout.hash = RandomHash();
+        txin.prevout.n = insecure_rand() % 4;
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (insecure_rand() % 2) ? insecure_rand() : (unsigned int)-1;
+    }
+    for (int out = 0; out < outs; out++)
+    {
+        tx.vout.push_back(CTxOut());
+        CTxOut& txout = tx.vout.back();
+        txout.nValue = insecure_rand() % 100000000;
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_equivalence)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        int nHashType = insecure_rand();
+        CTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        unsigned int nIn = insecure_rand() % txTo.vin.size();
+
+        uint256 hashOld = SignatureHashOld(scriptCode, txTo, nIn, nHashType);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType) == hashOld);
+        CSignatureHashContext sighash(txTo);
+        BOOST_CHECK(sighash.SignatureHash(scriptCode, nIn, nHashType) == hashOld);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_every_input)
+{
+    // One context hashes every input of a transaction, as the wallet and
+    // ConnectInputs use it, including inputs SIGHASH_SINGLE has no output for
+    static const int vHashType[] = {
+        SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE,
+        SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY
+    };
+    for (int i = 0; i < 200; i++)
+    {
+        CTransaction txTo;
+        RandomTransaction(txTo, false);
+        CSignatureHashContext sighash(txTo);
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+        {
+            for (unsigned int j = 0; j < sizeof(vHashType)/sizeof(vHashType[0]); j++)
+            {
+                CScript scriptCode;
+                RandomScript(scriptCode);
+                uint256 hashOld = SignatureHashOld(scriptCode, txTo, nIn, vHashType[j]);
+                BOOST_CHECK(sighash.SignatureHash(scriptCode, nIn, vHashType[j]) == hashOld);
+                BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, vHashType[j]) == hashOld);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_out_of_range)
+{
+    CTransaction txTo;
+    RandomTransaction(txTo, false);
+    CSignatureHashContext sighash(txTo);
+    CScript scriptCode;
+    BOOST_CHECK(SignatureHash(scriptCode, txTo, txTo.vin.size(), SIGHASH_ALL) == 1);
+    BOOST_CHECK(sighash.SignatureHash(scriptCode, txTo.vin.size(), SIGHASH_ALL) == 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,11 +3,13 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <deque>
 #include <map>
 
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -26,11 +28,25 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Commits deferred during initial block download, keyed by serialized db key
+static CCriticalSection cs_deferred;
+static CLevelDBBatch::EntryMap mapDeferred;
+static size_t nDeferredBytes = 0;
+static size_t nDeferredBudget = 0;
+
+// Rough per-entry cost of mapDeferred on top of the key and value bytes
+static const size_t DEFERRED_ENTRY_OVERHEAD = 96;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 10);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    // -dbcache is a single budget: a quarter goes to the block cache, a
+    // quarter to the memtable and the rest to commits deferred during
+    // initial block download.
+    int64_t nCacheSize = std::min(std::max(GetArg("-dbcache", DEFAULT_DB_CACHE), (int64_t)4), (int64_t)4096) << 20;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize / 4);
+    options.write_buffer_size = nCacheSize / 4;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    nDeferredBudget = nCacheSize - nCacheSize / 4 * 2;
     return options;
 }
 
@@ -40,6 +56,7 @@ void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
 
     if (fRemoveOld) {
         filesystem::remove_all(directory); // remove directory
+        blockFileCache.Clear();
         unsigned int nFile = 1;
 
         while (true)
@@ -123,6 +140,7 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    FlushDeferred();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -136,14 +154,41 @@ void CTxDB::Close()
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = new CLevelDBBatch();
     return true;
 }
 
+static void DeferWrite(const std::string& key, bool fErase, const std::string& value)
+{
+    AssertLockHeld(cs_deferred);
+    std::pair<CLevelDBBatch::EntryMap::iterator, bool> ret = mapDeferred.insert(make_pair(key, CLevelDBBatch::Entry()));
+    CLevelDBBatch::Entry& write = ret.first->second;
+    if (ret.second)
+        nDeferredBytes += key.size() + DEFERRED_ENTRY_OVERHEAD;
+    else
+        nDeferredBytes -= write.strValue.size();
+    write.fErase = fErase;
+    write.strValue = value;
+    nDeferredBytes += value.size();
+}
+
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    if (fDeferDBCommits) {
+        bool fFull;
+        {
+            LOCK(cs_deferred);
+            const CLevelDBBatch::EntryMap& entries = activeBatch->GetEntries();
+            for (CLevelDBBatch::EntryMap::const_iterator it = entries.begin(); it != entries.end(); ++it)
+                DeferWrite(it->first, it->second.fErase, it->second.strValue);
+            delete activeBatch;
+            activeBatch = NULL;
+            fFull = nDeferredBytes >= nDeferredBudget;
+        }
+        return !fFull || FlushDeferred();
+    }
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch->Get());
     delete activeBatch;
     activeBatch = NULL;
     if (!status.ok()) {
@@ -153,75 +198,349 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+bool CTxDB::FlushDeferred()
+{
+    LOCK2(cs_main, cs_deferred);
+    if (mapDeferred.empty())
+        return true;
+    assert(txdb);
+
+    // Index entries must never point at block data that could still be lost
+    if (!SyncBlockFiles())
+        return error("CTxDB::FlushDeferred() : SyncBlockFiles failed");
+
+    int64_t nStart = GetTimeMillis();
+    leveldb::WriteBatch batch;
+    for (CLevelDBBatch::EntryMap::const_iterator it = mapDeferred.begin(); it != mapDeferred.end(); ++it) {
+        if (it->second.fErase)
+            batch.Delete(it->first);
+        else
+            batch.Put(it->first, it->second.strValue);
+    }
+    leveldb::WriteOptions syncOptions;
+    syncOptions.sync = true;
+    leveldb::Status status = txdb->Write(syncOptions, &batch);
+    if (!status.ok())
+        return error("CTxDB::FlushDeferred() : LevelDB write failure: %s", status.ToString());
+
+    LogPrint("db", "CTxDB::FlushDeferred() : wrote %u records (%u kB)  %dms\n",
+             mapDeferred.size(), nDeferredBytes >> 10, GetTimeMillis() - nStart);
+    mapDeferred.clear();
+    nDeferredBytes = 0;
+    return true;
+}
+
+bool CTxDB::PutDirect(const std::string &key, const std::string &value)
+{
+    {
+        LOCK(cs_deferred);
+        if (fDeferDBCommits || !mapDeferred.empty()) {
+            DeferWrite(key, false, value);
+            return true;
         }
     }
+    leveldb::Status status = pdb->Put(leveldb::WriteOptions(), key, value);
+    if (!status.ok()) {
+        LogPrintf("LevelDB write failure: %s\n", status.ToString());
+        return false;
+    }
+    return true;
+}
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+bool CTxDB::DeleteDirect(const std::string &key)
+{
+    {
+        LOCK(cs_deferred);
+        if (fDeferDBCommits || !mapDeferred.empty()) {
+            DeferWrite(key, true, std::string());
+            return true;
         }
     }
-};
+    leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), key);
+    return (status.ok() || status.IsNotFound());
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    if (activeBatch && activeBatch->Lookup(key.str(), value, deleted))
+        return true;
+
+    // Then the commits deferred during initial block download
+    LOCK(cs_deferred);
+    if (mapDeferred.empty())
+        return false;
+    CLevelDBBatch::EntryMap::const_iterator it = mapDeferred.find(key.str());
+    if (it == mapDeferred.end())
+        return false;
+    *deleted = it->second.fErase;
+    if (!*deleted)
+        *value = it->second.strValue;
+    return true;
+}
+
+bool CTxDB::WriteAddrIndex(uint160 addrHash, int nHeight, unsigned int nTxIndex, uint256 txHash)
+{
+    return Write(CAddrIndexKey(addrHash, nHeight, nTxIndex), txHash);
 }
 
-bool CTxDB::WriteAddrIndex(uint160 addrHash, uint256 txHash)
+bool CTxDB::EraseAddrIndex(uint160 addrHash, int nHeight, unsigned int nTxIndex)
 {
-    std::vector<uint256> txHashes;
-    if(!ReadAddrIndex(addrHash, txHashes))
+    return Erase(CAddrIndexKey(addrHash, nHeight, nTxIndex));
+}
+
+// Scans the address index range of addrHash in chain order. A negative nSkip
+// counts back from the newest entry, a negative nCount returns everything
+// after the skipped entries. Only committed records are visited, writes
+// pending in an active batch are not.
+bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes, int nSkip, int nCount)
+{
+    txHashes.clear();
+
+    CDataStream ssFirst(SER_DISK, CLIENT_VERSION);
+    ssFirst << CAddrIndexKey(addrHash, 0, 0);
+    string strPrefix = ssFirst.str().substr(0, ssFirst.size() - 8);
+    leveldb::Slice prefix(strPrefix);
+
+    // Iterators only see what is on disk
+    if (!FlushDeferred())
+        return false;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    if (nSkip >= 0)
     {
-	txHashes.push_back(txHash);
-        return Write(make_pair(string("adr"), addrHash), txHashes);
+        iterator->Seek(ssFirst.str());
+        for (; nSkip > 0 && iterator->Valid() && iterator->key().starts_with(prefix); nSkip--)
+            iterator->Next();
     }
     else
     {
-	if(std::find(txHashes.begin(), txHashes.end(), txHash) == txHashes.end()) 
-    	{
-    	    txHashes.push_back(txHash);
-            return Write(make_pair(string("adr"), addrHash), txHashes);
-	}
-	else
-	{
-	    return true; // already have this tx hash
-	}
+        // Position on the newest entry and step back from there
+        CDataStream ssLast(SER_DISK, CLIENT_VERSION);
+        ssLast << CAddrIndexKey(addrHash, std::numeric_limits<unsigned int>::max(), std::numeric_limits<unsigned int>::max());
+        iterator->Seek(ssLast.str());
+        if (!iterator->Valid())
+            iterator->SeekToLast();
+        else if (iterator->key().compare(ssLast.str()) > 0)
+            iterator->Prev();
+        for (int i = -1; i > nSkip && iterator->Valid() && iterator->key().starts_with(prefix); i--)
+            iterator->Prev();
+        // Fewer entries than requested, start at the oldest one
+        if (!iterator->Valid() || !iterator->key().starts_with(prefix))
+            iterator->Seek(ssFirst.str());
     }
+
+    for (; nCount != 0 && iterator->Valid() && iterator->key().starts_with(prefix); iterator->Next())
+    {
+        CDataStream ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(),
+                            SER_DISK, CLIENT_VERSION);
+        uint256 txHash;
+        ssValue >> txHash;
+        txHashes.push_back(txHash);
+        if (nCount > 0)
+            nCount--;
+    }
+    delete iterator;
+
+    return true;
 }
 
-bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+// An address index rebuild records the last block whose records are fully
+// committed, so an interrupted rebuild can pick up from there.
+bool CTxDB::ReadAddrIndexProgress(int& nHeight, uint256& hashBlock)
 {
-    return Read(make_pair(string("adr"), addrHash), txHashes);
+    pair<int, uint256> progress;
+    if (!Read(string("addrindexprogress"), progress))
+        return false;
+    nHeight = progress.first;
+    hashBlock = progress.second;
+    return true;
+}
+
+bool CTxDB::WriteAddrIndexProgress(int nHeight, uint256 hashBlock)
+{
+    return Write(string("addrindexprogress"), make_pair(nHeight, hashBlock));
+}
+
+bool CTxDB::EraseAddrIndexProgress()
+{
+    return Erase(string("addrindexprogress"));
+}
+
+// Reads up to nMax records of keyStart.addrHash, starting at keyStart and
+// ending at height nToHeight. When more records follow in that range, fMore
+// is set and keyNext holds the first one not returned.
+bool CTxDB::ReadAddrIndexRange(const CAddrIndexKey& keyStart, unsigned int nToHeight, unsigned int nMax,
+                               std::vector<std::pair<CAddrIndexKey, uint256> >& vEntries, CAddrIndexKey& keyNext, bool& fMore)
+{
+    vEntries.clear();
+    fMore = false;
+
+    CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+    ssStart << keyStart;
+    string strPrefix = ssStart.str().substr(0, ssStart.size() - 8);
+    leveldb::Slice prefix(strPrefix);
+
+    if (!FlushDeferred())
+        return false;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(ssStart.str()); iterator->Valid() && iterator->key().starts_with(prefix); iterator->Next())
+    {
+        CDataStream ssKey(iterator->key().data(), iterator->key().data() + iterator->key().size(),
+                          SER_DISK, CLIENT_VERSION);
+        CAddrIndexKey key;
+        ssKey >> key;
+        if (key.nHeight > nToHeight)
+            break;
+        if (vEntries.size() >= nMax)
+        {
+            keyNext = key;
+            fMore = true;
+            break;
+        }
+
+        CDataStream ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(),
+                            SER_DISK, CLIENT_VERSION);
+        uint256 txHash;
+        ssValue >> txHash;
+        vEntries.push_back(make_pair(key, txHash));
+    }
+    delete iterator;
+
+    return true;
+}
+
+// Address indexes written by older versions kept one ("adr", addrHash) record
+// holding the vector of all transaction hashes of the address. Convert them to
+// one CAddrIndexKey record per transaction, locating every transaction by the
+// best chain block it was connected in.
+bool CTxDB::MigrateAddrIndex()
+{
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("adr"), uint160(0));
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    iterator->Seek(ssStartKey.str());
+    if (!iterator->Valid() || !iterator->key().starts_with(ssStartKey.str().substr(0, 4)))
+    {
+        delete iterator;
+        return true;
+    }
+
+    LogPrintf("MigrateAddrIndex() : converting address index to per-transaction records\n");
+    int64_t nStart = GetTimeMillis();
+
+    // Block file positions of the best chain, so txindex positions can be
+    // mapped back to a height
+    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+        mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex;
+
+    // Transaction offsets of recently read blocks
+    map<CBlockIndex*, vector<unsigned int> > mapTxOffsets;
+
+    leveldb::WriteBatch batch;
+    unsigned int nPending = 0;
+    unsigned int nAddresses = 0;
+    unsigned int nConverted = 0;
+    unsigned int nDropped = 0;
+    while (iterator->Valid())
+    {
+        boost::this_thread::interruption_point();
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "adr")
+            break;
+        uint160 addrHash;
+        ssKey >> addrHash;
+
+        vector<uint256> txHashes;
+        CDataStream ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(),
+                            SER_DISK, CLIENT_VERSION);
+        ssValue >> txHashes;
+
+        BOOST_FOREACH(const uint256& txHash, txHashes)
+        {
+            CTxIndex txindex;
+            if (!ReadTxIndex(txHash, txindex))
+            {
+                nDropped++;
+                continue;
+            }
+            map<pair<unsigned int, unsigned int>, CBlockIndex*>::iterator mi = mapBlockPos.find(make_pair(txindex.pos.nFile, txindex.pos.nBlockPos));
+            if (mi == mapBlockPos.end())
+            {
+                nDropped++;
+                continue;
+            }
+            CBlockIndex* pindex = (*mi).second;
+
+            vector<unsigned int>& vOffsets = mapTxOffsets[pindex];
+            if (vOffsets.empty())
+            {
+                CBlock block;
+                if (!block.ReadFromDisk(pindex))
+                {
+                    mapTxOffsets.erase(pindex);
+                    nDropped++;
+                    continue;
+                }
+                // Same layout ConnectBlock uses to compute CDiskTxPos
+                unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+                BOOST_FOREACH(const CTransaction& tx, block.vtx)
+                {
+                    vOffsets.push_back(nTxPos);
+                    nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+                }
+            }
+            vector<unsigned int>::iterator it = lower_bound(vOffsets.begin(), vOffsets.end(), txindex.pos.nTxPos);
+            if (it == vOffsets.end() || *it != txindex.pos.nTxPos)
+            {
+                nDropped++;
+                continue;
+            }
+
+            CDataStream ssNewKey(SER_DISK, CLIENT_VERSION);
+            ssNewKey << CAddrIndexKey(addrHash, pindex->nHeight, it - vOffsets.begin());
+            CDataStream ssNewValue(SER_DISK, CLIENT_VERSION);
+            ssNewValue << txHash;
+            batch.Put(ssNewKey.str(), ssNewValue.str());
+            nPending++;
+            nConverted++;
+        }
+        batch.Delete(iterator->key());
+        nPending++;
+        nAddresses++;
+
+        if (mapTxOffsets.size() > 1000)
+            mapTxOffsets.clear();
+
+        if (nPending >= 10000)
+        {
+            leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+            {
+                delete iterator;
+                return error("MigrateAddrIndex() : batch commit failure: %s", status.ToString());
+            }
+            batch.Clear();
+            nPending = 0;
+        }
+
+        iterator->Next();
+    }
+    delete iterator;
+
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("MigrateAddrIndex() : batch commit failure: %s", status.ToString());
+
+    LogPrintf("MigrateAddrIndex() : converted %u addresses, %u records, dropped %u  %dms\n",
+              nAddresses, nConverted, nDropped, GetTimeMillis() - nStart);
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -310,21 +629,375 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     if (hash == 0)
         return NULL;
 
-    // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    // Return existing, or make room for a new one, in a single lookup
+    pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(hash, (CBlockIndex*)NULL));
+    if (!ret.second)
+        return ret.first->second;
 
     // Create new
     CBlockIndex* pindexNew = new CBlockIndex();
     if (!pindexNew)
         throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    ret.first->second = pindexNew;
+    pindexNew->phashBlock = &(ret.first->first);
 
     return pindexNew;
 }
 
+// Scans the block index out of LevelDB on its own thread and hands the
+// decoded entries over in batches, so that decoding and hashing overlap
+// with building mapBlockIndex
+class CBlockIndexReader
+{
+public:
+    typedef vector<pair<uint256, CDiskBlockIndex> > batch_type;
+
+private:
+    static const size_t BATCH_SIZE = 1024;
+    static const size_t MAX_QUEUED = 16;
+
+    leveldb::DB* pdb;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    deque<batch_type> queue;
+    bool fDone;
+    bool fStop;
+    bool fError;
+    boost::thread thread;
+
+    bool Push(batch_type& vBatch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && queue.size() >= MAX_QUEUED)
+            cond.wait(lock);
+        if (fStop)
+            return false;
+        queue.push_back(batch_type());
+        queue.back().swap(vBatch);
+        cond.notify_all();
+        return true;
+    }
+
+    void Run()
+    {
+        RenameThread("phc-loadindex");
+
+        // Keys are ("blockindex", hash); match the serialized string
+        // directly rather than decoding every key
+        static const char pchPrefix[] = "\x0a" "blockindex";
+        static const size_t nPrefixSize = sizeof(pchPrefix) - 1;
+
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << make_pair(string("blockindex"), uint256(0));
+        iterator->Seek(ssStartKey.str());
+
+        bool fOk = true;
+        try {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            batch_type vBatch;
+            vBatch.reserve(BATCH_SIZE);
+            for (; iterator->Valid(); iterator->Next())
+            {
+                leveldb::Slice key = iterator->key();
+                if (key.size() < nPrefixSize || memcmp(key.data(), pchPrefix, nPrefixSize) != 0)
+                    break;
+                leveldb::Slice value = iterator->value();
+                ssValue.clear();
+                ssValue.write(value.data(), value.size());
+                vBatch.push_back(make_pair(uint256(0), CDiskBlockIndex()));
+                ssValue >> vBatch.back().second;
+                vBatch.back().first = vBatch.back().second.GetBlockHash();
+                if (vBatch.size() == BATCH_SIZE)
+                {
+                    if (!Push(vBatch))
+                        break;
+                    vBatch.reserve(BATCH_SIZE);
+                }
+            }
+            if (!vBatch.empty())
+                Push(vBatch);
+        }
+        catch (std::exception &e) {
+            LogPrintf("LoadBlockIndex() : deserialize error reading block index: %s\n", e.what());
+            fOk = false;
+        }
+        delete iterator;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fDone = true;
+        fError = !fOk;
+        cond.notify_all();
+    }
+
+public:
+    CBlockIndexReader(leveldb::DB* pdbIn) : pdb(pdbIn), fDone(false), fStop(false), fError(false)
+    {
+        thread = boost::thread(boost::bind(&CBlockIndexReader::Run, this));
+    }
+
+    ~CBlockIndexReader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            cond.notify_all();
+        }
+        boost::this_thread::disable_interruption di;
+        thread.join();
+    }
+
+    // Take the next batch. Returns false when the scan is over, with
+    // Failed() telling whether it ended on an error.
+    bool Next(batch_type& vBatch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty() && !fDone)
+            cond.wait(lock);
+        if (queue.empty())
+            return false;
+        vBatch.swap(queue.front());
+        queue.pop_front();
+        cond.notify_all();
+        return true;
+    }
+
+    bool Failed()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fError;
+    }
+};
+
+// Sets pindex->nChainTrust to the trust of the block alone for
+// vpindex[nBegin], vpindex[nBegin+nStep], ...
+static void ComputeBlockTrust(const vector<CBlockIndex*>* pvpindex, size_t nBegin, size_t nStep)
+{
+    for (size_t i = nBegin; i < pvpindex->size(); i += nStep)
+        (*pvpindex)[i]->nChainTrust = (*pvpindex)[i]->GetBlockTrust();
+}
+
+// Checks of the -checkblocks pass at levels 2 to 6, which look at how the
+// block's transactions are recorded in the transaction index. Spends have to
+// be in blocks of the checked range no lower than this one; mapBlockPos maps
+// the positions of those blocks to their height.
+static bool CheckBlockTxIndex(CTxDB& txdb, int nCheckLevel, const CBlockIndex* pindex, const CBlock& block,
+                              const map<pair<unsigned int, unsigned int>, int>& mapBlockPos)
+{
+    bool fOk = true;
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        CTxIndex txindex;
+        if (txdb.ReadTxIndex(hashTx, txindex))
+        {
+            // check level 3: checker transaction hashes
+            if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+            {
+                // either an error or a duplicate transaction
+                CTransaction txFound;
+                if (!txFound.ReadFromDisk(txindex.pos))
+                {
+                    LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
+                    fOk = false;
+                }
+                else
+                    if (txFound.GetHash() != hashTx) // not a duplicate tx
+                    {
+                        LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
+                        fOk = false;
+                    }
+            }
+            // check level 4: check whether spent txouts were spent within the main chain
+            unsigned int nOutput = 0;
+            if (nCheckLevel>3)
+            {
+                BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                {
+                    if (!txpos.IsNull())
+                    {
+                        pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
+                        map<pair<unsigned int, unsigned int>, int>::const_iterator mi = mapBlockPos.find(posFind);
+                        if (mi == mapBlockPos.end() || mi->second < pindex->nHeight)
+                        {
+                            LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
+                            fOk = false;
+                        }
+                        // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                        if (nCheckLevel>5)
+                        {
+                            CTransaction txSpend;
+                            if (!txSpend.ReadFromDisk(txpos))
+                            {
+                                LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
+                                fOk = false;
+                            }
+                            else if (!txSpend.CheckTransaction())
+                            {
+                                LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
+                                fOk = false;
+                            }
+                            else
+                            {
+                                bool fFound = false;
+                                BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                    if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                        fFound = true;
+                                if (!fFound)
+                                {
+                                    LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
+                                    fOk = false;
+                                }
+                            }
+                        }
+                    }
+                    nOutput++;
+                }
+            }
+        }
+        // check level 5: check whether all prevouts are marked spent
+        if (nCheckLevel>4)
+        {
+             BOOST_FOREACH(const CTxIn &txin, tx.vin)
+             {
+                  CTxIndex txindex;
+                  if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                      if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                      {
+                          LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
+                          fOk = false;
+                      }
+             }
+        }
+    }
+    return fOk;
+}
+
+// Runs the -checkblocks pass over vpindex, highest block first. Worker
+// threads read the blocks ahead, a chunk at a time, and run the transaction
+// index checks, which only need the database. The calling thread takes the
+// blocks back in order for CheckBlock, which wants cs_main, so that the
+// outcome is the same as checking them one after another.
+class CBlockVerifier
+{
+private:
+    static const size_t CHUNK_SIZE = 8;
+    static const size_t WINDOW_SIZE = 256;
+
+    struct CJob
+    {
+        CBlock block;
+        bool fDone;
+        bool fRead;
+        bool fTxIndexOk;
+    };
+
+    CTxDB& txdb;
+    int nCheckLevel;
+    const vector<CBlockIndex*>& vpindex;
+    map<pair<unsigned int, unsigned int>, int> mapBlockPos;
+    vector<CJob> vJob;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    size_t nNext;
+    size_t nConsumed;
+    bool fStop;
+    boost::thread_group threads;
+
+    void Run()
+    {
+        while (true)
+        {
+            size_t nBegin, nEnd;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNext < vpindex.size() && nNext + CHUNK_SIZE > nConsumed + WINDOW_SIZE)
+                    condWorker.wait(lock);
+                if (fStop || nNext >= vpindex.size())
+                    return;
+                nBegin = nNext;
+                nEnd = std::min(nNext + CHUNK_SIZE, vpindex.size());
+                nNext = nEnd;
+            }
+
+            // Hash the proof-of-work headers of the chunk in one batch
+            vector<CBlock> vHeader;
+            for (size_t i = nBegin; i < nEnd; i++)
+                if (vpindex[i]->IsProofOfWork())
+                    vHeader.push_back(vpindex[i]->GetBlockHeader());
+            vector<const CBlock*> vpblock;
+            BOOST_FOREACH(const CBlock& header, vHeader)
+                vpblock.push_back(&header);
+            PrecomputePoWHashes(vpblock);
+
+            for (size_t i = nBegin; i < nEnd; i++)
+            {
+                CJob& job = vJob[i % WINDOW_SIZE];
+                job.block.SetNull();
+                job.fRead = job.block.ReadFromDisk(vpindex[i]);
+                job.fTxIndexOk = !job.fRead || nCheckLevel<=1 ||
+                                 CheckBlockTxIndex(txdb, nCheckLevel, vpindex[i], job.block, mapBlockPos);
+
+                boost::unique_lock<boost::mutex> lock(mutex);
+                job.fDone = true;
+                condMaster.notify_one();
+            }
+        }
+    }
+
+public:
+    CBlockVerifier(CTxDB& txdbIn, int nCheckLevelIn, const vector<CBlockIndex*>& vpindexIn, int nThreads)
+        : txdb(txdbIn), nCheckLevel(nCheckLevelIn), vpindex(vpindexIn), vJob(WINDOW_SIZE), nNext(0), nConsumed(0), fStop(false)
+    {
+        if (nCheckLevel>3)
+        {
+            BOOST_FOREACH(const CBlockIndex* pindex, vpindex)
+                mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
+        }
+        for (size_t i = 0; i < vJob.size(); i++)
+            vJob[i].fDone = false;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CBlockVerifier::Run, this));
+    }
+
+    ~CBlockVerifier()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condWorker.notify_all();
+        }
+        boost::this_thread::disable_interruption di;
+        threads.join_all();
+    }
+
+    // Wait for block i to be read and its transaction index checked, and
+    // return it for the remaining checks
+    CBlock& Get(size_t i, bool& fRead, bool& fTxIndexOk)
+    {
+        CJob& job = vJob[i % WINDOW_SIZE];
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!job.fDone)
+            condMaster.wait(lock);
+        fRead = job.fRead;
+        fTxIndexOk = job.fTxIndexOk;
+        return job.block;
+    }
+
+    // Done with block i; its slot can take a later block
+    void Release(size_t i)
+    {
+        CJob& job = vJob[i % WINDOW_SIZE];
+        job.block.SetNull();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        job.fDone = false;
+        nConsumed = i + 1;
+        condWorker.notify_all();
+    }
+};
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -335,76 +1008,83 @@ bool CTxDB::LoadBlockIndex()
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    int64_t nStart = GetTimeMillis();
+    unsigned int nEntries = 0;
+
+    // Size the hash table for the whole index up front instead of letting it
+    // rehash over and over while it fills. LevelDB can't count the records
+    // without reading them, but there is one per block of the best chain,
+    // plus the few of stale branches.
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
+        uint256 hashBest;
+        CDiskBlockIndex diskindexBest;
+        if (ReadHashBestChain(hashBest) && Read(make_pair(string("blockindex"), hashBest), diskindexBest))
+            mapBlockIndex.reserve(diskindexBest.nHeight + diskindexBest.nHeight / 16 + 1);
+    }
+
+    {
+        CBlockIndexReader reader(pdb);
+        CBlockIndexReader::batch_type vBatch;
+        while (reader.Next(vBatch))
+        {
+            boost::this_thread::interruption_point();
+            for (unsigned int i = 0; i < vBatch.size(); i++)
+            {
+                const uint256& blockHash = vBatch[i].first;
+                const CDiskBlockIndex& diskindex = vBatch[i].second;
+
+                // Construct block index object
+                CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+                pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+                pindexNew->nFile          = diskindex.nFile;
+                pindexNew->nBlockPos      = diskindex.nBlockPos;
+                pindexNew->nHeight        = diskindex.nHeight;
 #ifndef LOWMEM
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nLastReward    = diskindex.nLastReward;
+                pindexNew->nMint          = diskindex.nMint;
+                pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+                pindexNew->nLastReward    = diskindex.nLastReward;
 #endif
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+                pindexNew->nFlags         = diskindex.nFlags;
+                pindexNew->nStakeModifier = diskindex.nStakeModifier;
 #ifndef LOWMEM
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
+                pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
 #endif
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+                pindexNew->prevoutStake   = diskindex.prevoutStake;
+                pindexNew->nStakeTime     = diskindex.nStakeTime;
+                pindexNew->hashProof      = diskindex.hashProof;
+                pindexNew->nVersion       = diskindex.nVersion;
+                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+                pindexNew->nTime          = diskindex.nTime;
+                pindexNew->nBits          = diskindex.nBits;
+                pindexNew->nNonce         = diskindex.nNonce;
+
+                // Watch for genesis block
+                if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+                    pindexGenesisBlock = pindexNew;
+
+                if (!pindexNew->CheckIndex())
+                    return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+                // NovaCoin: build setStakeSeen
+                if (pindexNew->IsProofOfStake())
+                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            }
+            nEntries += vBatch.size();
+            vBatch.clear();
         }
-
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-        iterator->Next();
+        if (reader.Failed())
+            return error("LoadBlockIndex() : reading the block index failed");
     }
-    delete iterator;
+    LogPrintf("LoadBlockIndex(): read %u block index entries in %dms\n", nEntries, GetTimeMillis() - nStart);
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
+    // Calculate nChainTrust. The trust of each block on its own is a
+    // 256-bit division, so that part is spread over threads; adding it up
+    // along the chain goes in height order.
+    nStart = GetTimeMillis();
+    int nThreads = std::max(nScriptCheckThreads, 1);
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -413,11 +1093,23 @@ bool CTxDB::LoadBlockIndex()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    {
+        vector<CBlockIndex*> vpindex;
+        vpindex.reserve(vSortedByHeight.size());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+            vpindex.push_back(item.second);
+        boost::thread_group threads;
+        for (int i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(&ComputeBlockTrust, &vpindex, i, nThreads));
+        ComputeBlockTrust(&vpindex, 0, nThreads);
+        threads.join_all();
+    }
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->nChainTrust;
     }
+    LogPrintf("LoadBlockIndex(): computed chain trust in %dms using %d threads\n", GetTimeMillis() - nStart, nThreads);
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -429,6 +1121,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetBestChainByHeight(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -449,114 +1142,39 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    nStart = GetTimeMillis();
+    vector<CBlockIndex*> vpindexCheck;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
+        vpindexCheck.push_back(pindex);
+    }
+    CBlockIndex* pindexFork = NULL;
+    {
+        CBlockVerifier verifier(*this, nCheckLevel, vpindexCheck, nThreads);
+        for (size_t i = 0; i < vpindexCheck.size(); i++)
         {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            boost::this_thread::interruption_point();
+            CBlockIndex* pindex = vpindexCheck[i];
+            bool fRead, fTxIndexOk;
+            CBlock& block = verifier.Get(i, fRead, fTxIndexOk);
+            if (!fRead)
+                return error("LoadBlockIndex() : block.ReadFromDisk failed");
+            // check level 1: verify block validity
+            // check level 7: verify block signature too
+            if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
             {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
+                LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                pindexFork = pindex->pprev;
             }
+            // check levels 2 to 6 ran on the worker that read the block
+            if (!fTxIndexOk)
+                pindexFork = pindex->pprev;
+            verifier.Release(i);
         }
     }
+    LogPrintf("LoadBlockIndex(): verified %u blocks in %dms using %d threads\n", vpindexCheck.size(), GetTimeMillis() - nStart, nThreads);
     if (pindexFork)
     {
         boost::this_thread::interruption_point();
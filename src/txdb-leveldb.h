@@ -7,13 +7,70 @@
 #define BITCOIN_LEVELDB_H
 
 #include "main.h"
+#include "crypto/common.h"
+#include "leveldbbatch.h"
 
 #include <map>
 #include <string>
 #include <vector>
 
 #include <leveldb/db.h>
-#include <leveldb/write_batch.h>
+
+/** Key of an address index record. Every transaction touching an address gets
+ * its own ("adx", addrHash, nHeight, nTxIndex) record whose value is the
+ * transaction hash, so indexing a transaction is a blind put. Height and
+ * position are written big-endian so that LevelDB's bytewise ordering walks
+ * the history of one address in chain order.
+ */
+class CAddrIndexKey
+{
+public:
+    uint160 addrHash;
+    unsigned int nHeight;
+    unsigned int nTxIndex;
+
+    CAddrIndexKey()
+    {
+        addrHash = 0;
+        nHeight = 0;
+        nTxIndex = 0;
+    }
+
+    CAddrIndexKey(const uint160& addrHashIn, unsigned int nHeightIn, unsigned int nTxIndexIn)
+    {
+        addrHash = addrHashIn;
+        nHeight = nHeightIn;
+        nTxIndex = nTxIndexIn;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return ::GetSerializeSize(std::string("adx"), nType, nVersion) + addrHash.GetSerializeSize(nType, nVersion) + 8;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char pos[8];
+        WriteBE32(&pos[0], nHeight);
+        WriteBE32(&pos[4], nTxIndex);
+        ::Serialize(s, std::string("adx"), nType, nVersion);
+        addrHash.Serialize(s, nType, nVersion);
+        s.write((const char*)pos, sizeof(pos));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        std::string strType;
+        unsigned char pos[8];
+        ::Unserialize(s, strType, nType, nVersion);
+        addrHash.Unserialize(s, nType, nVersion);
+        s.read((char*)pos, sizeof(pos));
+        nHeight = ReadBE32(&pos[0]);
+        nTxIndex = ReadBE32(&pos[4]);
+    }
+};
 
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
@@ -45,17 +102,22 @@ private:
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    CLevelDBBatch *activeBatch;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
 protected:
-    // Returns true and sets (value,false) if activeBatch contains the given key
-    // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
+    // Returns true and sets (value,false) if activeBatch or the deferred
+    // commits contain the given key or leaves value alone and sets deleted =
+    // true if they contain a delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Writes/deletes outside of a batch; these join the deferred commits
+    // while there are any.
+    bool PutDirect(const std::string &key, const std::string &value);
+    bool DeleteDirect(const std::string &key);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -64,15 +126,12 @@ protected:
         ssKey << key;
         std::string strValue;
 
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to read disk.
+        bool deleted = false;
+        bool readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+        if (deleted) {
+            return false;
         }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
@@ -114,12 +173,7 @@ protected:
             activeBatch->Put(ssKey.str(), ssValue.str());
             return true;
         }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+        return PutDirect(ssKey.str(), ssValue.str());
     }
 
     template<typename K>
@@ -137,8 +191,7 @@ protected:
             activeBatch->Delete(ssKey.str());
             return true;
         }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return DeleteDirect(ssKey.str());
     }
 
     template<typename K>
@@ -149,14 +202,11 @@ protected:
         ssKey << key;
         std::string unused;
 
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
+        bool deleted;
+        if (ScanBatch(ssKey, &unused, &deleted)) {
+            return !deleted;
         }
 
-
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
     }
@@ -164,6 +214,8 @@ protected:
 
 public:
     bool TxnBegin();
+    // While fDeferDBCommits is set this folds the batch into the deferred
+    // commits, which are written once they outgrow their share of -dbcache.
     bool TxnCommit();
     bool TxnAbort()
     {
@@ -172,6 +224,11 @@ public:
         return true;
     }
 
+    // Sync the block files, then write the deferred commits to disk as one
+    // batch. The hashBestChain record in it marks the last block whose
+    // index updates are all on disk.
+    static bool FlushDeferred();
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -183,8 +240,15 @@ public:
         return Write(std::string("version"), nVersion);
     }
 
-    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes);
-    bool WriteAddrIndex(uint160 addrHash, uint256 txHash);
+    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes, int nSkip=0, int nCount=-1);
+    bool WriteAddrIndex(uint160 addrHash, int nHeight, unsigned int nTxIndex, uint256 txHash);
+    bool ReadAddrIndexRange(const CAddrIndexKey& keyStart, unsigned int nToHeight, unsigned int nMax,
+                            std::vector<std::pair<CAddrIndexKey, uint256> >& vEntries, CAddrIndexKey& keyNext, bool& fMore);
+    bool EraseAddrIndex(uint160 addrHash, int nHeight, unsigned int nTxIndex);
+    bool MigrateAddrIndex();
+    bool ReadAddrIndexProgress(int& nHeight, uint256& hashBlock);
+    bool WriteAddrIndexProgress(int nHeight, uint256 hashBlock);
+    bool EraseAddrIndexProgress();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -9,7 +9,43 @@
 
 using namespace std;
 
-CTxMemPool::CTxMemPool()
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nValueInIn, int64_t nValueInChainIn,
+                                 unsigned int nSigOpsIn, int64_t nTimeIn, double dPriorityIn, unsigned int nHeightIn)
+    : tx(txIn), nFee(nFeeIn), nValueIn(nValueInIn), nValueInChain(nValueInChainIn),
+      nSigOps(nSigOpsIn), nTime(nTimeIn), dPriority(dPriorityIn), nHeight(nHeightIn)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = RecursiveDynamicUsage(tx);
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nFeesWithDescendants = nFee;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry()
+    : nFee(0), nValueIn(0), nValueInChain(0), nTxSize(0), nSigOps(0), nTime(0), dPriority(0), nHeight(0),
+      nUsageSize(0), nCountWithDescendants(0), nSizeWithDescendants(0), nFeesWithDescendants(0)
+{
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    if (nCurrentHeight <= nHeight || nTxSize == 0)
+        return dPriority;
+    return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+}
+
+size_t RecursiveDynamicUsage(const CTransaction& tx)
+{
+    size_t nUsage = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += memusage::DynamicUsage(txin.scriptSig);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += memusage::DynamicUsage(txout.scriptPubKey);
+    return nUsage;
+}
+
+CTxMemPool::CTxMemPool() : nTransactionsUpdated(0), nTotalTxSize(0), nCachedInnerUsage(0),
+    dRollingMinimumFeeRate(0), nLastRollingFeeUpdate(0), fBlockSinceLastRollingFeeBump(false)
 {
 }
 
@@ -25,16 +61,66 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
+    if (mapTx.count(hash))
+        return false;
     {
-        mapTx[hash] = tx;
+        CTxMemPoolEntry& entryNew = mapTx[hash] = entry;
+        const CTransaction& tx = entryNew.GetTx();
+        TxLinks& links = mapLinks[hash];
+        const size_t nLinkUsage = memusage::IncrementalDynamicUsage(links.setParents);
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            mapNextTx[prevout] = CInPoint(&tx, i);
+            if (mapTx.count(prevout.hash) && links.setParents.insert(prevout.hash).second)
+            {
+                mapLinks[prevout.hash].setChildren.insert(hash);
+                nCachedInnerUsage += 2 * nLinkUsage;
+            }
+        }
+        // A transaction can come back to the pool after its spenders, when
+        // a block holding it is disconnected
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it != mapNextTx.end())
+            {
+                uint256 hashChild = it->second.ptx->GetHash();
+                if (links.setChildren.insert(hashChild).second)
+                {
+                    mapLinks[hashChild].setParents.insert(hash);
+                    nCachedInnerUsage += 2 * nLinkUsage;
+                }
+            }
+        }
+        setByFeeRate.insert(&entryNew);
+        nTotalTxSize += entryNew.GetTxSize();
+        nCachedInnerUsage += entryNew.GetDynamicUsage();
+
+        // Count it in everything it spends from. When its spenders were
+        // already here the packages it joins up have to be summed again.
+        entryNew.nCountWithDescendants = 1;
+        entryNew.nSizeWithDescendants = entryNew.GetTxSize();
+        entryNew.nFeesWithDescendants = entryNew.GetFee();
+        if (links.setChildren.empty())
+        {
+            setByDescendantScore.insert(&entryNew);
+            UpdateAncestors(hash, 1, entryNew.GetTxSize(), entryNew.GetFee());
+        }
+        else
+        {
+            RecalculateDescendantState(hash);
+            std::set<uint256> setAncestors;
+            CalculateAncestors(hash, setAncestors);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                RecalculateDescendantState(hashAncestor);
+        }
         nTransactionsUpdated++;
     }
     return true;
@@ -46,7 +132,8 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
@@ -57,7 +144,37 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             }
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+
+            // Take it out of the packages of everything it spends from.
+            // Spenders left behind, as when it is mined before them, no
+            // longer belong to those packages either.
+            const CTxMemPoolEntry& entry = mi->second;
+            std::set<uint256> setAncestors;
+            std::map<uint256, TxLinks>::iterator itLinks = mapLinks.find(hash);
+            bool fOrphansChildren = (itLinks != mapLinks.end() && !itLinks->second.setChildren.empty());
+            if (fOrphansChildren)
+                CalculateAncestors(hash, setAncestors);
+            else
+                UpdateAncestors(hash, -1, -(int64_t)entry.GetTxSize(), -entry.GetFee());
+
+            if (itLinks != mapLinks.end())
+            {
+                const size_t nLinkUsage = memusage::IncrementalDynamicUsage(itLinks->second.setParents);
+                BOOST_FOREACH(const uint256& hashParent, itLinks->second.setParents)
+                    mapLinks[hashParent].setChildren.erase(hash);
+                BOOST_FOREACH(const uint256& hashChild, itLinks->second.setChildren)
+                    mapLinks[hashChild].setParents.erase(hash);
+                nCachedInnerUsage -= 2 * nLinkUsage * (itLinks->second.setParents.size() + itLinks->second.setChildren.size());
+                mapLinks.erase(itLinks);
+            }
+            nTotalTxSize -= entry.GetTxSize();
+            nCachedInnerUsage -= entry.GetDynamicUsage();
+            setByFeeRate.erase(&entry);
+            setByDescendantScore.erase(&entry);
+            mapTx.erase(mi);
+
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                RecalculateDescendantState(hashAncestor);
             nTransactionsUpdated++;
         }
     }
@@ -79,9 +196,40 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+bool CTxMemPool::removeSpends(const CTransaction &tx)
+{
+    // Remove transactions which spend outputs of tx, recursively
+    LOCK(cs);
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+        if (it != mapNextTx.end())
+            remove(*it->second.ptx, true);
+    }
+    return true;
+}
+
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx)
+{
+    LOCK(cs);
+    // Whatever spent the same inputs can never be mined any more, and block
+    // assembly takes the pool as valid without looking at inputs again
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        remove(tx);
+        removeConflicts(tx);
+    }
+    fBlockSinceLastRollingFeeBump = true;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    setByFeeRate.clear();
+    setByDescendantScore.clear();
+    mapLinks.clear();
+    nTotalTxSize = 0;
+    nCachedInnerUsage = 0;
     mapTx.clear();
     mapNextTx.clear();
     ++nTransactionsUpdated;
@@ -93,15 +241,202 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    std::map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = i->second.GetTx();
     return true;
 }
+
+const CTxMemPool::TxLinks& CTxMemPool::GetLinks(const uint256& hash) const
+{
+    AssertLockHeld(cs);
+    static const TxLinks linksNone;
+    std::map<uint256, TxLinks>::const_iterator it = mapLinks.find(hash);
+    return it == mapLinks.end() ? linksNone : it->second;
+}
+
+void CTxMemPool::CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const
+{
+    std::vector<uint256> vTodo(1, hash);
+    while (!vTodo.empty())
+    {
+        uint256 hashNext = vTodo.back();
+        vTodo.pop_back();
+        BOOST_FOREACH(const uint256& hashParent, GetLinks(hashNext).setParents)
+            if (setAncestors.insert(hashParent).second)
+                vTodo.push_back(hashParent);
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    std::vector<uint256> vTodo(1, hash);
+    while (!vTodo.empty())
+    {
+        uint256 hashNext = vTodo.back();
+        vTodo.pop_back();
+        BOOST_FOREACH(const uint256& hashChild, GetLinks(hashNext).setChildren)
+            if (setDescendants.insert(hashChild).second)
+                vTodo.push_back(hashChild);
+    }
+}
+
+void CTxMemPool::UpdateAncestors(const uint256& hash, int64_t nCount, int64_t nSize, int64_t nFee)
+{
+    // An ancestor reached along several paths still counts hash once
+    std::set<uint256> setAncestors;
+    CalculateAncestors(hash, setAncestors);
+    BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+    {
+        CTxMemPoolEntry& entry = mapTx[hashAncestor];
+        setByDescendantScore.erase(&entry);
+        entry.nCountWithDescendants += nCount;
+        entry.nSizeWithDescendants += nSize;
+        entry.nFeesWithDescendants += nFee;
+        setByDescendantScore.insert(&entry);
+    }
+}
+
+void CTxMemPool::RecalculateDescendantState(const uint256& hash)
+{
+    CTxMemPoolEntry& entry = mapTx[hash];
+    std::set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+
+    setByDescendantScore.erase(&entry);
+    entry.nCountWithDescendants = 1;
+    entry.nSizeWithDescendants = entry.GetTxSize();
+    entry.nFeesWithDescendants = entry.GetFee();
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        const CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += descendant.GetTxSize();
+        entry.nFeesWithDescendants += descendant.GetFee();
+    }
+    setByDescendantScore.insert(&entry);
+}
+
+unsigned int CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    double dMaxEvictedFeeRate = 0;
+    while (!setByDescendantScore.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        const CTxMemPoolEntry* pentry = *setByDescendantScore.begin();
+        size_t nSizeBefore = mapTx.size();
+        double dFeeRate = pentry->GetDescendantScore() * 1000.0;
+        LogPrint("mempool", "TrimToSize : evicting %s and %u descendants (%.1f per kB)\n",
+            pentry->GetTx().GetHash().ToString(), pentry->GetCountWithDescendants() - 1, dFeeRate);
+        remove(pentry->GetTx(), true);
+        nEvicted += nSizeBefore - mapTx.size();
+        dMaxEvictedFeeRate = std::max(dMaxEvictedFeeRate, dFeeRate);
+    }
+
+    // What comes in next has to pay more than what just went out, by at
+    // least the relay fee, or the pool could be churned for nearly nothing
+    if (nEvicted > 0)
+    {
+        dRollingMinimumFeeRate = std::max(dRollingMinimumFeeRate, dMaxEvictedFeeRate + MIN_RELAY_TX_FEE);
+        nLastRollingFeeUpdate = GetTime();
+        fBlockSinceLastRollingFeeBump = false;
+    }
+    return nEvicted;
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, unsigned int nSize,
+                                    uint64_t nLimitAncestors, uint64_t nLimitAncestorSize,
+                                    uint64_t nLimitDescendants, uint64_t nLimitDescendantSize,
+                                    std::string& strReason) const
+{
+    LOCK(cs);
+    // Walk the ancestors tx would have, stopping as soon as a limit is hit,
+    // so that the walk itself stays as short as the limits
+    std::set<uint256> setAncestors;
+    std::vector<uint256> vTodo;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (mapTx.count(txin.prevout.hash) && setAncestors.insert(txin.prevout.hash).second)
+            vTodo.push_back(txin.prevout.hash);
+    uint64_t nSizeWithAncestors = nSize;
+    while (!vTodo.empty())
+    {
+        if (setAncestors.size() + 1 > nLimitAncestors)
+        {
+            strReason = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestors);
+            return false;
+        }
+
+        uint256 hash = vTodo.back();
+        vTodo.pop_back();
+        const CTxMemPoolEntry& entry = mapTx.find(hash)->second;
+        nSizeWithAncestors += entry.GetTxSize();
+        if (nSizeWithAncestors > nLimitAncestorSize)
+        {
+            strReason = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+            return false;
+        }
+        if (entry.GetCountWithDescendants() + 1 > nLimitDescendants)
+        {
+            strReason = strprintf("too many descendants for tx %s [limit: %u]", hash.ToString(), nLimitDescendants);
+            return false;
+        }
+        if (entry.GetSizeWithDescendants() + nSize > nLimitDescendantSize)
+        {
+            strReason = strprintf("exceeds descendant size limit for tx %s [limit: %u]", hash.ToString(), nLimitDescendantSize);
+            return false;
+        }
+
+        BOOST_FOREACH(const uint256& hashParent, GetLinks(hash).setParents)
+            if (setAncestors.insert(hashParent).second)
+                vTodo.push_back(hashParent);
+    }
+    if (setAncestors.size() + 1 > nLimitAncestors)
+    {
+        strReason = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestors);
+        return false;
+    }
+    return true;
+}
+
+int64_t CTxMemPool::GetMinFeeRate(size_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (!fBlockSinceLastRollingFeeBump || dRollingMinimumFeeRate == 0)
+        return (int64_t)dRollingMinimumFeeRate;
+
+    // Decay faster the emptier blocks have left the pool
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinimumFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return std::max((int64_t)dRollingMinimumFeeRate, MIN_RELAY_TX_FEE);
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) +
+           memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(setByFeeRate) +
+           memusage::DynamicUsage(setByDescendantScore) + nCachedInnerUsage;
+}
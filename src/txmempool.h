@@ -6,6 +6,74 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include "core.h"
+#include "main.h"
+#include "memusage.h"
+
+#include <set>
+
+/** A transaction in the memory pool, together with what block assembly
+ * needs to know about it. Everything here is worked out once, when the
+ * transaction is accepted and its inputs have been read anyway, so that
+ * building a block never has to go back to the disk.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    int64_t nFee;           // Fee paid, input value minus output value
+    int64_t nValueIn;       // Total input value
+    int64_t nValueInChain;  // Part of nValueIn spent from confirmed outputs
+    unsigned int nTxSize;   // Serialized size
+    unsigned int nSigOps;   // Legacy and P2SH sigops
+    int64_t nTime;          // Local time when entering the pool
+    double dPriority;       // Priority when entering the pool
+    unsigned int nHeight;   // Best chain height when entering the pool
+    size_t nUsageSize;      // Heap memory held by tx
+
+    // The entry together with its in-pool descendants, kept up to date by
+    // the pool as transactions come and go
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+    friend class CTxMemPool;
+
+public:
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nValueInIn, int64_t nValueInChainIn,
+                    unsigned int nSigOpsIn, int64_t nTimeIn, double dPriorityIn, unsigned int nHeightIn);
+    CTxMemPoolEntry();
+
+    const CTransaction& GetTx() const { return tx; }
+    int64_t GetFee() const { return nFee; }
+    int64_t GetValueIn() const { return nValueIn; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    int64_t GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+    size_t GetDynamicUsage() const { return nUsageSize; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    /** Priority as sum(valuein * age) / txsize once the chain is at
+        nCurrentHeight. Confirmed inputs keep aging while the transaction
+        waits, inputs from other pool transactions count for nothing. */
+    double GetPriority(unsigned int nCurrentHeight) const;
+
+    /** Fee per 1000 bytes, unrounded */
+    double GetFeePerKb() const { return (double)nFee * 1000.0 / nTxSize; }
+
+    /** What evicting this entry and its descendants saves per byte: the
+        better of its own fee rate and that of the whole package, so that
+        a low fee child goes before the parent it hangs from. */
+    double GetDescendantScore() const
+    {
+        return std::max((double)nFee / nTxSize, (double)nFeesWithDescendants / nSizeWithDescendants);
+    }
+};
+
+/** Heap memory held by a transaction's inputs, outputs and scripts */
+size_t RecursiveDynamicUsage(const CTransaction& tx);
 
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
@@ -16,27 +84,134 @@
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * Besides the transactions by hash, the pool keeps them ordered by fee
+ * rate, and links every transaction with the pool transactions it spends
+ * from and that spend from it, so that a block template is a walk down
+ * that order rather than a rebuild of the whole pool.
+ *
+ * The memory all of this takes is counted as it changes, and TrimToSize()
+ * keeps it under a limit by evicting the transactions, together with what
+ * spends from them, that pay the least for it. Keeping those packages up to
+ * date walks ancestors and descendants, which CheckPackageLimits() keeps
+ * few. After an eviction GetMinFeeRate() holds new transactions to a fee
+ * rate above what was evicted, so they can't just push each other out.
  */
 class CTxMemPool
 {
+public:
+    /** Orders pool transactions by fee rate, highest first, then by the
+        time they arrived, oldest first. */
+    struct CompareFeeRate
+    {
+        bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+        {
+            double fa = (double)a->GetFee() * b->GetTxSize();
+            double fb = (double)b->GetFee() * a->GetTxSize();
+            if (fa != fb)
+                return fa > fb;
+            if (a->GetTime() != b->GetTime())
+                return a->GetTime() < b->GetTime();
+            return a < b;
+        }
+    };
+    typedef std::set<const CTxMemPoolEntry*, CompareFeeRate> setEntriesByFeeRate;
+
+    /** Orders pool transactions for eviction, lowest descendant score
+        first, then the most recent first. */
+    struct CompareDescendantScore
+    {
+        bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+        {
+            double fa = a->GetDescendantScore();
+            double fb = b->GetDescendantScore();
+            if (fa != fb)
+                return fa < fb;
+            if (a->GetTime() != b->GetTime())
+                return a->GetTime() > b->GetTime();
+            return a < b;
+        }
+    };
+    typedef std::set<const CTxMemPoolEntry*, CompareDescendantScore> setEntriesByDescendantScore;
+
+    /** In-pool transactions an entry spends from and that spend from it */
+    struct TxLinks
+    {
+        std::set<uint256> setParents;
+        std::set<uint256> setChildren;
+    };
+
 private:
     unsigned int nTransactionsUpdated;
+    setEntriesByFeeRate setByFeeRate;
+    setEntriesByDescendantScore setByDescendantScore;
+    std::map<uint256, TxLinks> mapLinks;
+    uint64_t nTotalTxSize;     // Serialized size of all transactions
+    size_t nCachedInnerUsage;  // Heap memory of the entries and their links
+
+    // Fee per 1000 bytes a new transaction must pay since the last eviction,
+    // halved every ROLLING_FEE_HALFLIFE once a block has been connected
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+    mutable bool fBlockSinceLastRollingFeeBump;
+
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void UpdateAncestors(const uint256& hash, int64_t nCount, int64_t nSize, int64_t nFee);
+    void RecalculateDescendantState(const uint256& hash);
 
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
+    bool removeSpends(const CTransaction &tx);
+    /** Removes the transactions of a connected block, and with their
+        descendants those that spend the same inputs */
+    void removeForBlock(const std::vector<CTransaction>& vtx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    /** Evicts the lowest scoring transactions and their descendants until
+        the pool takes at most nSizeLimit bytes; returns how many went */
+    unsigned int TrimToSize(size_t nSizeLimit);
+
+    /** Whether tx, of nSize bytes, can join the pool without making an
+        unconfirmed chain longer or bigger than the limits (sizes in bytes);
+        strReason says which limit it hits */
+    bool CheckPackageLimits(const CTransaction& tx, unsigned int nSize,
+                            uint64_t nLimitAncestors, uint64_t nLimitAncestorSize,
+                            uint64_t nLimitDescendants, uint64_t nLimitDescendantSize,
+                            std::string& strReason) const;
+
+    /** Fee per 1000 bytes a new transaction must pay to get into a pool
+        kept below nSizeLimit bytes; 0 unless it had to evict lately */
+    int64_t GetMinFeeRate(size_t nSizeLimit) const;
+
+    /** Heap memory taken by the pool, its indexes and links */
+    size_t DynamicMemoryUsage() const;
+
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
+    /** Pool entries by fee rate; cs must be held while it is used */
+    const setEntriesByFeeRate& GetEntriesByFeeRate() const { return setByFeeRate; }
+
+    /** Parents and children of a pool transaction; cs must be held */
+    const TxLinks& GetLinks(const uint256& hash) const;
+
     unsigned long size() const
     {
         LOCK(cs);
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_UINT256_H
 #define BITCOIN_UINT256_H
 
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <stdint.h>
@@ -394,6 +395,7 @@ public:
     friend class uint160;
     friend class uint256;
     friend class uint512;
+    friend class arith_uint256;
     friend inline int Testuint256AdHoc(std::vector<std::string> vArg);
 };
 
@@ -635,6 +637,182 @@ inline const uint256 operator-(const uint256& a, const uint256& b)      { return
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// arith_uint256
+//
+
+/** 256-bit unsigned integer with the arithmetic that targets and chain
+ * trust need: compact encoding, multiplication by a 64-bit factor and
+ * division. Used by consensus code in place of CBigNum, so none of it
+ * touches the heap.
+ */
+class arith_uint256 : public base_uint256
+{
+public:
+    typedef base_uint256 basetype;
+
+    arith_uint256()
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    arith_uint256(const basetype& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = b.pn[i];
+    }
+
+    arith_uint256& operator=(const basetype& b)
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = b.pn[i];
+        return *this;
+    }
+
+    arith_uint256(uint64_t b)
+    {
+        pn[0] = (unsigned int)b;
+        pn[1] = (unsigned int)(b >> 32);
+        for (int i = 2; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    arith_uint256& operator=(uint64_t b)
+    {
+        pn[0] = (unsigned int)b;
+        pn[1] = (unsigned int)(b >> 32);
+        for (int i = 2; i < WIDTH; i++)
+            pn[i] = 0;
+        return *this;
+    }
+
+    /** Position of the highest set bit plus one, 0 for zero */
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                    if (pn[pos] & (1U << nbits))
+                        return 32 * pos + nbits + 1;
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    /** Multiply by b. If the product does not fit, keeps its low 256 bits
+     *  and returns false. */
+    bool MulU64(uint64_t b)
+    {
+        unsigned int r[WIDTH + 2];
+        for (int i = 0; i < WIDTH + 2; i++)
+            r[i] = 0;
+        for (int j = 0; j < 2; j++)
+        {
+            uint64_t bj = (unsigned int)(b >> (32 * j));
+            uint64_t carry = 0;
+            for (int i = 0; i < WIDTH; i++)
+            {
+                uint64_t n = carry + r[i + j] + pn[i] * bj;
+                r[i + j] = (unsigned int)n;
+                carry = n >> 32;
+            }
+            r[WIDTH + j] = (unsigned int)carry;
+        }
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = r[i];
+        return r[WIDTH] == 0 && r[WIDTH + 1] == 0;
+    }
+
+    arith_uint256& operator/=(const basetype& b)
+    {
+        arith_uint256 div = b;
+        arith_uint256 num = *this;
+        *this = 0;
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0)
+            throw std::runtime_error("arith_uint256::operator/= : division by zero");
+        if (div_bits > num_bits)
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift; // shift so that div and num align
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31)); // set a bit of the result
+            }
+            div >>= 1; // shift back
+            shift--;
+        }
+        return *this;
+    }
+
+    /**
+     * Set from the compact form used for nBits: the top byte is a size in
+     * bytes and the low 23 bits are the leading digits, with bit 23 as the
+     * sign. Decodes the same magnitude as CBigNum::SetCompact, reporting
+     * through pfNegative and pfOverflow what a 256-bit unsigned value can't
+     * hold. On overflow the value is the magnitude modulo 2**256.
+     */
+    arith_uint256& SetCompact(unsigned int nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    /** Compact form of this value, as CBigNum::GetCompact gives it */
+    unsigned int GetCompact() const
+    {
+        int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3)
+            nCompact = Get64() << 8 * (3 - nSize);
+        else
+        {
+            arith_uint256 bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = bn.Get64();
+        }
+        // The 0x00800000 bit denotes the sign, so if it is already set,
+        // divide the mantissa by 256 and increase the exponent
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        return nCompact;
+    }
+};
+
+inline const arith_uint256 operator/(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) /= b; }
+
+
+
 
 
 